@@ -9,6 +9,10 @@ std::string_view get_arg(int argc, const char *argv[], std::string_view argname,
   return it[1];
 }
 
+bool has_arg(int argc, const char *argv[], std::string_view argname) {
+  return std::any_of(argv, argv + argc, [argname](const char *p) { return std::strcmp(p, argname.data()) == 0; });
+}
+
 int main(int argc, const char *argv[]) {
   std::string_view source_path = get_arg(argc, argv, argv[0], "/tmp/file.asm");
   std::string_view target_asm = get_arg(argc, argv, "-oasm", "/tmp/file.asm");
@@ -16,11 +20,21 @@ int main(int argc, const char *argv[]) {
   std::string_view target = get_arg(argc, argv, "-o", "/tmp/file.exe");
   std::string_view
       lib_object_file = get_arg(argc, argv, "-lib", "/home/luke/CLionProjects/compilers/bml/lib/rt/rt_fast.o");
+  std::string_view spill_report = get_arg(argc, argv, "-spill-report", "");
+  std::string_view inline_budget = get_arg(argc, argv, "-inline-budget", "");
+  std::string_view eval_fuel = get_arg(argc, argv, "-eval-fuel", "");
+  std::string_view fused_words = get_arg(argc, argv, "-fused-words", "");
+  const bool profile = has_arg(argc, argv, "-profile"); // link with a runtime built with ALLOC_PROFILE
   std::string source = util::load_file(source_path);
   std::ofstream oasm;
   oasm.open(target_asm.data());
+  std::ofstream oreport;
+  if (!spill_report.empty())oreport.open(spill_report.data());
   try {
-    build_ir(source, oasm, source_path);
+    build_ir(source, oasm, source_path, spill_report.empty() ? nullptr : &oreport,
+             inline_budget.empty() ? ast::inliner::default_budget : std::stoul(std::string(inline_budget)),
+             eval_fuel.empty() ? ast::evaluator::default_fuel : std::stoul(std::string(eval_fuel)),
+             fused_words.empty() ? 0 : std::stoul(std::string(fused_words)), profile);
   } catch (const std::exception &) {
     return 1;
   }
@@ -1,5 +1,9 @@
 #include <ast/ast.h>
 #include <util/sexp.h>
+#include <functional>
+#include <optional>
+#include <bit>
+#include <sstream>
 
 namespace ast {
 
@@ -24,6 +28,44 @@ capture_set join_capture_set(capture_set &&c1, capture_set &&c2) {
   return c1;
 }
 
+// calls visit on the owning pointer of every direct subexpression of e
+template<typename Fun>
+void for_each_subexpression(expression::t &e, const Fun &visit) {
+  using namespace expression;
+  if (auto *a = dynamic_cast<fun_app *>(&e)) {
+    visit(a->f), visit(a->x);
+  } else if (auto *d = dynamic_cast<destroy *>(&e)) {
+    visit(d->obj), visit(d->d);
+  } else if (auto *i = dynamic_cast<if_then_else *>(&e)) {
+    visit(i->condition), visit(i->true_branch), visit(i->false_branch);
+  } else if (auto *c = dynamic_cast<constructor *>(&e)) {
+    if (c->arg)visit(c->arg);
+  } else if (auto *s = dynamic_cast<seq *>(&e)) {
+    visit(s->a), visit(s->b);
+  } else if (auto *m = dynamic_cast<match_with *>(&e)) {
+    visit(m->what);
+    for (auto &b : m->branches)visit(b.result);
+  } else if (auto *t = dynamic_cast<tuple *>(&e)) {
+    for (auto &p : t->args)visit(p);
+  } else if (auto *l = dynamic_cast<let_in *>(&e)) {
+    for (auto &d : l->d->defs)visit(d.e);
+    visit(l->e);
+  } else if (auto *f = dynamic_cast<expression::fun *>(&e)) {
+    visit(f->body);
+  } else {
+    assert(dynamic_cast<identifier *>(&e) || dynamic_cast<expression::literal *>(&e));
+  }
+}
+
+// for the identifiers at the head of an application in e, the most args they are applied to
+void count_applied_args(expression::t &e, std::unordered_map<const expression::identifier *, size_t> &applied) {
+  size_t n = 0;
+  expression::t *head = &e;
+  for (; auto *app = dynamic_cast<expression::fun_app *>(head); head = app->f.get())++n;
+  if (auto *id = dynamic_cast<expression::identifier *>(head); id && n)applied[id] = std::max(applied[id], n);
+  for_each_subexpression(e, [&applied](expression::ptr &c) { count_applied_args(*c, applied); });
+}
+
 #define Tag_Tuple  0
 #define Tag_Fun 1
 #define Tag_Arg 2
@@ -32,10 +74,159 @@ capture_set join_capture_set(capture_set &&c1, capture_set &&c2) {
 uintptr_t uint_to_v(uint64_t x) {
   return (uintptr_t) ((x << 1) | 1);
 }
-uint64_t make_tag_size_d(uint32_t tag, uint32_t size, uint8_t d) {
-  return (((uint64_t) tag) << 32) | (((uint64_t) size) << 1) | (d & 1);
+using ir::make_header;
+using ir::header_words;
+
 }
 
+namespace {
+ir::lang::destroy_class_t ir_destroy_class_of_def(const ::type::function::t *def) {
+  using namespace ::type::function;
+  using namespace ir::lang;
+  if (def == nullptr)return value; // polymorphic
+  for (const primitive *p : {&tf_int, &tf_bool, &tf_char, &tf_unit, &tf_time, &tf_file})
+    if (def == p)return unboxed;
+  if (def == &tf_string || def == &tf_fun || dynamic_cast<const tf_tuple_t *>(def))return boxed;
+  if (const auto *v = dynamic_cast<const variant *>(def)) {
+    // constructors with args are blocks, the others are immediates
+    const bool some_block = std::any_of(v->constructors.begin(), v->constructors.end(), [](const auto &c) {
+      return !c.args.empty();
+    });
+    const bool some_immediate = std::any_of(v->constructors.begin(), v->constructors.end(), [](const auto &c) {
+      return c.args.empty();
+    });
+    if (!some_block)return unboxed;
+    if (!some_immediate)return boxed;
+  }
+  return value;
+}
+
+// identifies a type up to its type variables, which all stand for any value; type functions are told apart by address,
+// as a type definition can shadow another one with the same name
+std::string type_key(const ::type::arena &arena, ::type::arena::idx_t id) {
+  const auto &b = arena.boss(id);
+  if (b.def == nullptr)return "'";
+  std::ostringstream key;
+  key << b.def->name << '@' << static_cast<const void *>(b.def) << '(';
+  for (auto a : b.args)key << type_key(arena, a) << ',';
+  key << ')';
+  return key.str();
+}
+}
+
+ir::lang::destroy_class_t ir_destroy_class_of_type(const ::type::arena &arena, ::type::arena::idx_t id) {
+  return ir_destroy_class_of_def(arena.boss(id).def);
+}
+
+// r11 holds the block, whose refcount dropped to 0, rax is saved as it's the only other register used
+std::string_view destructors::of_type(::type::arena &arena, ::type::arena::idx_t id, size_t depth) {
+  using namespace ir::lang;
+  const auto *v = dynamic_cast<const ::type::function::variant *>(arena.boss(id).def);
+  if (!enabled || !v || depth > max_depth || ir_destroy_class_of_type(arena, id) == unboxed)return {};
+  const std::string key = type_key(arena, id);
+  auto[it, fresh] = names.try_emplace(key, "__destroy_" + std::to_string(names.size()) + "__");
+  const std::string &name = it->second;
+  if (!fresh)return name;
+  const std::vector<::type::arena::idx_t> params = arena.boss(id).args;
+  std::vector<const ::type::function::variant::constr *> blocks;
+  for (const auto &c : v->constructors)if (!c.args.empty())blocks.push_back(&c);
+
+  std::ostringstream os;
+  auto t = arena.to_typeexpr(id);
+  t.poly_normalize();
+  os << name << ": ; destructor of " << t << "\n";
+  os << "cmp qword [lazy_free_budget], 0\n";
+  os << "jne destroy_nontrivial_preserving\n";
+  os << "push rax\n";
+  os << name << ".next:\n";
+  os << "test byte [r11+4], 1 ; with a destructor\n";
+  os << "jnz " << name << ".generic\n";
+  if (blocks.size() > 1) {
+    os << "movzx eax, word [r11+6]\n";
+    for (size_t k = 0; k + 1 < blocks.size(); ++k) {
+      os << "cmp eax, " << blocks[k]->tag_id << "\n";
+      os << "je " << name << ".c" << k << "\n";
+    }
+    os << "jmp " << name << ".c" << blocks.size() - 1 << "\n"; // the only tag left
+  }
+  //rax := the field, dropped; jumps to skip unless it was the last reference to a block
+  auto drop = [&os](destroy_class_t dc, std::string_view skip) {
+    if (dc & unboxed) {
+      os << "test al, 1\n";
+      os << "jnz " << skip << "\n";
+    }
+    if (dc & destroy_class_t::global) {
+      os << "cmp dword [rax], 0\n";
+      os << "je " << skip << "\n";
+    }
+    os << "sub dword [rax], 2\n";
+    os << "cmp dword [rax], 1\n";
+    os << "jne " << skip << "\n";
+  };
+  for (size_t k = 0; k < blocks.size(); ++k) {
+    const size_t n = blocks[k]->args.size(), words = header_words + n;
+    os << name << ".c" << k << ": ; " << blocks[k]->name << "\n";
+    if (words > ir::fast_malloc_max_words) {
+      os << "jmp " << name << ".generic\n";
+      continue;
+    }
+    std::vector<::type::arena::idx_t> fields;
+    for (const auto &a : blocks[k]->args)fields.push_back(arena.type_with_args(a, params));
+    for (size_t i = 0; i + 1 < n; ++i) {
+      const destroy_class_t dc = ir_destroy_class_of_type(arena, fields[i]);
+      if (!(dc & non_trivial))continue;
+      const std::string skip = name + ".f" + std::to_string(k) + "_" + std::to_string(i);
+      os << "mov rax, qword [r11+" << (header_words + i) * 8 << "]\n";
+      drop(dc, skip);
+      os << "push r11\n";
+      os << "mov r11, rax\n";
+      os << "call destroy_nontrivial_preserving\n";
+      os << "pop r11\n";
+      os << skip << ":\n";
+    }
+    //the block goes back to its free list, the last field is still readable
+    os << "mov rax, qword [fast_malloc_free_list+" << words * 8 << "]\n";
+    os << "mov qword [r11], rax\n";
+    os << "mov qword [fast_malloc_free_list+" << words * 8 << "], r11\n";
+    os << "add qword [fast_malloc_freed+" << words * 8 << "], 1\n";
+    const destroy_class_t dc = ir_destroy_class_of_type(arena, fields[n - 1]);
+    if (!(dc & non_trivial)) {
+      os << "jmp " << name << ".done\n";
+      continue;
+    }
+    os << "mov rax, qword [r11+" << (header_words + n - 1) * 8 << "]\n";
+    drop(dc, name + ".done");
+    os << "mov r11, rax\n";
+    if (type_key(arena, fields[n - 1]) == key) {
+      os << "jmp " << name << ".next\n";
+    } else {
+      const std::string_view d = of_type(arena, fields[n - 1], depth + 1);
+      os << "pop rax\n";
+      os << "jmp " << (d.empty() ? "destroy_nontrivial_preserving" : d) << "\n";
+    }
+  }
+  os << name << ".done:\n";
+  os << "pop rax\n";
+  os << "ret\n";
+  os << name << ".generic:\n";
+  os << "pop rax\n";
+  os << "jmp destroy_nontrivial_preserving\n";
+  code.push_back(os.str());
+  return name;
+}
+
+void destructors::emit(std::ostream &text) const {
+  for (const auto &c : code)text << c;
+}
+
+void ir_annotate_destroy_classes(tc_section tcs, destructors &ds) {
+  for (const auto&[m, id] : tcs.local)
+    ir::lang::var(m->ir_var).mark(ir_destroy_class_of_type(tcs.arena, id)).mark_destructor(ds.of_type(tcs.arena, id));
+  for (const auto&[e, id] : tcs.typed) {
+    e->ir_destroy_class = ir_destroy_class_of_type(tcs.arena, id);
+    e->ir_destructor = ds.of_type(tcs.arena, id);
+  }
+  tcs.typed.clear();
 }
 
 namespace expression {
@@ -197,6 +388,7 @@ capture_set identifier::capture_group() {
   }
   if (!definition_point)THROW_INTERNAL_ERROR
   if (definition_point->top_level) return {};
+  if (const auto *f = definition_point->ir_lifted)return {f->captures.begin(), f->captures.end()}; // passed to its calls
   return {definition_point};
 }
 capture_set literal::capture_group() { return {}; }
@@ -227,6 +419,7 @@ capture_set match_with::capture_group() {
   return cs;
 }
 capture_set let_in::capture_group() {
+  if (!d->rec)d->ir_lift_functions(*e);
   return d->capture_group(e->capture_group());
 }
 capture_set fun::capture_group() {
@@ -237,9 +430,127 @@ capture_set fun::capture_group() {
   return std::move(cs);
 }
 
+namespace {
+// a block that e builds with no destructor, i.e. if it's a constructor with args or a tuple: its header and the
+// expressions of its fields, and where its allocation site is (the name of a constructor, which has no loc of its own)
+struct block_shape {
+  uint64_t header;
+  std::vector<expression::t *> fields;
+  std::string_view loc, kind;
+};
+std::optional<block_shape> block_shape_of(expression::t &e) {
+  if (auto *t = dynamic_cast<tuple *>(&e)) {
+    block_shape b{.header = make_header(Tag_Tuple, t->args.size(), 0), .loc = t->loc, .kind = "tuple"};
+    for (auto &a : t->args)b.fields.push_back(a.get());
+    return b;
+  }
+  auto *c = dynamic_cast<constructor *>(&e);
+  if (!c || !c->arg)return {};
+  const size_t n_args = c->definition_point->args.size();
+  block_shape b{.header = make_header(c->definition_point->tag_id, n_args, 0), .loc = c->name, .kind = c->name};
+  if (n_args == 1) {
+    b.fields.push_back(c->arg.get());
+  } else {
+    auto *t = dynamic_cast<tuple *>(c->arg.get());
+    assert(t);
+    for (auto &a : t->args)b.fields.push_back(a.get());
+  }
+  return b;
+}
+
+//Allocation fusion: the blocks of a tree of constructors and tuples nested in one another are carved out of a single
+//malloc, laid out in preorder up to s.fused_words, and the fields that aren't blocks are computed in the same
+//order as before. Each block keeps its own header and is freed on its own, into the free list of its size. A tuple at
+//the root is left out of the region, so that it can still be returned in registers or put in the frame. Returns
+//nothing if there are less than two blocks to fuse.
+std::optional<ir::lang::var> ir_compile_fused(expression::t &root, ir_sections_t s) {
+  using namespace ir::lang;
+  struct node {
+    block_shape shape;
+    size_t offset;
+    std::vector<std::optional<size_t>> children; // the node of each field, if it's a block of the region
+  };
+  std::vector<node> nodes;
+  size_t words = 0;
+  // larger ones come from libc, which can't free them piece by piece
+  const size_t max_words = std::min(s.fused_words, ir::fast_malloc_max_words);
+  //the nodes of the fields of a block, in preorder; empty for the fields that are left out
+  std::function<std::optional<size_t>(expression::t &)> place = [&](expression::t &e) -> std::optional<size_t> {
+    auto shape = block_shape_of(e);
+    if (!shape || words + header_words + shape->fields.size() > max_words)return {};
+    const size_t k = nodes.size();
+    nodes.push_back(node{.shape = std::move(*shape), .offset = words});
+    words += header_words + nodes[k].shape.fields.size();
+    for (size_t i = 0; i < nodes[k].shape.fields.size(); ++i) {
+      auto child = place(*nodes[k].shape.fields[i]);
+      nodes[k].children.push_back(child);
+    }
+    return k;
+  };
+  auto root_shape = block_shape_of(root);
+  assert(root_shape);
+  const bool root_in_region = !dynamic_cast<tuple *>(&root);
+  std::vector<std::optional<size_t>> root_children;
+  if (root_in_region)place(root);
+  else for (auto *f : root_shape->fields)root_children.push_back(place(*f));
+  if (nodes.size() < 2)return {};
+
+  //the fields that aren't blocks of the region, in the order they were computed before
+  std::vector<std::vector<std::optional<var>>> leaves(nodes.size());
+  std::vector<std::optional<var>> root_leaves;
+  std::function<void(size_t)> compile_leaves = [&](size_t k) {
+    for (size_t i = 0; i < nodes[k].shape.fields.size(); ++i)
+      if (nodes[k].children[i])compile_leaves(*nodes[k].children[i]), leaves[k].emplace_back();
+      else leaves[k].push_back(nodes[k].shape.fields[i]->ir_compile(s));
+  };
+  if (root_in_region)compile_leaves(0);
+  else
+    for (size_t i = 0; i < root_shape->fields.size(); ++i)
+      if (root_children[i])compile_leaves(*root_children[i]), root_leaves.emplace_back();
+      else root_leaves.push_back(root_shape->fields[i]->ir_compile(s));
+
+  const size_t base_size = header_words + nodes[0].shape.fields.size();
+  std::vector<size_t> carved;
+  for (size_t k = 1; k < nodes.size(); ++k)carved.push_back(header_words + nodes[k].shape.fields.size());
+  auto site = [&](const block_shape &b) {
+    return s.alloc_site(b.loc, b.kind, ir::header_tag(b.header), header_words + b.fields.size());
+  };
+  std::vector<var> blocks{s.main.declare_assign(rhs_expr::malloc{
+      .size = base_size, .carved = std::move(carved), .site = site(nodes[0].shape)})};
+  for (size_t k = 1; k < nodes.size(); ++k)
+    blocks.push_back(s.main.declare_assign(rhs_expr::malloc{
+        .size = header_words + nodes[k].shape.fields.size(), .carved_from = blocks[0], .carved_at = nodes[k].offset,
+        .site = site(nodes[k].shape)}));
+  //in postorder, so that a block is complete before it's moved into its parent
+  std::function<void(size_t)> write = [&](size_t k) {
+    for (const auto &c : nodes[k].children)if (c)write(*c);
+    s.main.push_back(instruction::write_uninitialized_mem{.base = blocks[k], .block_offset = 0, .src = s.main.declare_constant(
+        nodes[k].shape.header)});
+    for (size_t i = 0; i < nodes[k].shape.fields.size(); ++i)
+      s.main.push_back(instruction::write_uninitialized_mem{.base = blocks[k], .block_offset = header_words + i,
+          .src = nodes[k].children[i] ? blocks[*nodes[k].children[i]] : *leaves[k][i]});
+  };
+  if (root_in_region) {
+    write(0);
+    return blocks[0];
+  }
+  for (const auto &c : root_children)if (c)write(*c);
+  var block = s.main.declare_assign(rhs_expr::malloc{.size = header_words + root_shape->fields.size(),
+      .site = site(*root_shape)});
+  s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 0, .src = s.main.declare_constant(
+      root_shape->header)});
+  for (size_t i = 0; i < root_shape->fields.size(); ++i)
+    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = header_words + i,
+        .src = root_children[i] ? blocks[*root_children[i]] : *root_leaves[i]});
+  return block;
+}
+}
+
 ir::lang::var identifier::ir_compile(ir_sections_t s) {
   if (definition_point->top_level) {
-    return definition_point->ir_evaluate_global(s.main);
+    ir::lang::var v = definition_point->ir_evaluate_global(s.main);
+    if (v.destroy_class() & ir_destroy_class)v.mark(v.destroy_class() & ir_destroy_class);
+    return v.mark_destructor(ir_destructor);
   } else {
     return definition_point->ir_var;
   }
@@ -251,30 +562,30 @@ ir::lang::var constructor::ir_compile(ir_sections_t s) {
   using namespace ir::lang;
   assert(definition_point->tag_id >= 51);
   assert(definition_point->tag_id & 1);
+  assert(definition_point->tag_id <= ir::header_max_tag);
   if (!arg) {
     assert(definition_point->args.empty());
     return s.main.declare_constant(definition_point->tag_id);
   }
+  if (auto fused = ir_compile_fused(*this, s))return *fused;
   const size_t n_args = definition_point->args.size();
   if (n_args == 1) {
     var content = arg->ir_compile(s);
-    var block = s.main.declare_assign(rhs_expr::malloc{.size=3});
+    var block = s.main.declare_assign(rhs_expr::malloc{.size=header_words + 1,
+        .site = s.alloc_site(name, name, definition_point->tag_id, header_words + 1)});
     s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 0, .src = s.main.declare_constant(
-        3)});
-    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 1, .src = s.main.declare_constant(
-        make_tag_size_d(definition_point->tag_id, 1, 0))});
-    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 2, .src = content});
+        make_header(definition_point->tag_id, 1, 0))});
+    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = header_words, .src = content});
     return block;
   } else {
     auto *t = dynamic_cast<tuple *>(arg.get());
     assert(t);
-    var block = s.main.declare_assign(rhs_expr::malloc{.size=2 + n_args});
+    var block = s.main.declare_assign(rhs_expr::malloc{.size=header_words + n_args,
+        .site = s.alloc_site(name, name, definition_point->tag_id, header_words + n_args)});
     s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 0, .src = s.main.declare_constant(
-        3)});
-    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 1, .src = s.main.declare_constant(
-        make_tag_size_d(definition_point->tag_id, n_args, 0))});
+        make_header(definition_point->tag_id, n_args, 0))});
     for (size_t i = 0; i < n_args; ++i)
-      s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 2
+      s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = header_words
           + i, .src = t->args.at(i)->ir_compile(s)});
     return block;
   }
@@ -289,107 +600,345 @@ ir::lang::var constructor::ir_compile_with_destructor(ir_sections_t s, ir::lang:
   const size_t n_args = definition_point->args.size();
   if (n_args == 1) {
     var content = arg->ir_compile(s);
-    var block = s.main.declare_assign(rhs_expr::malloc{.size=3 + 1});
+    var block = s.main.declare_assign(rhs_expr::malloc{.size=header_words + 1 + 1,
+        .site = s.alloc_site(name, name, definition_point->tag_id, header_words + 1 + 1)});
     s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 0, .src = s.main.declare_constant(
-        3)});
-    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 1, .src = s.main.declare_constant(
-        make_tag_size_d(definition_point->tag_id, 1, 1))});
-    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 2, .src = content});
-    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 3, .src = d});
+        make_header(definition_point->tag_id, 1, 1))});
+    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = header_words, .src = content});
+    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = header_words + 1, .src = d});
     return block;
   } else {
     auto *t = dynamic_cast<tuple *>(arg.get());
     assert(t);
-    var block = s.main.declare_assign(rhs_expr::malloc{.size=2 + n_args + 1});
+    var block = s.main.declare_assign(rhs_expr::malloc{.size=header_words + n_args + 1,
+        .site = s.alloc_site(name, name, definition_point->tag_id, header_words + n_args + 1)});
     s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 0, .src = s.main.declare_constant(
-        3)});
-    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 1, .src = s.main.declare_constant(
-        make_tag_size_d(definition_point->tag_id, n_args, 1))});
+        make_header(definition_point->tag_id, n_args, 1))});
     for (size_t i = 0; i < n_args; ++i)
-      s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 2
+      s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = header_words
           + i, .src = t->args.at(i)->ir_compile(s)});
-    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = 2 + n_args, .src = d});
+    s.main.push_back(instruction::write_uninitialized_mem{.base = block, .block_offset = header_words + n_args, .src = d});
     return block;
   }
 }
+namespace {
+//A saturated application of a comparison operator. Tagging preserves the order of ints, so it is a single cmp of the
+//tagged words, whose flags are either jumped upon or turned into a bool by a setcc.
+struct comparison {
+  ir::lang::rhs_expr::binary_op::ops op;
+  expression::t *lhs, *rhs;
+  bool int_operands; // false for physical (in)equality, whose operands might be boxed
+};
+//f x with f a builtin operator (e.g. __unary_op__MINUS__)
+std::optional<std::pair<std::string_view, expression::t *>> as_unary_app(expression::t *e) {
+  auto *app = dynamic_cast<fun_app *>(e);
+  if (!app)return {};
+  auto *id = dynamic_cast<identifier *>(app->f.get());
+  if (!id)return {};
+  return std::make_pair(id->name, app->x.get());
+}
+//f lhs rhs with f a builtin operator (e.g. __binary_op__PLUS__)
+struct binary_app {
+  std::string_view name;
+  expression::t *lhs, *rhs;
+};
+std::optional<binary_app> as_binary_app(expression::t *e) {
+  auto *app = dynamic_cast<fun_app *>(e);
+  if (!app)return {};
+  auto *fa = dynamic_cast<fun_app *>(app->f.get());
+  if (!fa)return {};
+  auto *id = dynamic_cast<identifier *>(fa->f.get());
+  if (!id)return {};
+  return binary_app{id->name, fa->x.get(), app->x.get()};
+}
+std::optional<comparison> as_comparison(expression::t *e) {
+  using ops = ir::lang::rhs_expr::binary_op::ops;
+  auto app = as_binary_app(e);
+  if (!app)return {};
+  auto make = [&](ops op, bool int_operands) { return comparison{op, app->lhs, app->rhs, int_operands}; };
+  const std::string_view name = app->name;
+  if (name == "__binary_op__EQUAL__")return make(ops::sete, true);
+  if (name == "__binary_op__NOT_EQUAL__")return make(ops::setne, true);
+  if (name == "__binary_op__LESS_THAN__")return make(ops::setl, true);
+  if (name == "__binary_op__LESS_EQUAL_THAN__")return make(ops::setle, true);
+  if (name == "__binary_op__GREATER_THAN__")return make(ops::setg, true);
+  if (name == "__binary_op__GREATER_EQUAL_THAN__")return make(ops::setge, true);
+  if (name == "__binary_op__PHYS_EQUAL__")return make(ops::sete, false);
+  if (name == "__binary_op__NOT_PHYS_EQUAL__")return make(ops::setne, false);
+  return {};
+}
+//the jump taken when the comparison holds
+ir::lang::ternary::jmp_instr jump_of(ir::lang::rhs_expr::binary_op::ops op) {
+  using namespace ir::lang;
+  switch (op) {
+    case rhs_expr::binary_op::sete:return ternary::je;
+    case rhs_expr::binary_op::setne:return ternary::jne;
+    case rhs_expr::binary_op::setl:return ternary::jl;
+    case rhs_expr::binary_op::setle:return ternary::jle;
+    case rhs_expr::binary_op::setg:return ternary::jg;
+    case rhs_expr::binary_op::setge:return ternary::jge;
+    case rhs_expr::binary_op::setb:return ternary::jb;
+    case rhs_expr::binary_op::setbe:return ternary::jbe;
+    case rhs_expr::binary_op::seta:return ternary::ja;
+    case rhs_expr::binary_op::setae:return ternary::jae;
+    default:THROW_INTERNAL_ERROR
+  }
+}
+std::pair<ir::lang::var, ir::lang::var> compile_operands(const comparison &cmp, ir_sections_t s) {
+  ir::lang::var a = cmp.lhs->ir_compile(s);
+  ir::lang::var b = cmp.rhs->ir_compile(s);
+  if (cmp.int_operands) {
+    a.mark(ir::lang::trivial);
+    b.mark(ir::lang::trivial);
+  }
+  return {a, b};
+}
+//an int literal, possibly negated
+std::optional<int64_t> int_constant(expression::t *e) {
+  if (auto *l = dynamic_cast<literal *>(e))
+    if (auto *i = dynamic_cast<ast::literal::integer *>(l->value.get()))return i->value;
+  if (auto app = as_unary_app(e); app && app->first == "__unary_op__MINUS__")
+    if (auto k = int_constant(app->second))return -*k;
+  return {};
+}
+//Integer arithmetic. Tagged words are added and subtracted as they are (a+b is a_v+b_v-1, a-b is a_v-b_v+1) and
+//multiplied by a constant k as a_v*k-(k-1); the other products and the quotients work on untagged ints, which stay
+//untagged up the chain and get retagged once at its root. Constants fold into the instructions, and division by a
+//constant is a multiplication by its reciprocal, or shifts for powers of 2 (Hacker's Delight, chapter 10).
+//Division by a variable is left to the runtime.
+class arithmetic_compiler {
+ public:
+  explicit arithmetic_compiler(ir_sections_t s) : s(s) {}
+  static bool handles(expression::t *e) {
+    if (auto app = as_unary_app(e))return app->first == "__unary_op__MINUS__" || app->first == "__unary_op__PLUS__";
+    auto app = as_binary_app(e);
+    if (!app)return false;
+    if (app->name == "__binary_op__SLASH__") {
+      auto d = int_constant(app->rhs);
+      return d && *d != 0;
+    }
+    return app->name == "__binary_op__PLUS__" || app->name == "__binary_op__MINUS__"
+        || app->name == "__binary_op__STAR__";
+  }
+  ir::lang::var compile(expression::t *e) { return tagged(compile(e, true)); }
+ private:
+  typedef ir::lang::rhs_expr::binary_op::ops ops;
+  struct operand {
+    std::optional<int64_t> constant;
+    std::optional<ir::lang::var> v; // unless constant
+    bool is_tagged = true;
+  };
+  ir_sections_t s;
+
+  static operand constant(int64_t k) { return operand{.constant = k}; }
+  static operand tagged_var(ir::lang::var v) { return operand{.v = v, .is_tagged = true}; }
+  static operand untagged_var(ir::lang::var v) { return operand{.v = v, .is_tagged = false}; }
+  static bool is_untagged(const operand &o) { return !o.constant && !o.is_tagged; }
+
+  ir::lang::var imm(int64_t k) { return s.main.declare_constant(uint64_t(k)).mark(ir::lang::trivial); }
+  ir::lang::var op(ops o, ir::lang::var x1, ir::lang::var x2) {
+    return s.main.declare_assign(ir::lang::rhs_expr::binary_op{.op = o, .x1 = x1, .x2 = x2}).mark(ir::lang::trivial);
+  }
+  ir::lang::var op(ir::lang::rhs_expr::unary_op::ops o, ir::lang::var x) {
+    return s.main.declare_assign(ir::lang::rhs_expr::unary_op{.op = o, .x = x}).mark(ir::lang::trivial);
+  }
+  ir::lang::var tagged(const operand &o) {
+    if (o.constant)return imm(int64_t((uint64_t(*o.constant) << 1) | 1));
+    return o.is_tagged ? *o.v : op(ir::lang::rhs_expr::unary_op::int_to_v, *o.v);
+  }
+  ir::lang::var untagged(const operand &o) {
+    if (o.constant)return imm(*o.constant);
+    return o.is_tagged ? op(ir::lang::rhs_expr::unary_op::v_to_int, *o.v) : *o.v;
+  }
+
+  operand compile(expression::t *e, bool prefer_tagged) {
+    if (auto k = int_constant(e))return constant(*k);
+    if (!handles(e))return tagged_var(e->ir_compile(s).mark(ir::lang::trivial));
+    if (auto app = as_unary_app(e)) {
+      operand x = compile(app->second, prefer_tagged);
+      return app->first == "__unary_op__MINUS__" ? neg(x) : x;
+    }
+    auto app = as_binary_app(e).value();
+    if (app.name == "__binary_op__SLASH__")return div(compile(app.lhs, false), int_constant(app.rhs).value());
+    const bool is_product = app.name == "__binary_op__STAR__";
+    operand a = compile(app.lhs, prefer_tagged && !is_product);
+    operand b = compile(app.rhs, prefer_tagged && !is_product);
+    if (app.name == "__binary_op__PLUS__")return add(a, b);
+    if (app.name == "__binary_op__MINUS__")return sub(a, b);
+    return mul(a, b, prefer_tagged);
+  }
+
+  operand add(operand a, operand b) {
+    if (a.constant && b.constant)return constant(int64_t(uint64_t(*a.constant) + uint64_t(*b.constant)));
+    if (a.constant)std::swap(a, b);
+    if (is_untagged(a) || is_untagged(b))return untagged_var(op(ops::add, untagged(a), untagged(b)));
+    if (b.constant)return tagged_var(op(ops::add, *a.v, imm(int64_t(uint64_t(*b.constant) << 1))));
+    return tagged_var(op(ops::sub, op(ops::add, *a.v, *b.v), imm(1)));
+  }
+  operand sub(operand a, operand b) {
+    if (a.constant && b.constant)return constant(int64_t(uint64_t(*a.constant) - uint64_t(*b.constant)));
+    if (is_untagged(a) || is_untagged(b))return untagged_var(op(ops::sub, untagged(a), untagged(b)));
+    if (b.constant)return tagged_var(op(ops::add, *a.v, imm(-int64_t(uint64_t(*b.constant) << 1))));
+    if (a.constant)return tagged_var(op(ops::sub, imm(int64_t((uint64_t(*a.constant) << 1) + 2)), *b.v));
+    return tagged_var(op(ops::add, op(ops::sub, *a.v, *b.v), imm(1)));
+  }
+  operand neg(const operand &a) {
+    if (a.constant)return constant(int64_t(-uint64_t(*a.constant)));
+    if (!a.is_tagged)return untagged_var(op(ops::sub, imm(0), *a.v));
+    return tagged_var(op(ir::lang::rhs_expr::unary_op::neg, *a.v)); // neg works on tagged ints
+  }
+  // x*k, with sal for powers of 2
+  ir::lang::var times(ir::lang::var x, int64_t k) {
+    if (k > 0 && std::has_single_bit(uint64_t(k)))return op(ops::sal, x, imm(std::countr_zero(uint64_t(k))));
+    return op(ops::imul, x, imm(k));
+  }
+  operand mul(operand a, operand b, bool prefer_tagged) {
+    if (a.constant && b.constant)return constant(int64_t(uint64_t(*a.constant) * uint64_t(*b.constant)));
+    if (a.constant)std::swap(a, b);
+    if (b.constant) {
+      const int64_t k = *b.constant;
+      if (k == 0)return constant(0);
+      if (k == 1)return a;
+      if (!a.is_tagged)return untagged_var(times(*a.v, k));
+      return tagged_var(op(ops::sub, times(*a.v, k), imm(k - 1)));
+    }
+    if (is_untagged(a) || is_untagged(b) || !prefer_tagged)
+      return untagged_var(op(ops::imul, untagged(a), untagged(b)));
+    // (a_v-1)*b+1 = 2ab+1, a single untag
+    ir::lang::var p = op(ops::imul, op(ops::sub, *a.v, imm(1)), untagged(b));
+    return tagged_var(op(ops::add, p, imm(1)));
+  }
+  operand div(const operand &a, int64_t d) {
+    if (a.constant)return constant(*a.constant / d);
+    if (d == 1)return a;
+    if (d == -1)return neg(a);
+    const ir::lang::var x = untagged(a);
+    const uint64_t abs_d = d < 0 ? -uint64_t(d) : uint64_t(d);
+    ir::lang::var q = x;
+    if (std::has_single_bit(abs_d)) {
+      // round towards 0: negative dividends get biased by |d|-1 before the arithmetic shift
+      const int k = std::countr_zero(abs_d);
+      ir::lang::var bias = op(ops::shr, op(ops::sar, x, imm(63)), imm(64 - k));
+      q = op(ops::sar, op(ops::add, x, bias), imm(k));
+    } else {
+      auto[magic, shift] = signed_magic(abs_d);
+      q = op(ops::imulh, x, imm(magic));
+      if (magic < 0)q = op(ops::add, q, x);
+      if (shift)q = op(ops::sar, q, imm(shift));
+      q = op(ops::add, q, op(ops::shr, x, imm(63))); // +1 for negative dividends
+    }
+    operand result = untagged_var(q);
+    return d < 0 ? neg(result) : result;
+  }
+  // the multiplier and the shift for the signed division by d>=2 (Hacker's Delight, figure 10-1)
+  static std::pair<int64_t, int> signed_magic(uint64_t d) {
+    constexpr uint64_t two63 = uint64_t(1) << 63;
+    const uint64_t anc = two63 - 1 - two63 % d;
+    int p = 63;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / d, r2 = two63 - q2 * d;
+    uint64_t delta;
+    do {
+      ++p;
+      q1 *= 2, r1 *= 2;
+      if (r1 >= anc)++q1, r1 -= anc;
+      q2 *= 2, r2 *= 2;
+      if (r2 >= d)++q2, r2 -= d;
+      delta = d - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    return {int64_t(q2 + 1), p - 64};
+  }
+};
+}
 ir::lang::var if_then_else::ir_compile(ir_sections_t s) {
   using namespace ir::lang;
-  s.main.push_back(instruction::cmp_vars{.v1 = condition->ir_compile(s), .v2 = s.main.declare_constant(2), .op=instruction::cmp_vars::test});
+  ternary::jmp_instr to_false_branch;
+  if (auto cmp = as_comparison(condition.get())) {
+    //fused compare and branch, no bool in between
+    auto [a, b] = compile_operands(*cmp, s);
+    s.main.push_back(instruction::cmp_vars{.v1 = a, .v2 = b, .op=instruction::cmp_vars::cmp});
+    to_false_branch = ternary::negate(jump_of(cmp->op));
+  } else {
+    s.main.push_back(instruction::cmp_vars{.v1 = condition->ir_compile(s), .v2 = s.main.declare_constant(2), .op=instruction::cmp_vars::test});
+    to_false_branch = ternary::jz;
+  }
   scope true_scope, false_scope;
   true_scope.ret = true_branch->ir_compile(s.with_main(true_scope));
   false_scope.ret = false_branch->ir_compile(s.with_main(false_scope));
-  return s.main.declare_assign(std::make_unique<ternary>(ternary{.cond = ternary::jmp_instr::jz, .nojmp_branch = std::move(
+  return s.main.declare_assign(std::make_unique<ternary>(ternary{.cond = to_false_branch, .nojmp_branch = std::move(
       true_scope), .jmp_branch = std::move(false_scope)}));
 }
 ir::lang::var tuple::ir_compile(ir_sections_t s) {
   using namespace ir::lang;
-  var block = s.main.declare_assign(rhs_expr::malloc{.size=2 + args.size()});
-  s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=0, .src=s.main.declare_constant(3)});
-  s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=1, .src=s.main.declare_constant(
-      make_tag_size_d(Tag_Tuple, args.size(), 0))});
+  if (auto fused = ir_compile_fused(*this, s))return *fused;
+  var block = s.main.declare_assign(rhs_expr::malloc{.size=header_words + args.size(),
+      .site = s.alloc_site(loc, "tuple", Tag_Tuple, header_words + args.size())});
+  s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=0, .src=s.main.declare_constant(
+      make_header(Tag_Tuple, args.size(), 0))});
   for (size_t i = 0; i < args.size(); ++i) {
-    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=2 + i, .src=args.at(i)->ir_compile(
-        s)});
+    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=header_words + i, .src=args.at(
+        i)->ir_compile(s)});
   }
   return block;
 }
 ir::lang::var tuple::ir_compile_with_destructor(ir_sections_t s, ir::lang::var d) {
   using namespace ir::lang;
-  var block = s.main.declare_assign(rhs_expr::malloc{.size=2 + args.size() + 1});
-  s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=0, .src=s.main.declare_constant(3)});
-  s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=1, .src=s.main.declare_constant(
-      make_tag_size_d(Tag_Tuple, args.size(), 1))});
+  var block = s.main.declare_assign(rhs_expr::malloc{.size=header_words + args.size() + 1,
+      .site = s.alloc_site(loc, "tuple", Tag_Tuple, header_words + args.size() + 1)});
+  s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=0, .src=s.main.declare_constant(
+      make_header(Tag_Tuple, args.size(), 1))});
   for (size_t i = 0; i < args.size(); ++i) {
-    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=2 + i, .src=args.at(i)->ir_compile(
-        s)});
+    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=header_words + i, .src=args.at(
+        i)->ir_compile(s)});
   }
-  s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=2 + args.size(), .src=d});
+  s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=header_words + args.size(), .src=d});
   return block;
 }
 ir::lang::var fun_app::ir_compile(ir_sections_t s) {
   using namespace ir::lang;
 
-  //optimize for arithmetic
-  if (auto *unary_f = dynamic_cast<identifier *>(this->f.get()); unary_f && unary_f->name.starts_with("__unary_op__")) {
-    //unary
-    if (unary_f->name == "__unary_op__PLUS__")return x->ir_compile(s).mark(trivial);
-    if (unary_f->name == "__unary_op__MINUS__")
-      return s.main.declare_assign(rhs_expr::unary_op{
-          .op=rhs_expr::unary_op::neg, .x =  x->ir_compile(s).mark(trivial)}).mark(trivial);
+  if (arithmetic_compiler::handles(this))return arithmetic_compiler(s).compile(this);
+  if (auto app = as_unary_app(this); app && app->first.starts_with("__unary_op__"))
     THROW_INTERNAL_ERROR // no other unary operators
-  }
 
-  //TODO: support all arithmetic
-  if (auto *fa = dynamic_cast<fun_app *>(f.get()); fa)
-    if (auto *binary_f = dynamic_cast<identifier *>(fa->f.get()); binary_f
-        && util::is_in<std::string_view>(binary_f->name,
-                                         {"__binary_op__PLUS__", "__binary_op__MINUS__", "__binary_op__STAR__"})) {
-      //binary op
-      //TODO-someday: addition and subtraction might require a single rather than three ops
-      var a_v = fa->x->ir_compile(s).mark(trivial);
-      var a = s.main.declare_assign(rhs_expr::unary_op{.op = rhs_expr::unary_op::v_to_int, .x = a_v}).mark(trivial);
-
-      var b_v = x->ir_compile(s).mark(trivial);
-      var b = s.main.declare_assign(rhs_expr::unary_op{.op = rhs_expr::unary_op::v_to_int, .x = b_v}).mark(trivial);
-
-      auto with_unary = [&](rhs_expr::binary_op::ops o) {
-        var a_op_b = s.main.declare_assign(rhs_expr::binary_op{.op = o, .x1 = a, .x2 = b}).mark(trivial);
-        var a_op_b_v =
-            s.main.declare_assign(rhs_expr::unary_op{.op = rhs_expr::unary_op::int_to_v, .x = a_op_b}).mark(trivial);
-        return a_op_b_v;
-      };
-      if (binary_f->name == "__binary_op__PLUS__")return with_unary(rhs_expr::binary_op::add);
-      if (binary_f->name == "__binary_op__MINUS__")return with_unary(rhs_expr::binary_op::sub);
-      if (binary_f->name == "__binary_op__STAR__")return with_unary(rhs_expr::binary_op::imul);
-      //TODO: add others
-      THROW_INTERNAL_ERROR
+  if (auto cmp = as_comparison(this)) {
+    auto [a, b] = compile_operands(*cmp, s);
+    return s.main.declare_assign(rhs_expr::binary_op{.op = cmp->op, .x1 = a, .x2 = b}).mark(trivial);
+  }
 
+  //saturated call of a toplevel or lifted function: call it directly, applying any leftover arg to the result
+  {
+    std::vector<expression::t *> app_args = {x.get()};
+    std::vector<const fun_app *> spine = {this}; // spine[i] is the application of the first i+1 args
+    expression::t *head = f.get();
+    while (auto *fa = dynamic_cast<fun_app *>(head)) {
+      app_args.push_back(fa->x.get());
+      spine.push_back(fa);
+      head = fa->f.get();
+    }
+    std::reverse(app_args.begin(), app_args.end());
+    std::reverse(spine.begin(), spine.end());
+    if (auto *id = dynamic_cast<identifier *>(head); id && !id->definition_point->ir_direct_text_ptr.empty()
+        && app_args.size() >= id->definition_point->ir_direct_n_args) {
+      const size_t n_args = id->definition_point->ir_direct_n_args;
+      std::vector<var> vs;
+      for (size_t i = 0; i < n_args; ++i)vs.push_back(app_args.at(i)->ir_compile(s));
+      if (const auto *f = id->definition_point->ir_lifted)
+        for (const auto *c : f->captures)vs.push_back(c->ir_var);
+      var result = s.main.declare_assign(rhs_expr::call_direct{.name = id->definition_point->ir_direct_text_ptr, .args = std::move(vs)});
+      result.mark(spine.at(n_args - 1)->ir_destroy_class).mark_destructor(spine.at(n_args - 1)->ir_destructor);
+      for (size_t i = n_args; i < app_args.size(); ++i) {
+        result = s.main.declare_assign(rhs_expr::apply_fn{.f = result, .x = app_args.at(i)->ir_compile(s)});
+        result.mark(spine.at(i)->ir_destroy_class).mark_destructor(spine.at(i)->ir_destructor);
+      }
+      return result;
     }
+  }
 
   //trivial case, a normal function
   var vf = f->ir_compile(s);
   var vx = x->ir_compile(s);
-  return s.main.declare_assign(rhs_expr::apply_fn{.f = vf, .x = vx});
+  return s.main.declare_assign(rhs_expr::apply_fn{.f = vf, .x = vx}).mark(ir_destroy_class).mark_destructor(ir_destructor);
 }
 ir::lang::var destroy::ir_compile(ir_sections_t s) {
   if (auto *t = dynamic_cast<tuple *>(  obj.get());t) {
@@ -404,35 +953,274 @@ ir::lang::var seq::ir_compile(ir_sections_t s) {
   a->ir_compile(s);
   return b->ir_compile(s);
 }
+namespace {
+//Matches are compiled to decision trees: the branches are the rows of a matrix of patterns, whose columns are the parts
+//of the matched value still to be looked at. When the first row has only wildcards left, its branch is taken.
+//Otherwise the first column it refutes is switched upon, and every row goes on in the cases its pattern there agrees
+//with: each tag or literal is loaded and tested at most once on every path. A dry run (without a scope) counts the
+//leaves reaching each branch, for reporting the unreachable ones and for knowing which results would be duplicated.
+class match_compiler {
+public:
+  typedef std::function<ir::lang::var(ir::lang::scope &, size_t)> leaf_t;
+  struct occurrence {
+    std::optional<ir::lang::var> v; // once loaded
+    ir::lang::var base; // closest loaded ancestor
+    std::vector<size_t> path; // block offsets from base
+  };
+  struct row {
+    std::vector<const matcher::t *> cols;
+    size_t branch;
+  };
+  std::vector<size_t> leaves; // reaching each branch
+  match_compiler(size_t n_branches, leaf_t leaf, leaf_t fail) : leaves(n_branches, 0), leaf(std::move(leaf)),
+                                                                  fail(std::move(fail)) {}
+  std::optional<ir::lang::var> compile(ir::lang::scope *s, std::vector<occurrence> occs, std::vector<row> rows);
+private:
+  typedef std::function<std::optional<ir::lang::var>(ir::lang::scope *)> subtree_t;
+  leaf_t leaf, fail;
+  static matcher::ignore wildcard;
+
+  static bool is_wildcard(const matcher::t *p) {
+    return dynamic_cast<const matcher::ignore *>(p) || dynamic_cast<const matcher::universal *>(p);
+  }
+  static ir::lang::var load(ir::lang::scope &s, occurrence &o) {
+    if (!o.v) {
+      ir::lang::var cur = o.base;
+      for (size_t offset : o.path)cur = s.declare_assign(cur[offset]).mark(ir::lang::trivial);
+      o.v = cur;
+    }
+    return *o.v;
+  }
+  static std::vector<const matcher::t *> fields_of(const matcher::constructor &c) {
+    const size_t n_args = c.definition_point->args.size();
+    if (n_args == 0)return {};
+    if (!c.arg || is_wildcard(c.arg.get()))return std::vector<const matcher::t *>(n_args, &wildcard);
+    if (n_args == 1)return {c.arg.get()};
+    const auto *t = dynamic_cast<const matcher::tuple *>(c.arg.get());
+    if (!t || t->args.size() != n_args)THROW_INTERNAL_ERROR
+    std::vector<const matcher::t *> fields;
+    for (const auto &a : t->args)fields.push_back(a.get());
+    return fields;
+  }
+  // the rows agreeing with a head in column j, which is replaced by the n_fields fields of the head
+  subtree_t specialize(const std::vector<occurrence> &occs,
+                       const std::vector<row> &rows,
+                       size_t j,
+                       size_t n_fields,
+                       const std::function<std::optional<std::vector<const matcher::t *>>(const matcher::t *)> &fields) {
+    std::vector<row> specialized;
+    for (const row &r : rows) {
+      std::optional<std::vector<const matcher::t *>> fs;
+      if (is_wildcard(r.cols[j]))fs.emplace(n_fields, &wildcard);
+      else fs = fields(r.cols[j]);
+      if (!fs)continue;
+      row sr{.cols = std::vector<const matcher::t *>(r.cols.begin(), r.cols.begin() + j), .branch = r.branch};
+      sr.cols.insert(sr.cols.end(), fs->begin(), fs->end());
+      sr.cols.insert(sr.cols.end(), r.cols.begin() + j + 1, r.cols.end());
+      specialized.push_back(std::move(sr));
+    }
+    return [this, occs, j, n_fields, specialized = std::move(specialized)](ir::lang::scope *s) {
+      std::vector<occurrence> socc(occs.begin(), occs.begin() + j);
+      for (size_t i = 0; i < n_fields; ++i) {
+        const occurrence &o = occs[j];
+        if (o.v)socc.push_back(occurrence{.base = *o.v, .path = {header_words + i}});
+        else {
+          socc.push_back(occurrence{.base = o.base, .path = o.path});
+          socc.back().path.push_back(header_words + i);
+        }
+      }
+      socc.insert(socc.end(), occs.begin() + j + 1, occs.end());
+      return compile(s, std::move(socc), specialized);
+    };
+  }
+  // the rows with a wildcard in column j, which is dropped
+  subtree_t defaults(const std::vector<occurrence> &occs, const std::vector<row> &rows, size_t j) {
+    return specialize(occs, rows, j, 0, [](const matcher::t *) { return std::nullopt; });
+  }
+  // switches on key among the cases; without an otherwise, the last case is taken when none of the others is
+  static std::optional<ir::lang::var> dispatch(ir::lang::scope *s,
+                                               const std::function<ir::lang::var(ir::lang::scope &)> &key,
+                                               std::vector<std::pair<uint64_t, subtree_t>> cases,
+                                               subtree_t otherwise) {
+    using namespace ir::lang;
+    if (!otherwise) {
+      otherwise = std::move(cases.back().second);
+      cases.pop_back();
+    }
+    if (cases.empty())return otherwise(s);
+    if (!s) {
+      for (auto &c : cases)c.second(nullptr);
+      otherwise(nullptr);
+      return {};
+    }
+    var k = key(*s);
+    if (cases.size() == 1) {
+      s->push_back(instruction::cmp_vars{.v1 = k, .v2 = s->declare_constant(cases.front().first), .op = instruction::cmp_vars::cmp});
+      auto b = std::make_unique<ternary>();
+      b->cond = ternary::jne;
+      b->nojmp_branch.ret = cases.front().second(&b->nojmp_branch).value();
+      b->jmp_branch.ret = otherwise(&b->jmp_branch).value();
+      return s->declare_assign(std::move(b));
+    }
+    std::sort(cases.begin(), cases.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    auto sw = std::make_unique<switch_table>();
+    sw->v = k;
+    for (auto &[value, subtree] : cases) {
+      scope &c = sw->cases.emplace_back(value, scope()).second;
+      c.ret = subtree(&c).value();
+    }
+    sw->otherwise.ret = otherwise(&sw->otherwise).value();
+    return s->declare_assign(std::move(sw));
+  }
+  std::optional<ir::lang::var> switch_constructors(ir::lang::scope *s,
+                                                   std::vector<occurrence> &occs,
+                                                   const std::vector<row> &rows,
+                                                   size_t j);
+  std::optional<ir::lang::var> switch_literals(ir::lang::scope *s,
+                                               std::vector<occurrence> &occs,
+                                               const std::vector<row> &rows,
+                                               size_t j);
+};
+matcher::ignore match_compiler::wildcard;
+
+std::optional<ir::lang::var> match_compiler::compile(ir::lang::scope *s,
+                                                     std::vector<occurrence> occs,
+                                                     std::vector<row> rows) {
+  if (rows.empty()) {
+    if (!s)return {};
+    return fail(*s, 0);
+  }
+  const row &first = rows.front();
+  size_t j = 0;
+  while (j < first.cols.size() && is_wildcard(first.cols[j]))++j;
+  if (j == first.cols.size()) {
+    ++leaves.at(first.branch);
+    if (!s)return {};
+    return leaf(*s, first.branch);
+  }
+  if (const auto *t = dynamic_cast<const matcher::tuple *>(first.cols[j])) {
+    return specialize(occs, rows, j, t->args.size(), [](const matcher::t *p) {
+      std::vector<const matcher::t *> fields;
+      for (const auto &a : dynamic_cast<const matcher::tuple &>(*p).args)fields.push_back(a.get());
+      return std::optional(fields);
+    })(s);
+  }
+  if (dynamic_cast<const matcher::constructor *>(first.cols[j]))return switch_constructors(s, occs, rows, j);
+  return switch_literals(s, occs, rows, j);
+}
+
+std::optional<ir::lang::var> match_compiler::switch_constructors(ir::lang::scope *s,
+                                                                 std::vector<occurrence> &occs,
+                                                                 const std::vector<row> &rows,
+                                                                 size_t j) {
+  using namespace ir::lang;
+  typedef ::type::function::variant::constr constr;
+  std::vector<const constr *> heads;
+  for (const row &r : rows)
+    if (const auto *c = dynamic_cast<const matcher::constructor *>(r.cols[j]); c && std::find(heads.begin(), heads.end(), c->definition_point) == heads.end())
+      heads.push_back(c->definition_point);
+  const auto &all = heads.front()->parent_tf->constructors;
+  const bool complete = heads.size() == all.size();
+  const bool has_immediates = std::any_of(all.begin(), all.end(), [](const constr &c) { return c.args.empty(); });
+  const bool has_blocks = std::any_of(all.begin(), all.end(), [](const constr &c) { return !c.args.empty(); });
+  std::vector<std::pair<uint64_t, subtree_t>> immediates, blocks;
+  for (const constr *h : heads)
+    (h->args.empty() ? immediates : blocks).emplace_back(h->tag_id, specialize(occs, rows, j, h->args.size(), [h](const matcher::t *p) {
+      const auto &c = dynamic_cast<const matcher::constructor &>(*p);
+      return c.definition_point == h ? std::optional(fields_of(c)) : std::nullopt;
+    }));
+  const subtree_t others = complete ? subtree_t() : defaults(occs, rows, j);
+  subtree_t on_immediate = [&](scope *s) {
+    if (immediates.empty())return others(s);
+    return dispatch(s, [&](scope &s) { return load(s, occs[j]); }, immediates, others);
+  };
+  subtree_t on_block = [&](scope *s) {
+    if (blocks.empty())return others(s);
+    return dispatch(s, [&](scope &s) {
+      using binary_op = rhs_expr::binary_op;
+      var header = s.declare_assign(load(s, occs[j])[0]).mark(trivial);
+      return s.declare_assign(binary_op{.op = binary_op::shr, .x1 = header, .x2 = s.declare_constant(48)}).mark(trivial);
+    }, blocks, others);
+  };
+  if (!has_blocks)return on_immediate(s);
+  if (!has_immediates)return on_block(s);
+  if (!s) {
+    on_block(nullptr);
+    on_immediate(nullptr);
+    return {};
+  }
+  s->push_back(instruction::cmp_vars{.v1 = load(*s, occs[j]), .v2 = s->declare_constant(1), .op = instruction::cmp_vars::test});
+  auto b = std::make_unique<ternary>();
+  b->cond = ternary::jnz;
+  b->nojmp_branch.ret = on_block(&b->nojmp_branch).value();
+  b->jmp_branch.ret = on_immediate(&b->jmp_branch).value();
+  return s->declare_assign(std::move(b));
+}
+
+std::optional<ir::lang::var> match_compiler::switch_literals(ir::lang::scope *s,
+                                                             std::vector<occurrence> &occs,
+                                                             const std::vector<row> &rows,
+                                                             size_t j) {
+  std::vector<uint64_t> heads;
+  bool complete = false;
+  for (const row &r : rows)
+    if (const auto *l = dynamic_cast<const matcher::literal *>(r.cols[j])) {
+      if (std::find(heads.begin(), heads.end(), l->value->to_value()) == heads.end())heads.push_back(l->value->to_value());
+      if (dynamic_cast<const ast::literal::unit *>(l->value.get()))complete = true;
+      if (dynamic_cast<const ast::literal::boolean *>(l->value.get()))complete |= heads.size() == 2;
+    }
+  std::vector<std::pair<uint64_t, subtree_t>> cases;
+  for (uint64_t h : heads)
+    cases.emplace_back(h, specialize(occs, rows, j, 0, [h](const matcher::t *p) {
+      return dynamic_cast<const matcher::literal &>(*p).value->to_value() == h
+             ? std::optional(std::vector<const matcher::t *>{}) : std::nullopt;
+    }));
+  return dispatch(s, [&](ir::lang::scope &s) { return load(s, occs[j]); }, std::move(cases),
+                  complete ? subtree_t() : defaults(occs, rows, j));
+}
+}
+
 ir::lang::var match_with::ir_compile(ir_sections_t s) {
   assert(!branches.empty());
   using namespace ir::lang;
   var to_match = what->ir_compile(s);
 
-  scope *current = &s.main;
-
-  std::optional<var> returned;
-  for (const auto &branch : branches) {
-    branch.pattern->print(current->comment() << "matching ");
-    var cond = branch.pattern->ir_test_unroll(*current, to_match).mark(trivial);
-    current->push_back(instruction::cmp_vars{.v1 = cond, .v2 = current->declare_constant(2), .op=instruction::cmp_vars::test});
-    auto if_applies = std::make_unique<ternary>();
-    if_applies->cond = ternary::jz;
-    //if_applies->nojmp_branch; // if applies
-    //if_applies->jmp_branch; // if not applies
-    scope &branch_scope = if_applies->nojmp_branch;
-    branch.pattern->ir_locally_unroll(branch_scope, to_match);
-    branch_scope.ret = branch.result->ir_compile(s.with_main(branch_scope));
-
-    scope *on_fail = &if_applies->jmp_branch;
-    auto v = current->declare_assign(std::move(if_applies));
-    if (returned.has_value())current->ret = v; else returned.emplace(v);
-    current = on_fail;
-  }
-  current->ret =
-      current->declare_assign(rhs_expr::apply_fn{.f=current->declare_global("__throw__unmatched__"), .x=current->declare_constant(
-          3)});
-  return returned.value();
+  auto compile_branch = [&](scope &sc, size_t k) {
+    const branch &b = branches.at(k);
+    b.pattern->print(sc.comment() << "matching ");
+    b.pattern->ir_locally_unroll(sc, to_match);
+    return b.result->ir_compile(s.with_main(sc));
+  };
+  auto unmatched = [&](scope &sc, size_t) {
+    return sc.declare_assign(rhs_expr::apply_fn{.f=sc.declare_global("__throw__unmatched__"), .x=sc.declare_constant(
+        3)}).mark(ir_destroy_class); // never returns
+  };
+  std::vector<match_compiler::row> rows;
+  for (size_t k = 0; k < branches.size(); ++k)rows.push_back({.cols = {branches[k].pattern.get()}, .branch = k});
+  const std::vector<match_compiler::occurrence> root{{.v = to_match, .base = to_match}};
+
+  match_compiler dry_run(branches.size(), compile_branch, unmatched);
+  dry_run.compile(nullptr, root, rows);
+  for (size_t k = 0; report_unreachable && k < branches.size(); ++k)
+    if (!dry_run.leaves[k])
+      util::message::global.push_back(std::make_unique<error::unreachable_branch>(branches[k].pattern->loc));
+  if (std::all_of(dry_run.leaves.begin(), dry_run.leaves.end(), [](size_t n) { return n <= 1; }))
+    return match_compiler(branches.size(), compile_branch, unmatched).compile(&s.main, root, rows).value();
+
+  //some branch is reached from more than one leaf: the tree picks the index of the branch, which is compiled once
+  match_compiler picker(branches.size(), [](scope &sc, size_t k) { return sc.declare_constant(uint_to_v(k)); }, unmatched);
+  const var picked = picker.compile(&s.main, root, rows).value().mark(trivial);
+  std::vector<size_t> reached;
+  for (size_t k = 0; k < branches.size(); ++k)if (dry_run.leaves[k])reached.push_back(k);
+  auto sw = std::make_unique<switch_table>();
+  sw->v = picked;
+  for (size_t k : reached)
+    if (k != reached.back()) {
+      scope &c = sw->cases.emplace_back(uint_to_v(k), scope()).second;
+      c.ret = compile_branch(c, k);
+    }
+  sw->otherwise.ret = compile_branch(sw->otherwise, reached.back());
+  return s.main.declare_assign(std::move(sw));
 }
 ir::lang::var let_in::ir_compile(ir_sections_t s) {
   d->ir_compile_locally(s);
@@ -444,7 +1232,7 @@ ir::lang::var fun::ir_compile(ir_sections_t s) {
     static size_t id = 1;
     std::string name = "__pure_fun_block_";
     name.append(std::to_string(id++)).append("__");
-    s.data << name << " dq 0," << make_tag_size_d(Tag_Fun, 2, 0) << "," << text_ptr << "," << uint_to_v(args.size())
+    s.data << name << " dq " << make_header(Tag_Fun, 2, 0, 0) << "," << text_ptr << "," << uint_to_v(args.size())
            << "\n";
     return s.main.declare_global(name);
 
@@ -452,51 +1240,91 @@ ir::lang::var fun::ir_compile(ir_sections_t s) {
 
     static size_t id = 1;
     using namespace ir::lang;
-    var block = s.main.declare_assign(rhs_expr::malloc{.size=4 + captures.size()});
-    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=0, .src=s.main.declare_constant(3)});
-    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=1, .src=s.main.declare_constant(
-        make_tag_size_d(Tag_Fun, 2 + captures.size(), 0))});
-    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=2, .src=s.main.declare_global(
+    var block = s.main.declare_assign(rhs_expr::malloc{.size=3 + captures.size(),
+        .site = s.alloc_site(loc, "closure", Tag_Fun, 3 + captures.size())});
+    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=0, .src=s.main.declare_constant(
+        make_header(Tag_Fun, 2 + captures.size(), 0))});
+    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=1, .src=s.main.declare_global(
         text_ptr)});
-    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=3, .src=s.main.declare_constant(
+    s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=2, .src=s.main.declare_constant(
         uint_to_v(args.size()))});
     for (size_t i = 0; i < captures.size(); ++i) {
-      s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=4
+      s.main.push_back(instruction::write_uninitialized_mem{.base=block, .block_offset=3
           + i, .src=captures.at(i)->ir_var});
     }
     return block;
   }
 }
-std::string fun::ir_compile_global(ir_sections_t s) {
-  const bool has_captures = !captures.empty(); // If it's global it should not be capturing anything
+void fun::ir_name_entry_points(bool with_direct) {
   static size_t fun_id_gen = 1;
   const size_t fun_id = fun_id_gen++;
-  std::string name = std::string("__fun_").append(std::to_string(fun_id)).append("__");
+  ir_text_ptr = std::string("__fun_").append(std::to_string(fun_id)).append("__");
+  if (with_direct) {
+    assert(args.size() + captures.size() <= ir::reg::args_order.size()); // only a lifted function has captures
+    ir_direct_text_ptr = std::string("__fun_").append(std::to_string(fun_id)).append("_direct__");
+  }
+}
+std::string fun::ir_compile_global(ir_sections_t s) {
+  const bool has_captures = !captures.empty(); // If it's global it should not be capturing anything
+  if (ir_text_ptr.empty())ir_name_entry_points(false);
   using namespace ir::lang;
+  if (!ir_direct_text_ptr.empty()) {
+    ir_compile_direct(s);
+    //generic entry point: unroll the Arg block and jump into the direct one
+    function f;
+    var arg_block;
+    f.args = {arg_block};
+    f.name = ir_text_ptr;
+    std::vector<var> xs;
+    for (size_t i = 0; i < args.size(); ++i) {
+      xs.push_back(f.declare_assign(arg_block[3 + i]));
+      if (auto *u = dynamic_cast<const matcher::universal *>(args.at(i).get()))
+        xs.back().mark(u->ir_var.destroy_class()).mark_destructor(u->ir_var.destructor());
+    }
+    f.ret = f.declare_assign(rhs_expr::call_direct{.name = ir_direct_text_ptr, .args = std::move(xs)});
+    *(s.text++) = std::move(f);
+    return ir_text_ptr;
+  }
   function f;
   var arg_block;
   f.args = {arg_block};
-  f.name = name;
-  //read unroll args onto variables
-  bool should_skip = false;
-  // iterate the args in reverse order
-  for (auto arg_it = args.rbegin(); arg_it != args.rend(); ++arg_it) {
-    if (should_skip)arg_block = f.declare_assign(arg_block[2]);
-    should_skip = true;
-    (*arg_it)->ir_locally_unroll(f, f.declare_assign(arg_block[4]));
-  }
+  f.name = ir_text_ptr;
+  //read unroll args onto variables: the Arg block holds them all, in order
+  for (size_t i = 0; i < args.size(); ++i)args.at(i)->ir_locally_unroll(f, f.declare_assign(arg_block[3 + i]));
   if (has_captures) {
-    arg_block = f.declare_assign(arg_block[2]);
-    size_t id = 4;
+    var fun_block = f.declare_assign(arg_block[1]);
+    size_t id = 3;
     for (auto &c : captures) {
-      f.push_back(instruction::assign{.dst= c->ir_var, .src=arg_block[id]});
+      f.push_back(instruction::assign{.dst= c->ir_var, .src=fun_block[id]});
       ++id;
     }
   }
   //compute value
   f.ret = body->ir_compile(s.with_main(f));
   *(s.text++) = std::move(f);
-  return name;
+  return ir_text_ptr;
+}
+void fun::ir_compile_direct(ir_sections_t s) {
+  using namespace ir::lang;
+  //direct entry point: args in registers, followed by the captures of a lifted function
+  function d;
+  d.name = ir_direct_text_ptr;
+  for (auto &arg : args) {
+    var a;
+    d.args.push_back(a);
+    arg->ir_locally_unroll(d, a);
+  }
+  //the captures are rebound to args of their own while the body is compiled, so that what is inferred on the args of d
+  //doesn't reach the vars of the enclosing function
+  std::vector<var> enclosing;
+  for (const auto *c : captures) {
+    enclosing.push_back(c->ir_var);
+    c->ir_var = var().mark(c->ir_var.destroy_class()).mark_destructor(c->ir_var.destructor());
+    d.args.push_back(c->ir_var);
+  }
+  d.ret = body->ir_compile(s.with_main(d));
+  for (size_t i = 0; i < captures.size(); ++i)captures[i]->ir_var = enclosing[i];
+  *(s.text++) = std::move(d);
 }
 
 //typecheck
@@ -505,7 +1333,9 @@ tc_section::idx_t identifier::typecheck(tc_section tcs) const {
     // return a copy
     const auto &t = tcs.global.at(definition_point);
     assert(t.is_poly_normalized());
-    return tcs.arena.type_with_args(t, tcs.arena.fresh_n(t.poly_n_args()));
+    auto id = tcs.arena.type_with_args(t, tcs.arena.fresh_n(t.poly_n_args()));
+    tcs.typed.emplace_back(this, id);
+    return id;
   } else if (tcs.local.contains(definition_point)) {
     //return the same
     return tcs.local.at(definition_point);
@@ -562,6 +1392,7 @@ tc_section::idx_t tuple::typecheck(tc_section tcs) const {
 tc_section::idx_t fun_app::typecheck(tc_section tcs) const {
   auto fid = f->typecheck(tcs), xid = x->typecheck(tcs), aid = tcs.arena.fresh();
   tcs.arena.unify(fid, tcs.arena.apply(&::type::function::tf_fun, {xid, aid}));
+  tcs.typed.emplace_back(this, aid);
   return aid;
 }
 tc_section::idx_t destroy::typecheck(tc_section tcs) const {
@@ -581,6 +1412,7 @@ tc_section::idx_t match_with::typecheck(tc_section tcs) const {
     tcs.arena.unify(wid, b.pattern->typecheck(tcs));
     tcs.arena.unify(ret, b.result->typecheck(tcs));
   }
+  tcs.typed.emplace_back(this, ret);
   return ret;
 }
 tc_section::idx_t let_in::typecheck(tc_section tcs) const {
@@ -643,6 +1475,77 @@ std::string fun::text_name_gen(std::string_view name_hint) {
     return s;
   }
 }
+ptr literal::clone(clone_map &) const {
+  auto c = std::make_unique<literal>(value->clone());
+  c->loc = loc;
+  return c;
+}
+ptr identifier::clone(clone_map &cm) const {
+  auto c = std::make_unique<identifier>(name, loc);
+  if (auto it = cm.find(definition_point); it != cm.end()) {
+    c->definition_point = it->second;
+    it->second->usages.push_front(c.get());
+  } else {
+    c->definition_point = definition_point; // bound outside, e.g. a global: the original already counts as a usage
+  }
+  return c;
+}
+ptr constructor::clone(clone_map &cm) const {
+  auto c = std::make_unique<constructor>(name);
+  c->loc = loc;
+  c->definition_point = definition_point;
+  if (arg)c->arg = arg->clone(cm);
+  return c;
+}
+ptr if_then_else::clone(clone_map &cm) const {
+  auto cond = condition->clone(cm);
+  auto tb = true_branch->clone(cm);
+  auto c = std::make_unique<if_then_else>(std::move(cond), std::move(tb), false_branch->clone(cm));
+  c->loc = loc;
+  return c;
+}
+ptr tuple::clone(clone_map &cm) const {
+  auto c = std::make_unique<tuple>();
+  c->loc = loc;
+  for (const auto &p : args)c->args.push_back(p->clone(cm));
+  return c;
+}
+ptr fun_app::clone(clone_map &cm) const {
+  auto cf = f->clone(cm);
+  return std::make_unique<fun_app>(std::move(cf), x->clone(cm));
+}
+ptr destroy::clone(clone_map &cm) const {
+  auto cobj = obj->clone(cm);
+  return std::make_unique<destroy>(std::move(cobj), d->clone(cm));
+}
+ptr seq::clone(clone_map &cm) const {
+  auto ca = a->clone(cm);
+  return std::make_unique<seq>(std::move(ca), b->clone(cm));
+}
+ptr match_with::clone(clone_map &cm) const {
+  auto c = std::make_unique<match_with>(what->clone(cm));
+  c->loc = loc;
+  c->report_unreachable = false;
+  for (const auto &b : branches) {
+    auto &cb = c->branches.emplace_back();
+    cb.pattern = b.pattern->clone(cm);
+    cb.result = b.result->clone(cm);
+  }
+  return c;
+}
+ptr let_in::clone(clone_map &cm) const {
+  auto cd = d->clone(cm);
+  auto c = std::make_unique<let_in>(std::move(cd), e->clone(cm));
+  c->loc = loc;
+  return c;
+}
+ptr fun::clone(clone_map &cm) const {
+  std::vector<matcher::ptr> cargs;
+  for (const auto &m : args)cargs.push_back(m->clone(cm));
+  auto c = std::make_unique<fun>(std::move(cargs), body->clone(cm));
+  c->loc = loc;
+  return c;
+}
 
 }
 
@@ -689,8 +1592,33 @@ void t::ir_compile_locally(ir_sections_t s) {
     // 2. check that if one contains another
     THROW_UNIMPLEMENTED
   }
-  for (auto &def : defs) def.name->ir_locally_unroll(s.main, def.e->ir_compile(s));
-
+  for (auto &def : defs) {
+    auto *name = dynamic_cast<matcher::universal *>(def.name.get());
+    if (name && name->ir_lifted) {
+      //no closure is built, the calls go to the direct entry point
+      auto *f = dynamic_cast<expression::fun *>(def.e.get());
+      f->ir_name_entry_points(true);
+      f->ir_compile_direct(s);
+      name->ir_direct_text_ptr = f->ir_direct_text_ptr;
+      name->ir_direct_n_args = f->args.size();
+    } else def.name->ir_locally_unroll(s.main, def.e->ir_compile(s));
+  }
+}
+void t::ir_lift_functions(expression::t &in) {
+  std::unordered_map<const expression::identifier *, size_t> applied;
+  count_applied_args(in, applied);
+  for (auto &def : defs) {
+    auto *name = dynamic_cast<matcher::universal *>(def.name.get());
+    auto *f = dynamic_cast<expression::fun *>(def.e.get());
+    if (!name || !f || name->usages.empty())continue;
+    if (!std::all_of(name->usages.begin(), name->usages.end(), [&](const expression::identifier *id) {
+      auto it = applied.find(id);
+      return it != applied.end() && it->second >= f->args.size();
+    }))
+      continue; // it escapes, or is partially applied
+    f->capture_group();
+    if (f->args.size() + f->captures.size() <= ir::reg::args_order.size())name->ir_lifted = f;
+  }
 }
 void t::ir_compile_global(ir_sections_t s) {
 
@@ -730,6 +1658,17 @@ void t::ir_compile_global(ir_sections_t s) {
     if (def.is_single_name() && (def.is_fun() || def.is_tuple() || def.is_constr())) {
       dynamic_cast<matcher::universal *>(def.name.get())->use_as_immediate = true;
     }
+  //name the entry points first, so that (mutually) recursive calls can be direct
+  for (auto &def : defs) {
+    auto *name = dynamic_cast<matcher::universal *>(def.name.get());
+    if (name && def.is_fun()) {
+      auto *f = dynamic_cast<expression::fun *>(def.e.get());
+      assert(f->captures.empty());
+      f->ir_name_entry_points(f->args.size() <= ir::reg::args_order.size());
+      name->ir_direct_text_ptr = f->ir_direct_text_ptr;
+      name->ir_direct_n_args = f->args.size();
+    }
+  }
   for (auto &def : defs) {
     auto *name = dynamic_cast<matcher::universal *>(def.name.get());
     if (name && def.is_fun()) {
@@ -746,7 +1685,7 @@ void t::ir_compile_global(ir_sections_t s) {
       size_t i = 0;
       for (auto &e : tuple_expr->args) {
         auto v = e->ir_compile(s);
-        s.main.push_back(instruction::write_uninitialized_mem{.base = tuple_addr, .block_offset = i + 2, .src = v});
+        s.main.push_back(instruction::write_uninitialized_mem{.base = tuple_addr, .block_offset = header_words + i, .src = v});
         ++i;
       }
     } else if (name && def.is_constr()) {
@@ -760,14 +1699,14 @@ void t::ir_compile_global(ir_sections_t s) {
         //TODO: parse knowing type of constructor
         if (n_args == 0)throw "not okay - didn't expect args";
         if (n_args == 1) {
-          s.main.push_back(instruction::write_uninitialized_mem{.base = constr_addr, .block_offset = 2, .src = e->arg->ir_compile(
+          s.main.push_back(instruction::write_uninitialized_mem{.base = constr_addr, .block_offset = header_words, .src = e->arg->ir_compile(
               s)});
         } else {
           const auto *t = dynamic_cast<const expression::tuple *>(e->arg.get());
           if (!t)throw "expected n_args argument";
           if (t->args.size() != n_args)throw "expected n_args argument";
           for (size_t i = 0; i < n_args; ++i)
-            s.main.push_back(instruction::write_uninitialized_mem{.base = constr_addr, .block_offset = 2
+            s.main.push_back(instruction::write_uninitialized_mem{.base = constr_addr, .block_offset = header_words
                 + i, .src = t->args.at(i)->ir_compile(s)});
         }
       } else {
@@ -788,6 +1727,15 @@ void t::bind(const constr_map &cm) {
 void t::typecheck(tc_section tcs) const {
   for (const auto &d : defs)d.typecheck(tcs);
 }
+ptr t::clone(clone_map &cm) const {
+  auto c = std::make_unique<t>();
+  c->loc = loc;
+  c->rec = rec;
+  std::vector<matcher::ptr> names; // all the binders first, in a rec definition any of them can be referred to
+  for (const auto &d : defs)names.push_back(d.name->clone(cm));
+  for (size_t i = 0; i < defs.size(); ++i)c->defs.emplace_back(std::move(names.at(i)), defs.at(i).e->clone(cm));
+  return c;
+}
 
 }
 
@@ -902,19 +1850,20 @@ void constructor::ir_global_unroll(ir::scope &s, ir::lang::var block) {
   }
   if (dynamic_cast<const ignore *>(arg.get()))return;
   if (n_args == 1) {
-    arg->ir_global_unroll(s, s.declare_assign(block[2]));
+    arg->ir_global_unroll(s, s.declare_assign(block[header_words]));
   } else {
     auto *t = dynamic_cast<tuple *>(arg.get());
     if (!t)throw "error - wrong number";
     if (t->args.size() != n_args)throw "error - wrong number";
-    for (size_t i = 0; i < n_args; ++i)t->args.at(i)->ir_global_unroll(s, s.declare_assign(block[2 + i]));
+    for (size_t i = 0; i < n_args; ++i)t->args.at(i)->ir_global_unroll(s, s.declare_assign(block[header_words + i]));
   }
 
 }
 void tuple::ir_global_unroll(ir::scope &s, ir::lang::var block) {
   using namespace ir::lang;
   for (size_t i = 0; i < args.size(); ++i) {
-    var content = s.declare_assign(block[i + 2]);
+    if (dynamic_cast<const ignore *>(args.at(i).get()))continue; // nothing to bind
+    var content = s.declare_assign(block[header_words + i]);
     args.at(i)->ir_global_unroll(s, content);
   }
 }
@@ -1002,13 +1951,13 @@ std::string universal::ir_asm_name() const {
 void universal::ir_allocate_globally_funblock(std::ostream &os, size_t n_args,
                                               std::string_view text_ptr) {
   use_as_immediate = true;
-  os << ir_asm_name() << " dq 0, " << make_tag_size_d(Tag_Fun, 2, 0) << "," << text_ptr << "," << uint_to_v(n_args)
+  os << ir_asm_name() << " dq " << make_header(Tag_Fun, 2, 0, 0) << "," << text_ptr << "," << uint_to_v(n_args)
      << "; " << name
      << " : funblock\n";
 }
 void universal::ir_allocate_global_tuple(std::ostream &os, size_t tuple_size) {
   use_as_immediate = true;
-  os << ir_asm_name() << " dq 0," << make_tag_size_d(Tag_Tuple, tuple_size, 0);
+  os << ir_asm_name() << " dq " << make_header(Tag_Tuple, tuple_size, 0, 0);
   for (int i = 0; i < tuple_size; ++i)os << ", 0";
   os << "; " << name << " : tuple[" << tuple_size << "]\n";
 }
@@ -1017,7 +1966,7 @@ void universal::ir_allocate_global_constrblock(std::ostream &os,
                                                const ::type::function::variant::constr &constr) {
   use_as_immediate = true;
   assert(!constr.args.empty());
-  os << ir_asm_name() << " dq 0," << make_tag_size_d(constr.tag_id, constr.args.size(), 0);
+  os << ir_asm_name() << " dq " << make_header(constr.tag_id, constr.args.size(), 0, 0);
   for (size_t i = 0; i < constr.args.size(); ++i)os << ", 0 ";
   os << "   ; " << name << " : " << constr.name << " = " << constr.tag_id << "\n";
 }
@@ -1043,6 +1992,7 @@ ir::lang::var universal::ir_evaluate_global(ir::lang::scope &s) const {
 void universal::ir_locally_unroll(ir::scope &s, ir::lang::var v) {
   assert(!top_level);
   using namespace ir::lang;
+  if (v.destroy_class() & ir_var.destroy_class())v.mark(v.destroy_class() & ir_var.destroy_class()); // same type
   s.push_back(instruction::assign{.dst = ir_var, .src = v});
   s.comment() << "local variable \"" << name << "\" is on " << ir_var;
 }
@@ -1058,12 +2008,14 @@ void constructor::ir_locally_unroll(ir::scope &s, ir::lang::var block) {
   }
   if (dynamic_cast<const ignore *>(arg.get()))return;
   if (n_args == 1) {
-    arg->ir_locally_unroll(s, s.declare_assign(block[2]));
+    arg->ir_locally_unroll(s, s.declare_assign(block[header_words]));
   } else {
     auto *t = dynamic_cast<tuple *>(arg.get());
     if (!t)throw "error - wrong number";
     if (t->args.size() != n_args)throw "error - wrong number";
-    for (size_t i = 0; i < n_args; ++i)t->args.at(i)->ir_locally_unroll(s, s.declare_assign(block[2 + i]));
+    for (size_t i = 0; i < n_args; ++i)
+      if (!dynamic_cast<const ignore *>(t->args.at(i).get()))
+        t->args.at(i)->ir_locally_unroll(s, s.declare_assign(block[header_words + i]));
   }
 
 }
@@ -1071,7 +2023,7 @@ void constructor::ir_locally_unroll(ir::scope &s, ir::lang::var block) {
 void tuple::ir_locally_unroll(ir::scope &s, ir::lang::var block) {
   using namespace ir::lang;
   for (size_t i = 0; i < args.size(); ++i) {
-    var content = s.declare_assign(block[i + 2]);
+    var content = s.declare_assign(block[header_words + i]);
     args.at(i)->ir_locally_unroll(s, content);
   }
 }
@@ -1086,85 +2038,34 @@ std::ostream &tuple::print(std::ostream &os) const {
   }
   return os << ")";
 }
-ir::lang::var tuple::ir_test_unroll(ir::scope &main, ir::lang::var v) {
-  using namespace ir::lang;
-
-  scope *current = &main;
-  for (size_t i = 0; i < args.size(); ++i) {
-    var this_okay = args.at(i)->ir_test_unroll(*current, current->declare_assign(v[2 + i]).mark(trivial));
-    if (i + 1 == args.size()) {
-      current->ret = this_okay;
-    } else {
-      current->push_back(instruction::cmp_vars{.v1=this_okay, .v2=current->declare_constant(2), .op=instruction::cmp_vars::test});
-      rhs_expr::branch b = std::make_unique<ternary>();
-      b->cond = ternary::jz;
-      b->jmp_branch.ret = b->jmp_branch.declare_constant(1); //false
-      scope *next = &b->nojmp_branch;
-      current->ret = current->declare_assign(std::move(b));
-      current = next;
-    }
-  }
-  return main.ret;
+ptr universal::clone(clone_map &cm) const {
+  assert(!top_level);
+  auto c = std::make_unique<universal>(name);
+  c->loc = loc;
+  cm.emplace(this, c.get());
+  return c;
 }
-ir::lang::var constructor::ir_test_unroll(ir::scope &s, ir::lang::var v) {
-  using namespace ir::lang;
-  assert(definition_point);
-  assert(definition_point->args.empty() == (arg == nullptr));
-  if (!arg || dynamic_cast<ignore *>(arg.get())) {
-    s.push_back(instruction::cmp_vars{.v1=v, .v2=s.declare_constant(definition_point->tag_id), .op=instruction::cmp_vars::cmp});
-    scope strue, sfalse;
-    strue.ret = strue.declare_assign(3);
-    sfalse.ret = sfalse.declare_assign(1);
-    return s.declare_assign(std::make_unique<ternary>(ternary{.cond = ternary::jne, .nojmp_branch=std::move(strue), .jmp_branch=std::move(
-        sfalse)}));
-  }
-  const size_t n_args = definition_point->args.size();
-  s.push_back(instruction::cmp_vars{.v1=v, .v2=s.declare_constant(1), .op=instruction::cmp_vars::test});
-  scope matching_tag, sfalse;
-  if (n_args == 1) {
-    matching_tag.ret = arg->ir_test_unroll(matching_tag, matching_tag.declare_assign(v[2]).mark(trivial));
-  } else {
-    //in the matching tag, test all of them (similar to tuple)
-    scope *current = &matching_tag;
-    auto *t = dynamic_cast<tuple *>(arg.get());
-    assert(t);
-    assert(t->args.size() == n_args);
-    for (size_t i = 0; i < n_args; ++i) {
-      var this_okay = t->args.at(i)->ir_test_unroll(*current, current->declare_assign(v[2 + i]).mark(trivial));
-      if (i + 1 == n_args) {
-        current->ret = this_okay;
-      } else {
-        current->push_back(instruction::cmp_vars{.v1=this_okay, .v2=current->declare_constant(2), .op=instruction::cmp_vars::test});
-        rhs_expr::branch b = std::make_unique<ternary>();
-        b->cond = ternary::jz;
-        b->jmp_branch.ret = b->jmp_branch.declare_constant(1); //false
-        scope *next = &b->nojmp_branch;
-        current->ret = current->declare_assign(std::move(b));
-        current = next;
-      }
-    }
-  }
-  sfalse.ret = sfalse.declare_assign(1);
-  using binary_op = rhs_expr::binary_op;
-  scope sboxed, simmediate;
-  sboxed.push_back(instruction::cmp_vars{.v1=sboxed.declare_assign(binary_op{.op=binary_op::sar, .x1=sboxed.declare_assign(
-      v[1]).mark(trivial), .x2=sboxed.declare_constant(32)}).mark(trivial), .v2=sboxed.declare_constant(definition_point->tag_id), .op=instruction::cmp_vars::cmp});
-  sboxed.ret =
-      sboxed.declare_assign(std::make_unique<ternary>(ternary{.cond = ternary::jne, .nojmp_branch=std::move(matching_tag), .jmp_branch=std::move(
-          sfalse)}));
-  simmediate.ret = simmediate.declare_assign(1);
-  return s.declare_assign(std::make_unique<ternary>(ternary{.cond = ternary::jnz, .nojmp_branch=std::move(sboxed), .jmp_branch=std::move(
-      simmediate)}));
+ptr ignore::clone(clone_map &) const {
+  auto c = std::make_unique<ignore>();
+  c->loc = loc;
+  return c;
 }
-
-ir::lang::var literal::ir_test_unroll(ir::scope &s, ir::lang::var v) {
-  using namespace ir::lang;
-  s.push_back(instruction::cmp_vars{.v1=v, .v2=s.declare_constant(value->to_value()), .op=instruction::cmp_vars::cmp});
-  scope strue, sfalse;
-  strue.ret = strue.declare_assign(3);
-  sfalse.ret = sfalse.declare_assign(1);
-  return s.declare_assign(std::make_unique<ternary>(ternary{.cond = ternary::jne, .nojmp_branch=std::move(strue), .jmp_branch=std::move(
-      sfalse)}));
+ptr constructor::clone(clone_map &cm) const {
+  auto c = arg ? std::make_unique<constructor>(arg->clone(cm), cons) : std::make_unique<constructor>(cons);
+  c->loc = loc;
+  c->definition_point = definition_point;
+  return c;
+}
+ptr literal::clone(clone_map &) const {
+  auto c = std::make_unique<literal>(value->clone());
+  c->loc = loc;
+  return c;
+}
+ptr tuple::clone(clone_map &cm) const {
+  auto c = std::make_unique<tuple>();
+  c->loc = loc;
+  for (const auto &p : args)c->args.push_back(p->clone(cm));
+  return c;
 }
 
 }
@@ -1192,7 +2093,8 @@ ir::lang::var string::ir_compile(ir_sections_t s) const {
   size_t id = ++id_factory;
   std::string name("__string_literal_");
   name.append(std::to_string(id)).append("__");
-  s.data << name << " dq 0, " << make_tag_size_d(Tag_String, value.size() / 8, 0) << "\n";
+  if (value.size() / 8 > ir::header_max_size)throw std::runtime_error("string literal too long");
+  s.data << name << " dq " << make_header(Tag_String, value.size() / 8, 0, 0) << "\n";
   s.data << " db ";
   bool is_string_open = false;
   bool comma = false;
@@ -1222,6 +2124,324 @@ tc_section::idx_t boolean::typecheck(tc_section tcs) const { return tcs.arena.ap
 tc_section::idx_t unit::typecheck(tc_section tcs) const { return tcs.arena.apply(&::type::function::tf_unit, {}); }
 tc_section::idx_t string::typecheck(tc_section tcs) const { return tcs.arena.apply(&::type::function::tf_string, {}); }
 
+ptr integer::clone() const { return std::make_unique<integer>(value); }
+ptr boolean::clone() const { return std::make_unique<boolean>(value); }
+ptr unit::clone() const { return std::make_unique<unit>(); }
+ptr string::clone() const { return std::make_unique<string>(std::string_view(value)); }
+
+}
+
+namespace {
+size_t expression_size(expression::t &e) {
+  size_t n = 1;
+  for_each_subexpression(e, [&n](expression::ptr &c) { n += expression_size(*c); });
+  return n;
+}
+
+typedef std::unordered_map<const matcher::universal *, std::unordered_set<const matcher::universal *>> call_graph;
+bool is_recursive(const call_graph &g, const matcher::universal *u) {
+  std::vector<const matcher::universal *> todo = {u};
+  std::unordered_set<const matcher::universal *> seen;
+  while (!todo.empty()) {
+    const auto *v = todo.back();
+    todo.pop_back();
+    if (auto it = g.find(v); it != g.end())
+      for (const auto *w : it->second) {
+        if (w == u)return true;
+        if (seen.insert(w).second)todo.push_back(w);
+      }
+  }
+  return false;
+}
+}
+
+void inliner::record(definition::t &d) {
+  if (!budget)return;
+  call_graph calls; // references between the functions of a rec block
+  if (d.rec) {
+    std::unordered_set<const matcher::universal *> names;
+    for (auto &def : d.defs)def.name->for_each_universal([&names](matcher::universal &u) { names.insert(&u); });
+    for (auto &def : d.defs)
+      if (auto *u = dynamic_cast<matcher::universal *>(def.name.get()))
+        def.e->for_each_identifier([&](expression::identifier &id) {
+          if (names.contains(id.definition_point))calls[u].insert(id.definition_point);
+        });
+  }
+  for (auto &def : d.defs) {
+    auto *u = dynamic_cast<matcher::universal *>(def.name.get());
+    auto *f = dynamic_cast<expression::fun *>(def.e.get());
+    if (u && f && expression_size(*f->body) <= budget && !is_recursive(calls, u))candidates.emplace(u, f);
+  }
+}
+
+void inliner::inline_calls(definition::t &d) {
+  for (auto &def : d.defs)inline_calls(def.e);
+}
+
+void inliner::inline_calls(expression::ptr &e) {
+  if (!budget)return;
+  // bottom-up, so the arguments are inlined before they get moved, and an inlined body is not inlined into again
+  for_each_subexpression(*e, [this](expression::ptr &c) { inline_calls(c); });
+  std::vector<expression::ptr *> args; // last to first
+  expression::ptr *head = &e;
+  while (auto *app = dynamic_cast<expression::fun_app *>(head->get())) {
+    args.push_back(&app->x);
+    head = &app->f;
+  }
+  auto *id = dynamic_cast<expression::identifier *>(head->get());
+  if (!id)return;
+  auto it = candidates.find(id->definition_point);
+  if (it == candidates.end() || it->second->args.size() != args.size())return;
+  // f a1 .. an becomes let p1 = a1 in .. let pn = an in body, which evaluates the args in the same order as the call
+  clone_map cm;
+  std::vector<matcher::ptr> params;
+  for (const auto &p : it->second->args)params.push_back(p->clone(cm));
+  expression::ptr body = it->second->body->clone(cm);
+  std::reverse(params.begin(), params.end()); // last to first, like args
+  // a name passed as an argument replaces the parameter, rather than being copied into it: e.g. a function argument
+  // is called directly. Captures are only computed after the inlining, so a local name can be substituted as well
+  std::unordered_map<const matcher::universal *, const matcher::universal *> substituted;
+  for (size_t i = 0; i < args.size(); ++i) {
+    auto *p = dynamic_cast<matcher::universal *>(params.at(i).get());
+    auto *a = dynamic_cast<expression::identifier *>(args.at(i)->get());
+    if (p && a && a->definition_point)substituted.emplace(p, a->definition_point);
+  }
+  if (!substituted.empty())
+    body->for_each_identifier([&substituted](expression::identifier &id) {
+      if (auto s = substituted.find(id.definition_point); s != substituted.end())id.definition_point = s->second;
+    });
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (substituted.contains(dynamic_cast<matcher::universal *>(params.at(i).get()))) {
+      dropped.push_back(std::move(*args.at(i)));
+      continue;
+    }
+    auto d = std::make_unique<definition::t>();
+    d->loc = (*args.at(i))->loc;
+    d->defs.emplace_back(std::move(params.at(i)), std::move(*args.at(i)));
+    body = std::make_unique<expression::let_in>(std::move(d), std::move(body));
+  }
+  body->loc = e->loc;
+  dropped.push_back(std::move(*head));
+  e = std::move(body);
+}
+
+struct evaluator::value {
+  uint64_t word = 1; // of an immediate
+  std::optional<uint32_t> tag; // set for a block
+  std::vector<value_ptr> fields; // of a block, or the args applied so far to a function
+  const expression::fun *f = nullptr; // a closure of f, with its captures in env
+  env_t env;
+  const matcher::universal *funblock = nullptr; // a toplevel function or a builtin, with a static block at its label
+  mutable std::string label; // of a block, once serialised
+};
+
+namespace {
+bool is_pure_builtin(std::string_view name) {
+  static const std::unordered_set<std::string_view> pure = {
+      "__binary_op__PLUS__", "__binary_op__MINUS__", "__binary_op__STAR__", "__binary_op__SLASH__",
+      "__unary_op__MINUS__", "__binary_op__EQUAL__", "__binary_op__NOT_EQUAL__", "__binary_op__LESS_THAN__",
+      "__binary_op__LESS_EQUAL_THAN__", "__binary_op__GREATER_THAN__", "__binary_op__GREATER_EQUAL_THAN__"};
+  return pure.contains(name);
+}
+}
+
+bool evaluator::evaluate(definition::t &d, std::ostream &data) {
+  if (!fuel || d.rec)return false;
+  if (std::any_of(d.defs.begin(), d.defs.end(), [](const definition::def &def) { return def.is_fun(); }))return false;
+  steps_left = fuel;
+  depth = 0;
+  env_t bound;
+  try {
+    for (auto &def : d.defs) {
+      env_t env;
+      if (!match(*def.name, eval(*def.e, env), bound))return false;
+    }
+  } catch (const gave_up &) {
+    return false;
+  }
+  for (const auto&[u, v] : bound)if (!is_static(v))return false;
+  for (auto &def : d.defs)
+    def.name->for_each_universal([&](matcher::universal &u) {
+      const value_ptr &v = bound.at(&u);
+      const std::string word = serialise(v, data);
+      u.use_as_immediate = v->tag.has_value() || v->funblock;
+      if (u.use_as_immediate)data << u.ir_asm_name() << " equ " << word << "; " << u.name << " : static\n";
+      else data << u.ir_asm_name() << " dq " << word << "; " << u.name << " : static value\n";
+      globals.emplace(&u, v);
+    });
+  return true;
+}
+
+void evaluator::record(definition::t &d) {
+  for (auto &def : d.defs)
+    if (auto *u = dynamic_cast<matcher::universal *>(def.name.get()))
+      if (auto *f = dynamic_cast<expression::fun *>(def.e.get()))functions.emplace(u, f);
+}
+
+evaluator::value_ptr evaluator::eval(expression::t &e, env_t &env) {
+  using namespace expression;
+  if (steps_left == 0)throw gave_up{};
+  --steps_left;
+  auto v = std::make_shared<value>();
+  if (auto *l = dynamic_cast<expression::literal *>(&e)) {
+    if (dynamic_cast<const ast::literal::string *>(l->value.get()))throw gave_up{};
+    v->word = l->value->to_value();
+  } else if (auto *id = dynamic_cast<identifier *>(&e)) {
+    const matcher::universal *u = id->definition_point;
+    if (!u->top_level) {
+      auto it = env.find(u);
+      if (it == env.end())throw gave_up{};
+      return it->second;
+    }
+    if (auto it = globals.find(u); it != globals.end())return it->second;
+    v->funblock = u;
+    if (auto it = functions.find(u); it != functions.end())v->f = it->second;
+    else if (!is_pure_builtin(u->name))throw gave_up{};
+  } else if (auto *c = dynamic_cast<constructor *>(&e)) {
+    if (!c->arg) {
+      v->word = c->definition_point->tag_id;
+      return v;
+    }
+    v->tag = c->definition_point->tag_id;
+    value_ptr arg = eval(*c->arg, env);
+    if (c->definition_point->args.size() == 1)v->fields.push_back(arg);
+    else v->fields = arg->fields; // the tuple is flattened into the block
+  } else if (auto *t = dynamic_cast<tuple *>(&e)) {
+    v->tag = Tag_Tuple;
+    for (auto &a : t->args)v->fields.push_back(eval(*a, env));
+  } else if (auto *i = dynamic_cast<if_then_else *>(&e)) {
+    return eval(eval(*i->condition, env)->word == uint_to_v(1) ? *i->true_branch : *i->false_branch, env);
+  } else if (auto *s = dynamic_cast<seq *>(&e)) {
+    eval(*s->a, env);
+    return eval(*s->b, env);
+  } else if (auto *a = dynamic_cast<fun_app *>(&e)) {
+    value_ptr f = eval(*a->f, env);
+    return apply(f, eval(*a->x, env));
+  } else if (auto *m = dynamic_cast<match_with *>(&e)) {
+    value_ptr what = eval(*m->what, env);
+    for (auto &b : m->branches)if (match(*b.pattern, what, env))return eval(*b.result, env);
+    throw gave_up{}; // the program fails at runtime
+  } else if (auto *l = dynamic_cast<let_in *>(&e)) {
+    if (l->d->rec)throw gave_up{};
+    for (auto &def : l->d->defs)if (!match(*def.name, eval(*def.e, env), env))throw gave_up{};
+    return eval(*l->e, env);
+  } else if (auto *f = dynamic_cast<fun *>(&e)) {
+    v->f = f;
+    for (const auto *c : f->captures) {
+      auto it = env.find(c);
+      if (it == env.end())throw gave_up{};
+      v->env.emplace(c, it->second);
+    }
+  } else throw gave_up{}; // e.g. a destroy
+  return v;
+}
+
+evaluator::value_ptr evaluator::apply(const value_ptr &f, const value_ptr &x) {
+  auto g = std::make_shared<value>(*f);
+  g->fields.push_back(x);
+  if (!g->f) {
+    const size_t arity = g->funblock->name.starts_with("__unary_op__") ? 1 : 2;
+    return g->fields.size() < arity ? g : builtin(g->funblock->name, g->fields);
+  }
+  if (g->fields.size() < g->f->args.size())return g;
+  if (++depth > max_depth)throw gave_up{};
+  env_t env = g->env;
+  for (size_t i = 0; i < g->f->args.size(); ++i)if (!match(*g->f->args[i], g->fields[i], env))throw gave_up{};
+  value_ptr r = eval(*g->f->body, env);
+  --depth;
+  return r;
+}
+
+evaluator::value_ptr evaluator::builtin(std::string_view op, const std::vector<value_ptr> &args) const {
+  // on the ints as the runtime sees them, wrapping around at 63 bits
+  auto to_int = [](const value_ptr &v) { return int64_t(v->word) >> 1; };
+  auto v = std::make_shared<value>();
+  auto set_int = [&v](uint64_t x) { v->word = (x << 1) | 1; };
+  const int64_t a = to_int(args.at(0));
+  if (op == "__unary_op__MINUS__") {
+    set_int(-uint64_t(a));
+    return v;
+  }
+  const int64_t b = to_int(args.at(1));
+  if (op == "__binary_op__PLUS__")set_int(uint64_t(a) + uint64_t(b));
+  else if (op == "__binary_op__MINUS__")set_int(uint64_t(a) - uint64_t(b));
+  else if (op == "__binary_op__STAR__")set_int(uint64_t(a) * uint64_t(b));
+  else if (op == "__binary_op__SLASH__") {
+    if (b == 0)throw gave_up{};
+    set_int(uint64_t(a / b));
+  } else if (op == "__binary_op__EQUAL__")v->word = uint_to_v(a == b);
+  else if (op == "__binary_op__NOT_EQUAL__")v->word = uint_to_v(a != b);
+  else if (op == "__binary_op__LESS_THAN__")v->word = uint_to_v(a < b);
+  else if (op == "__binary_op__LESS_EQUAL_THAN__")v->word = uint_to_v(a <= b);
+  else if (op == "__binary_op__GREATER_THAN__")v->word = uint_to_v(a > b);
+  else if (op == "__binary_op__GREATER_EQUAL_THAN__")v->word = uint_to_v(a >= b);
+  else THROW_INTERNAL_ERROR
+  return v;
+}
+
+bool evaluator::match(matcher::t &m, const value_ptr &v, env_t &env) const {
+  using namespace matcher;
+  if (auto *u = dynamic_cast<universal *>(&m)) {
+    env[u] = v;
+    return true;
+  }
+  if (dynamic_cast<ignore *>(&m))return true;
+  if (auto *l = dynamic_cast<matcher::literal *>(&m)) {
+    if (dynamic_cast<const ast::literal::string *>(l->value.get()))throw gave_up{};
+    return !v->tag && v->word == l->value->to_value();
+  }
+  if (auto *t = dynamic_cast<tuple *>(&m)) {
+    for (size_t i = 0; i < t->args.size(); ++i)if (!match(*t->args[i], v->fields.at(i), env))return false;
+    return true;
+  }
+  auto *c = dynamic_cast<constructor *>(&m);
+  if (!c)THROW_INTERNAL_ERROR
+  if (!c->arg)return !v->tag && v->word == c->definition_point->tag_id;
+  if (!v->tag || *v->tag != c->definition_point->tag_id)return false;
+  if (c->definition_point->args.size() == 1)return match(*c->arg, v->fields.at(0), env);
+  if (dynamic_cast<ignore *>(c->arg.get()))return true;
+  auto *t = dynamic_cast<tuple *>(c->arg.get());
+  if (!t)throw gave_up{};
+  for (size_t i = 0; i < t->args.size(); ++i)if (!match(*t->args[i], v->fields.at(i), env))return false;
+  return true;
+}
+
+// closures and partial applications have no static representation, unlike the toplevel functions
+bool evaluator::is_static(const value_ptr &v) const {
+  std::vector<const value *> todo = {v.get()};
+  std::unordered_set<const value *> seen;
+  while (!todo.empty()) {
+    const value *w = todo.back();
+    todo.pop_back();
+    if (w->funblock && w->fields.empty())continue;
+    if (w->f || w->funblock)return false;
+    if (!w->tag || !w->label.empty() || !seen.insert(w).second)continue;
+    for (const auto &f : w->fields)todo.push_back(f.get());
+  }
+  return true;
+}
+
+std::string evaluator::serialise(const value_ptr &v, std::ostream &data) const {
+  static size_t id_factory = 0;
+  std::vector<const value *> todo; // with a stack rather than recursing, as long lists are deep
+  auto word = [&todo](const value_ptr &w) {
+    if (w->funblock)return w->funblock->ir_asm_name();
+    if (!w->tag)return std::to_string(int64_t(w->word));
+    if (w->label.empty()) {
+      w->label = std::string("__static_block_").append(std::to_string(++id_factory)).append("__");
+      todo.push_back(w.get());
+    }
+    return w->label;
+  };
+  std::string v_word = word(v);
+  while (!todo.empty()) {
+    const value *b = todo.back();
+    todo.pop_back();
+    data << b->label << " dq " << make_header(*b->tag, b->fields.size(), 0, 0);
+    for (const auto &f : b->fields)data << ", " << word(f);
+    data << "\n";
+  }
+  return v_word;
 }
 
 namespace type::expression {
@@ -41,6 +41,15 @@ public:
        << " is unused";
   }
 };
+class unreachable_branch : public util::message::warning_token {
+public:
+  unreachable_branch(std::string_view pattern)
+      : util::message::warning_token(pattern) {}
+  void describe(std::ostream &os) const {
+    os << "pattern " << util::message::style::bold << token << util::message::style::clear
+       << " is unreachable, the patterns before it already match everything it would";
+  }
+};
 class unbound_value : public base, public util::message::error_token {
 public:
   unbound_value(std::string_view value)
@@ -230,12 +239,33 @@ typedef std::unique_ptr<t> ptr;
 typedef std::unordered_map<std::string_view, matcher::universal *> global_names_map;
 typedef std::unordered_map<const matcher::universal *, ::type::expression::t> global_types_map;
 typedef std::unordered_map<const matcher::universal *, ::type::arena::idx_t> local_types_map;
+typedef std::vector<std::pair<const expression::t *, ::type::arena::idx_t>> typed_expressions_list;
 struct tc_section {
   const global_types_map &global;
   local_types_map &local;
   ::type::arena &arena;
+  typed_expressions_list &typed; // expressions whose ir destroy class is set from their type, once unified
   typedef ::type::arena::idx_t idx_t;
 };
+ir::lang::destroy_class_t ir_destroy_class_of_type(const ::type::arena &arena, ::type::arena::idx_t id);
+// Generates a destructor for each variant type the program drops, at the types its params are instantiated with: it
+// knows which fields of each constructor are immediates and skips them, and frees a last field of the same type (the
+// tail of a list, the right child of a tree) in a loop. It's called as destroy_nontrivial_preserving is, and falls back
+// on it for the blocks with a destructor, in the lazy mode of destruction, and for the other dying fields, which keeps
+// the destruction of any structure in constant stack space.
+struct destructors {
+  static constexpr size_t max_depth = 8; // of nested types whose destructor is generated only to be jumped to
+  // none is generated for the profiling mode, where the runtime has to see every block freed
+  explicit destructors(bool enabled = true) : enabled(enabled) {}
+  std::string_view of_type(::type::arena &arena, ::type::arena::idx_t id, size_t depth = 0); // "" if none is needed
+  void emit(std::ostream &text) const;
+private:
+  bool enabled;
+  std::unordered_map<std::string, std::string> names; // type key -> label
+  std::vector<std::string> code;
+};
+// to be called once the typecheck of a section is complete
+void ir_annotate_destroy_classes(tc_section tcs, destructors &ds);
 struct tr_section {
   const global_types_map &global;
   local_types_map &local;
@@ -247,17 +277,21 @@ struct tr_section {
 typedef std::forward_list<expression::identifier *> usage_list;
 typedef std::unordered_map<std::string_view, usage_list> free_vars_t;
 typedef std::unordered_set<const matcher::universal *> capture_set;
+typedef std::unordered_map<const matcher::universal *, matcher::universal *> clone_map; // original binder -> its copy
 
 namespace expression {
 
 struct t : public locable, public texp_of_t {
   using locable::locable;
+  mutable ir::lang::destroy_class_t ir_destroy_class = ir::lang::value; // strongest class allowed by the type
+  mutable std::string_view ir_destructor; // specialised destructor of the type, see destructors
   virtual free_vars_t free_vars() = 0; // computes the free variable of an expression
   virtual capture_set capture_group() = 0; // computes the set of non-global universal_macthers free in e
   virtual ir::lang::var ir_compile(ir_sections_t) = 0; // generate ir code, returning the var containing the result
   virtual void bind(const ::type::constr_map &) = 0;
   virtual bool is_constexpr() const = 0;
   virtual tc_section::idx_t typecheck(tc_section tcs) const = 0;
+  virtual ptr clone(clone_map &) const = 0; // deep copy, where the names bound inside get fresh universals
   template<typename Fun>
   void for_each_identifier(const Fun &fun_);
 };
@@ -272,6 +306,7 @@ struct literal : public t {
   ir::lang::var ir_compile(ir_sections_t) final;
   void bind(const constr_map &) final {}
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
   bool is_constexpr() const final { return true; }
 TO_TEXP(value);
 };
@@ -288,6 +323,7 @@ struct identifier : public t {
   bool is_constexpr() const final { return true; }
 TO_TEXP(name);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 };
 
 struct constructor : public t {
@@ -303,6 +339,7 @@ struct constructor : public t {
   bool is_constexpr() const final { return arg ? arg->is_constexpr() : true; }
 TO_TEXP(name, arg);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 
 };
 
@@ -318,6 +355,7 @@ struct if_then_else : public t {
   }
 TO_TEXP(condition, true_branch, false_branch);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 
 };
 
@@ -338,6 +376,7 @@ struct tuple : public t {
 
 TO_TEXP(args);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 
 };
 
@@ -352,6 +391,7 @@ struct fun_app : public t {
 
 TO_TEXP(f, x);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 
 };
 
@@ -366,6 +406,7 @@ struct destroy : public t {
 
 TO_TEXP(obj, d);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 
 };
 
@@ -380,6 +421,7 @@ struct seq : public t {
 
 TO_TEXP(a, b);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 
 };
 
@@ -392,6 +434,7 @@ struct match_with : public t {
   };
   expression::ptr what;
   std::vector<branch> branches;
+  bool report_unreachable = true; // false for the copies made by the inliner, the original reports them once
   explicit match_with(expression::ptr &&w);
   free_vars_t free_vars() final;;
 
@@ -402,6 +445,7 @@ struct match_with : public t {
 
 TO_TEXP(what, branches);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 
 };
 
@@ -416,6 +460,7 @@ struct let_in : public t {
   bool is_constexpr() const final { return false; }
 TO_TEXP(d, e);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
 
 };
 
@@ -434,7 +479,12 @@ struct fun : public t {
   bool is_constexpr() const final { return true; }
 TO_TEXP(args, body);
   std::string ir_compile_global(ir_sections_t s);
+  void ir_compile_direct(ir_sections_t s);
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  expression::ptr clone(clone_map &) const final;
+  std::string ir_text_ptr; // generic entry point, taking the last Arg block
+  std::string ir_direct_text_ptr; // entry point taking the args in registers, empty if there is none
+  void ir_name_entry_points(bool with_direct);
 
 };
 
@@ -450,8 +500,8 @@ struct t : public locable, texp_of_t {
   virtual void ir_allocate_global_value(std::ostream &os) = 0;
   virtual void ir_global_unroll(ir::scope &s, ir::lang::var v) = 0; // match value in v, unrolling on globals
   virtual void ir_locally_unroll(ir::scope &s, ir::lang::var v) = 0; // match value in v, unrolling on locals
-  virtual ir::lang::var ir_test_unroll(ir::scope &s, ir::lang::var v) = 0;
   virtual tc_section::idx_t typecheck(tc_section tcs) const = 0;
+  virtual ptr clone(clone_map &) const = 0; // the copied universals are recorded in the map
   virtual std::list<const universal *> universals() const = 0;
   virtual void for_each_universal(const std::function<void(universal&)>& f) = 0;
   template<typename Fun,typename State>
@@ -467,7 +517,11 @@ struct universal : public t {
   // 1. It has a static address which doesn't expire
   // 2. Hence closures do not need to capture this
   // 3. It's type doesn't get changed by type inference - unified on a "per use" basis
-  ir::lang::var ir_var; //useless if toplevel; otherwise identifies which var to use (both locally and captured)
+  mutable ir::lang::var ir_var; //useless if toplevel; otherwise identifies which var to use (both locally and captured)
+  std::string ir_direct_text_ptr; // non-empty if toplevel function which can be called directly once saturated
+  size_t ir_direct_n_args = 0;
+  const expression::fun *ir_lifted = nullptr; // local function only ever called saturated: no closure, its direct
+  // entry point takes the captures after the args
   explicit universal(std::string_view n);
   void bind(free_vars_t &fv) final;
   void bind(capture_set &cs) final;
@@ -486,13 +540,13 @@ struct universal : public t {
   void ir_allocate_global_constrimm(std::ostream &os, const ::type::function::variant::constr &constr);
   void ir_global_unroll(ir::scope &s, ir::lang::var) final;
   void ir_locally_unroll(ir::scope &s, ir::lang::var v) final;
-  ir::lang::var ir_test_unroll(ir::scope &s, ir::lang::var v) final { return s.declare_constant(3); }
   std::string_view name;
   usage_list usages;
 TO_TEXP(name)
   void ir_allocate_globally_funblock(std::ostream &os, size_t n_args, std::string_view text_ptr);
   ir::var ir_evaluate_global(ir::scope &s) const;
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  matcher::ptr clone(clone_map &) const final;
   std::list<const universal *> universals() const final;
   void for_each_universal(const std::function<void(universal&)>& f) final {
     return f(*this);
@@ -509,8 +563,8 @@ struct ignore : public t {
   void ir_globally_register(global_names_map &m) final;
   void ir_global_unroll(ir::scope &s, ir::lang::var) final {}
   void ir_locally_unroll(ir::scope &s, ir::lang::var v) final {}
-  ir::lang::var ir_test_unroll(ir::scope &s, ir::lang::var v) final { return s.declare_constant(3); }
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  matcher::ptr clone(clone_map &) const final;
   std::list<const universal *> universals() const final;
   void for_each_universal(const std::function<void(universal&)>& f) final {}
 TO_TEXP_EMPTY()
@@ -533,8 +587,8 @@ struct constructor : public t {
   void ir_allocate_global_value(std::ostream &os) final;
   void ir_global_unroll(ir::scope &s, ir::lang::var) final;
   void ir_locally_unroll(ir::scope &s, ir::lang::var v) final;
-  ir::lang::var ir_test_unroll(ir::scope &s, ir::lang::var v) final;
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  matcher::ptr clone(clone_map &) const final;
   std::list<const universal *> universals() const final;
   void for_each_universal(const std::function<void(universal&)>& f) final {if(arg)arg->for_each_universal(f);}
 TO_TEXP(cons, arg);
@@ -555,8 +609,8 @@ struct literal : public t {
   void ir_allocate_global_value(std::ostream &os) final {}
   void ir_global_unroll(ir::scope &s, ir::lang::var) final {}
   void ir_locally_unroll(ir::scope &s, ir::lang::var v) final {}
-  ir::lang::var ir_test_unroll(ir::scope &s, ir::lang::var v) final;
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  matcher::ptr clone(clone_map &) const final;
   std::list<const universal *> universals() const final;
   void for_each_universal(const std::function<void(universal&)>& f) final {}
 TO_TEXP(value);
@@ -574,8 +628,8 @@ struct tuple : public t {
   void ir_globally_register(global_names_map &m) final;
   void ir_global_unroll(ir::scope &s, ir::lang::var) final;
   void ir_locally_unroll(ir::scope &s, ir::lang::var v) final;
-  ir::lang::var ir_test_unroll(ir::scope &main, ir::lang::var v) final;
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  matcher::ptr clone(clone_map &) const final;
   std::list<const universal *> universals() const final;
   void for_each_universal(const std::function<void(universal&)>& f) final {for(auto &p : args)p->for_each_universal(f);}
 TO_TEXP(args);
@@ -589,6 +643,7 @@ struct t : public texp_of_t {
   virtual uint64_t to_value() const = 0;
   virtual ir::lang::var ir_compile(ir_sections_t) const = 0;
   virtual tc_section::idx_t typecheck(tc_section tcs) const = 0;
+  virtual ptr clone() const = 0;
 };
 struct integer : public t {
   int64_t value;
@@ -596,6 +651,7 @@ struct integer : public t {
   uint64_t to_value() const final;
   ir::lang::var ir_compile(ir_sections_t) const final;
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  literal::ptr clone() const final;
 TO_TEXP(value)
 };
 struct boolean : public t {
@@ -604,6 +660,7 @@ struct boolean : public t {
   uint64_t to_value() const final;
   ir::lang::var ir_compile(ir_sections_t) const final;
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  literal::ptr clone() const final;
 TO_TEXP(value)
 };
 struct unit : public t {
@@ -611,6 +668,7 @@ struct unit : public t {
   uint64_t to_value() const final { return 1; }
   ir::lang::var ir_compile(ir_sections_t) const final;
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  literal::ptr clone() const final;
 
 TO_TEXP_EMPTY()
 };
@@ -621,6 +679,7 @@ struct string : public t {
   uint64_t to_value() const final;
   ir::lang::var ir_compile(ir_sections_t) const final;
   tc_section::idx_t typecheck(tc_section tcs) const final;
+  literal::ptr clone() const final;
 
 TO_TEXP(value)
 };
@@ -650,7 +709,9 @@ struct t : public locable, public texp_of_t {
 
   void ir_compile_global(ir_sections_t s);
   void ir_compile_locally(ir_sections_t s);
+  void ir_lift_functions(expression::t &in); // sets ir_lifted of the functions only called saturated in "in"
   void typecheck(tc_section tcs) const;
+  ptr clone(clone_map &cm) const;
 
   void bind(const constr_map &cm);
 
@@ -660,6 +721,48 @@ typedef std::unique_ptr<t> ptr;
 
 }
 
+// Substitutes the body of small non-recursive toplevel functions at their saturated call sites, binding the
+// parameters to the arguments with lets. Sections are inlined once their names are resolved, before capture_group
+// and typecheck, so that those see the inlined code like any other.
+struct inliner {
+  static constexpr size_t default_budget = 12;
+  explicit inliner(size_t budget) : budget(budget) {}
+  void inline_calls(expression::ptr &e);
+  void inline_calls(definition::t &d);
+  void record(definition::t &d); // the functions of d become candidates for the sections that follow
+private:
+  size_t budget; // largest body inlined, in expression nodes; 0 disables inlining
+  std::unordered_map<const matcher::universal *, const expression::fun *> candidates;
+  std::vector<expression::ptr> dropped; // identifiers taken out of the tree, still among the usages of what they name
+};
+
+// Computes the pure toplevel definitions at compile time, so that instead of main building their values at startup,
+// these are serialised in .data as static blocks (refcount 0, never freed). A definition is left to main if its
+// evaluation runs out of fuel or recursion depth, calls an impure builtin, fails a match or divides by 0, or if its
+// value can't be static (e.g. a closure, a string).
+struct evaluator {
+  static constexpr size_t default_fuel = 1000000;
+  static constexpr size_t max_depth = 2000; // of nested calls, the evaluation recurses on the native stack
+  explicit evaluator(size_t fuel) : fuel(fuel) {}
+  bool evaluate(definition::t &d, std::ostream &data); // true if the values of d are now in data
+  void record(definition::t &d); // the functions of d can be called by the definitions that follow
+private:
+  struct value;
+  typedef std::shared_ptr<const value> value_ptr;
+  typedef std::unordered_map<const matcher::universal *, value_ptr> env_t;
+  struct gave_up {};
+  value_ptr eval(expression::t &e, env_t &env);
+  value_ptr apply(const value_ptr &f, const value_ptr &x);
+  value_ptr builtin(std::string_view op, const std::vector<value_ptr> &args) const;
+  bool match(matcher::t &m, const value_ptr &v, env_t &env) const;
+  bool is_static(const value_ptr &v) const;
+  std::string serialise(const value_ptr &v, std::ostream &data) const; // the word to write, e.g. a label
+  size_t fuel; // evaluation steps allowed to each definition, 0 disables the evaluation
+  size_t steps_left = 0, depth = 0;
+  env_t globals; // toplevel names with a static value
+  std::unordered_map<const matcher::universal *, const expression::fun *> functions; // toplevel functions
+};
+
 namespace error{
 
 class rec_def_invalid_rhs : public base, public util::message::vector {
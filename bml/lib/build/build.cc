@@ -31,7 +31,7 @@ std::pair<ast::global_names_map, ast::global_types_map> make_ir_data_section(std
   ast::global_names_map global_names;
   ast::global_types_map global_types;
   target << "section .data\n";
-  target << "extern apply_fn, destroy_nontrivial, decrement_nontrivial, decrement_value, increment_value, malloc, json_debug\n";
+  target << "extern apply_fn, destroy_nontrivial, destroy_nontrivial_preserving, decrement_nontrivial, decrement_value, increment_value, fast_malloc, fast_malloc_preserving, fast_malloc_free_list, fast_malloc_freed, fast_malloc_carved, lazy_free_budget, json_debug\n";
 
   ir_registerer_t ir_registerer{.names=global_names, .types = global_types, .data=target};
 
@@ -50,7 +50,9 @@ std::pair<ast::global_names_map, ast::global_types_map> make_ir_data_section(std
   register("_mllib_fn__int_div", 2, "__binary_op__SLASH__", iii);
   register("_mllib_fn__int_neg", 1, "__unary_op__MINUS__", ii);
   register("_mllib_fn__int_eq", 2, "__binary_op__EQUAL__", iib);
+  register("_mllib_fn__int_neq", 2, "__binary_op__NOT_EQUAL__", iib);
   register("_mllib_fn__t_phys_eq", 2, "__binary_op__PHYS_EQUAL__", tf_fun(_a, tf_fun(_a, tf_bool)));
+  register("_mllib_fn__t_phys_neq", 2, "__binary_op__NOT_PHYS_EQUAL__", tf_fun(_a, tf_fun(_a, tf_bool)));
   register("_mllib_fn__int_lt", 2, "__binary_op__LESS_THAN__", iib);
   register("_mllib_fn__int_leq", 2, "__binary_op__LESS_EQUAL_THAN__", iib);
   register("_mllib_fn__int_gt", 2, "__binary_op__GREATER_THAN__", iib);
@@ -163,10 +165,14 @@ void record_typedef(type::constr_map &constr_map,
 //TODO: check ownership of constructors
 }
 
-void build_ir(std::string_view s, std::ostream &target, std::string_view filename) {
+void build_ir(std::string_view s, std::ostream &target, std::string_view filename, std::ostream *allocation_report,
+              size_t inline_budget, size_t eval_fuel, size_t fused_words, bool profile) {
   util::message::global.clear();
   parse::tokenizer tk(s);
   auto[global_names, global_types] = make_ir_data_section(target);
+  if (profile)
+    target << "extern alloc_profile_live_words, alloc_profile_peak_words, alloc_profile_increments, alloc_profile_decrements, "
+              "alloc_profile_overwritten\n";
   for (const auto&[k, v] : global_types)assert(v.is_valid());
 
   type::type_map type_map = type::make_default_type_map();
@@ -177,6 +183,11 @@ void build_ir(std::string_view s, std::ostream &target, std::string_view filenam
   std::vector<type::function::variant::ptr> variants;
   ir::lang::function main;
   main.name = "main";
+  ast::inliner inliner(inline_budget);
+  ast::evaluator evaluator(eval_fuel);
+  ast::destructors destructors(!profile);
+  ir::alloc_sites sites(s, filename);
+  ir::alloc_sites *const profiled_sites = profile ? &sites : nullptr;
 
   while (!tk.empty()) {
     while (tk.peek() == parse::EOC)tk.pop();
@@ -190,11 +201,14 @@ void build_ir(std::string_view s, std::ostream &target, std::string_view filenam
         ast::free_vars_t fv = d->free_vars();
         resolve_global_free_vars(std::move(fv), global_names);
         for (auto &def : d->defs)def.name->ir_globally_register(global_names);
+        inliner.inline_calls(*d);
         auto cg = d->capture_group();
         assert(cg.empty());
         ast::local_types_map local_types;
+        ast::typed_expressions_list typed;
         type::arena arena;
-        d->typecheck(ast::tc_section{global_types, local_types, arena});
+        d->typecheck(ast::tc_section{global_types, local_types, arena, typed});
+        ast::ir_annotate_destroy_classes(ast::tc_section{global_types, local_types, arena, typed}, destructors);
         for (auto&[m, id] : local_types)
           if (m->top_level) {
             auto t = arena.to_typeexpr(id);
@@ -202,7 +216,10 @@ void build_ir(std::string_view s, std::ostream &target, std::string_view filenam
             std::cout << m->name << " : " << t << std::endl;
             global_types.try_emplace(m, std::move(t));
           }
-        d->ir_compile_global(ir_sections_t(target, std::back_inserter(functions), main));
+        if (!evaluator.evaluate(*d, target))
+          d->ir_compile_global(ir_sections_t(target, std::back_inserter(functions), main, fused_words, profiled_sites));
+        inliner.record(*d);
+        evaluator.record(*d);
         defs.push_back(std::move(d));
       } catch (util::message::base &e) {
         e.link_file(s, filename);
@@ -228,14 +245,17 @@ void build_ir(std::string_view s, std::ostream &target, std::string_view filenam
         e->bind(constr_map);
         ast::free_vars_t fv = e->free_vars();
         resolve_global_free_vars(std::move(fv), global_names);
+        inliner.inline_calls(e);
         auto cg = e->capture_group();
         assert(cg.empty());
         ast::local_types_map local_types;
+        ast::typed_expressions_list typed;
         type::arena arena;
-        auto t = arena.to_typeexpr(e->typecheck(ast::tc_section{global_types, local_types, arena}));
+        auto t = arena.to_typeexpr(e->typecheck(ast::tc_section{global_types, local_types, arena, typed}));
+        ast::ir_annotate_destroy_classes(ast::tc_section{global_types, local_types, arena, typed}, destructors);
         t.poly_normalize();
         std::cout << " - : " << t << std::endl;
-        e->ir_compile(ir_sections_t(target, std::back_inserter(functions), main));
+        e->ir_compile(ir_sections_t(target, std::back_inserter(functions), main, fused_words, profiled_sites));
 
       } catch (util::message::base &e) {
         e.link_file(s, filename);
@@ -244,16 +264,21 @@ void build_ir(std::string_view s, std::ostream &target, std::string_view filenam
       }
     }
   }
-  target << "__global_dealloc_fn__ dq 0, 4294967300,global_dealloc,3; global_dealloc : funblock\n" ;;
+  target << "__global_dealloc_fn__ dq " << ir::make_header(1, 2, 0, 0) << ",global_dealloc,3; global_dealloc : funblock\n";
   target << "global main\n" "section .text\n";
   main.declare_assign(ir::rhs_expr::apply_fn{.f = main.declare_global("__global_dealloc_fn__"),.x = main.declare_constant(1)});
   main.ret = main.declare_constant(0);
   functions.push_back(std::move(main));
+  ir::lang::unbox_tuple_returns(functions);
+  ir::lang::infer_borrowed_args(functions);
   for (auto &f : functions) {
 //    f.pre_compile();
 //    f.print(std::cout);
-    f.compile(target);
+    auto stats = f.compile(target, profile);
+    if (allocation_report)
+      *allocation_report << f.name << ": " << stats.spills << " spills, " << stats.stack_slots << " stack slots\n";
   }
+  destructors.emit(target);
   //global destroy
 
   target << "global_dealloc:\n" ;
@@ -279,6 +304,10 @@ void build_ir(std::string_view s, std::ostream &target, std::string_view filenam
   });
   target << "add rsp, 8\n";
   target << "mov eax, 1\nret\n";
+  if (profile) {
+    target << "section .data\n";
+    sites.emit(target);
+  }
 
   //output warnings
   for (const auto&[n, m] : global_names)
@@ -10,7 +10,17 @@ struct build_params {
   std::ostream& print_compiled_signature;
 };
 
-void build_ir(std::string_view s, std::ostream &target, std::string_view filename = "source.ml");
+// allocation_report, if given, gets the spills and stack slots of every compiled function
+// inline_budget is the size of the largest function body inlined at its call sites, 0 disables inlining
+// eval_fuel bounds the compile time evaluation of each toplevel definition, 0 leaves them all to main
+// fused_words bounds the single allocation the blocks of nested constructors are carved out of, 0 (the default) disables
+// the fusion: the carved pieces are freed into the smaller classes, so a loop that keeps fusing grows the heap, and a
+// runtime built with FAST_MALLOC_USE_LIBC doesn't link with fused allocations
+// profile instruments the allocations and the refcount operations, for a runtime built with ALLOC_PROFILE (see rt.c)
+void build_ir(std::string_view s, std::ostream &target, std::string_view filename = "source.ml",
+              std::ostream *allocation_report = nullptr, size_t inline_budget = ast::inliner::default_budget,
+              size_t eval_fuel = ast::evaluator::default_fuel, size_t fused_words = 0,
+              bool profile = false);
 /*
  IDEA for tests:
  1. let (a,b) = fun () -> 3 ;;  // Error: This expression should not be a function, the expected type is 'a * 'b
@@ -19,14 +19,30 @@ struct test_params {
   expect_str_t expected_stdout = "";
   expect_str_t expected_stderr = "";
   int expected_exit_code = 0;
+  size_t inline_budget = ast::inliner::default_budget;
+  size_t eval_fuel = ast::evaluator::default_fuel;
+  const char *lazy_free = nullptr; // BML_LAZY_FREE for the run of the program, unset if null
+  bool alloc_stats = false; // BML_ALLOC_STATS for the run of the program, the counters are then in stderr
+  size_t fused_words = 0; // the debug runtime routes everything through malloc/free: either of these needs the slabs
+  bool profile = false; // compiled with the profiling mode, linked with the runtime built with ALLOC_PROFILE
 };
 
+// with libc malloc/free, so that valgrind sees every block
 void compile_lib_debug() {
   static bool compiled = false;
   if (compiled)return;
   compiled = true;
   ASSERT_EQ(system(
-      "gcc -c /home/luke/CLionProjects/compilers/bml/lib/rt/rt.c -o /home/luke/CLionProjects/compilers/bml/lib/rt/rt.o -g -O0 -Wall"),
+      "gcc -c /home/luke/CLionProjects/compilers/bml/lib/rt/rt.c -o /home/luke/CLionProjects/compilers/bml/lib/rt/rt.o -g -O0 -Wall -DFAST_MALLOC_USE_LIBC"),
+            0);
+}
+
+void compile_lib_slab() {
+  static bool compiled = false;
+  if (compiled)return;
+  compiled = true;
+  ASSERT_EQ(system(
+      "gcc -c /home/luke/CLionProjects/compilers/bml/lib/rt/rt.c -o /home/luke/CLionProjects/compilers/bml/lib/rt/rt_slab.o -g -O0 -Wall"),
             0);
 }
 
@@ -39,6 +55,15 @@ void compile_lib_release() {
             0);
 }
 
+void compile_lib_profile() {
+  static bool compiled = false;
+  if (compiled)return;
+  compiled = true;
+  ASSERT_EQ(system(
+      "gcc -c /home/luke/CLionProjects/compilers/bml/lib/rt/rt.c -o /home/luke/CLionProjects/compilers/bml/lib/rt/rt_profile.o -g -O0 -Wall -DALLOC_PROFILE"),
+            0);
+}
+
 void test_build(std::string_view source, test_params tp) {
 
   if (tp.sandbox_timeout && tp.use_valgrind) {
@@ -46,20 +71,32 @@ void test_build(std::string_view source, test_params tp) {
               << std::endl;
     tp.use_valgrind = false;
   }
-  if (tp.use_release_lib)compile_lib_release();
+  const bool use_slab_lib = tp.alloc_stats || tp.fused_words;
+  if (tp.profile)compile_lib_profile();
+  else if (tp.use_release_lib)compile_lib_release();
+  else if (use_slab_lib)compile_lib_slab();
   else compile_lib_debug();
 #define target  "/home/luke/CLionProjects/compilers/cmake-build-debug/output"
   std::ofstream oasm;
   oasm.open(target ".asm");
-  ASSERT_NO_THROW(build_ir(source, oasm));
+  ASSERT_NO_THROW(build_ir(source, oasm, "source.ml", nullptr, tp.inline_budget, tp.eval_fuel, tp.fused_words,
+                           tp.profile));
   oasm.close();
 
   ASSERT_EQ(system("yasm -g dwarf2 -f elf64 " target ".asm -l " target ".lst -o " target ".o"), 0);
-  if (tp.use_release_lib)
+  if (tp.profile)
+    ASSERT_EQ(system("gcc -no-pie " target ".o /home/luke/CLionProjects/compilers/bml/lib/rt/rt_profile.o -o " target), 0);
+  else if (tp.use_release_lib)
     ASSERT_EQ(system("gcc -no-pie " target ".o /home/luke/CLionProjects/compilers/bml/lib/rt/rt_fast.o -o " target), 0);
+  else if (use_slab_lib)
+    ASSERT_EQ(system("gcc -no-pie " target ".o /home/luke/CLionProjects/compilers/bml/lib/rt/rt_slab.o -o " target), 0);
   else
     ASSERT_EQ(system("gcc -no-pie " target ".o /home/luke/CLionProjects/compilers/bml/lib/rt/rt.o -o " target), 0);
 
+  if (tp.lazy_free)setenv("BML_LAZY_FREE", tp.lazy_free, 1);
+  else unsetenv("BML_LAZY_FREE");
+  if (tp.alloc_stats)setenv("BML_ALLOC_STATS", "1", 1);
+  else unsetenv("BML_ALLOC_STATS");
   int exit_code;
   if (tp.sandbox_timeout)
     exit_code = WEXITSTATUS(system("timeout 1 " target " 2> " target ".stderr 1> " target ".stdout"));
@@ -334,6 +371,539 @@ TEST(Build, LongSum) {
              "print_int ans ;;", {.expected_stdout = "66 "});
 }
 
+TEST(Build, DirectCalls) {
+  test_build(R"(
+let add3 a b c = a + b + c;;
+let rec even n = if n = 0 then true else odd (n-1)
+and odd n = if n = 0 then false else even (n-1);;
+let mk_adder n = fun x -> x + n;;
+let twice x = (x, x);;
+print_int (add3 1 2 3);;
+let partial = add3 10 ;;
+print_int (partial 20 30);;
+print_bool (odd 7);;
+print_int (mk_adder 3 4);;
+let (a, b) = twice (1, 2) ;;
+)", {.expected_stdout = "6 60 true 7 "});
+}
+
+TEST(Build, TailCallThroughApplyFn) {
+  test_build(R"(
+let apply f x = f x;;
+let rec down n = if n = 0 then 7 else apply down (n-1);;
+print_int (down 3000000);;
+let rec spin k n = if n = 0 then k 0 else (let g = spin in g k (n-1));;
+print_int (spin (fun x -> x + 1) 3000000);;
+)", {.expected_stdout = "7 1 "});
+}
+
+TEST(Build, CurriedPartialApplications) {
+  test_build(R"(
+let add4 a b c d = a + b + c + d;;
+let p1 = add4 1;;
+let p2 = p1 2;;
+print_int (p2 3 4);;
+print_int (p2 30 40);;
+print_int (p1 20 30 40);;
+let mk x = fun a b c -> a + b + c + x;;
+let c = mk 1000;;
+let c1 = c 1;;
+print_int (c1 2 3);;
+print_int (c1 20 30);;
+let apply3 f = f 1 2 3;;
+print_int (apply3 (add4 10));;
+print_int (apply3 (fun a b c -> a * b * c));;
+)", {.expected_stdout = "10 73 91 1006 1051 16 6 "});
+}
+
+TEST(Build, SelfTailCallLoops) {
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec range_ i acc = if i < 0 then acc else range_ (i-1) (Cons(i,acc));;
+let rec sum_ l acc = match l with | Nil -> acc | Cons(x,xs) -> sum_ xs (acc+x);;
+print_int (sum_ (range_ 999999 Nil) 0);;
+let rec fib_ n a b = if n = 0 then a else fib_ (n-1) b (a+b);;
+print_int (fib_ 50 0 1);;
+)", {.expected_stdout = "499999500000 12586269025 "});
+}
+
+TEST(Build, TypeDirectedDestroyClasses) {
+  test_build(R"(
+type color = | Red | Green | Blue;;
+type 'a opt = | None | Some of 'a;;
+let next c = match c with | Red -> Green | Green -> Blue | Blue -> Red;;
+let code c = match c with | Red -> 1 | Green -> 2 | Blue -> 3;;
+let id x = x;;
+let first p = let (a, _) = p in a;;
+let get d o = match o with | None -> d | Some x -> x;;
+print_int (code (next (next Red)));;
+print_int (id 41 + 1);;
+print_str (id "s");;
+print_str (first ("t", 0));;
+print_int (first (7, "u"));;
+print_int (get 0 (Some 5) + get 1 None);;
+print_str (get "d" (Some "e"));;
+let rec count n acc = if n = 0 then acc else count (n - 1) (if n < 10 then acc + 1 else acc);;
+print_int (count 100 0);;
+)", {.expected_stdout = "3 42 st7 6 e9 "});
+}
+
+TEST(Build, ReuseDeadBlocks) {
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec range_ i acc = if i < 0 then acc else range_ (i-1) (Cons(i,acc));;
+let rec rev_ l acc = match l with | Nil -> acc | Cons(x,xs) -> rev_ xs (Cons(x,acc));;
+let rec map_ f l = match l with | Nil -> Nil | Cons(x,xs) -> Cons(f x, map_ f xs);;
+let rec sum_ l acc = match l with | Nil -> acc | Cons(x,xs) -> sum_ xs (acc+x);;
+let rec first_ l = match l with | Nil -> 0 | Cons(x,_) -> x;;
+let shared = range_ 9 Nil;;
+let r = rev_ shared Nil;;
+print_int (first_ r);;
+print_int (first_ shared);;
+print_int (sum_ (map_ (fun x -> x * 2) (rev_ (range_ 99999 Nil) Nil)) 0);;
+let strs = rev_ (Cons("a", Cons("b", Nil))) Nil;;
+let pairs = map_ (fun s -> (s, s)) strs;;
+let Cons((s,_),_) = pairs;;
+print_str s;;
+)", {.expected_stdout = "9 0 9999900000 b"});
+}
+
+TEST(Build, ReuseDeadBlocksOfGlobals) {
+  //the slot of a global is owned by global_dealloc: matching on a global and rebuilding must not take it over
+  std::string_view source = R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec range_ i acc = if i < 0 then acc else range_ (i-1) (Cons(i,acc));;
+let rec sum_ l acc = match l with | Nil -> acc | Cons(x,xs) -> sum_ xs (acc+x);;
+let rec len_ l acc = match l with | Nil -> acc | Cons(_,xs) -> len_ xs (acc+1);;
+let total = sum_ (range_ 2 Nil);;
+print_int (total 0);;
+let g = Cons("x", Cons("y", Nil));;
+let h = match g with | Nil -> Nil | Cons(_, t) -> Cons("z", t);;
+print_int (len_ h 0);;
+print_int (total 1);;
+)";
+  test_build(source, {.expected_stdout = "3 2 4 "});
+  test_build(source, {.expected_stdout = "3 2 4 ", .eval_fuel = 0});
+}
+
+TEST(Build, BorrowedArgs) {
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec range_ i acc = if i < 0 then acc else range_ (i-1) (Cons(i,acc));;
+let rec length_ l acc = match l with | Nil -> acc | Cons(_,l) -> length_ l (acc+1);;
+let rec nth d l n = match l with | Nil -> d | Cons(x,xs) -> if n = 0 then x else nth d xs (n-1);;
+let rec same_length a b = match a with
+  | Nil -> (match b with | Nil -> true | Cons(_,_) -> false)
+  | Cons(_,xs) -> (match b with | Nil -> false | Cons(_,ys) -> same_length xs ys);;
+let l = range_ 99999 Nil;;
+print_int (length_ l 0);;
+print_int (nth 0 l 4242);;
+print_bool (same_length l l);;
+let len = length_ (range_ 9 Nil);;
+print_int (len 0 + len 100);;
+let strs = Cons("x", Cons("y", Nil));;
+let snd_str = nth "" strs;;
+print_str (snd_str 1);;
+)", {.expected_stdout = "100000 4242 true 120 y"});
+}
+
+TEST(Build, FusedCompareBranch) {
+  test_build(R"(
+type 'a option = | None | Some of 'a ;;
+let rec fib n = if n < 2 then n else fib (n - 1) + fib (n - 2);;
+let print_cmp a b = print_bool (a < b); print_bool (a <= b); print_bool (a > b); print_bool (a >= b);
+                    print_bool (a = b); print_bool (a <> b);;
+print_cmp 1 2;;
+print_cmp (-5) (-5);;
+println_int (fib 20);;
+let x = Some 1;;
+let y = x;;
+print_bool (x == y); print_bool (x !== y); print_bool (x == Some 1);;
+println_int (if 0 < fib 3 then 1 else 0);;
+  )", {.expected_stdout = "true true false false false true false true false true true false 6765\n"
+                          "true false false 1\n"});
+}
+
+TEST(Build, TaggedArithmetic) {
+  test_build(R"(
+let rec fact n = if n = 0 then 1 else n * fact (n - 1);;
+let f a b c = print_int (a - b); print_int (3 - a); print_int (-a); print_int (a * 8); print_int (a * (-5));
+              print_int (a * b * c); print_int ((a + b) * (c - 1));;
+f 7 (-3) 5;;
+let g x = print_int (x / 2); print_int (x / 7); print_int (x / (-4)); print_int (x / 4611686018427387903);;
+g 100; g (-100); g (-4611686018427387904);;
+println_int (fact 10 + 4611686018427387903 + 1);;
+  )", {.expected_stdout = "10 -4 -7 56 -35 -105 16 50 14 -25 0 -50 -14 25 0 "
+                          "-2305843009213693952 -658812288346769700 1152921504606846976 -1 "
+                          "-4611686018423759104\n"});
+}
+
+TEST(Build, BranchLayoutMerge) {
+  test_build(R"(
+type t = | A | B of int | C of int * int | D of t * t;;
+let rec weight x = match x with | A -> 1 | B n -> n + 2 | C(a, b) -> a * b + weight A | D(l, r) -> weight l + weight r;;
+let pick a b c = let x = if a < b then weight (B c) else c + a in
+                 let y = if b < c then a + x else weight (C(a, x)) in x + y + a + b + c;;
+let rec loop i acc = if i = 0 then acc else loop (i - 1) (acc + pick i (i + 1) (i / 7));;
+print_int (weight (D(D(A, B 3), C(4, 5))));;
+print_int (loop 1000 0);;
+print_int (pick 3 2 1);;
+)", {.expected_stdout = "27 49623570 23 "});
+}
+
+TEST(Build, FrameAllocatedTuples) {
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec len l = match l with | Nil -> 0 | Cons(_, t) -> 1 + len t;;
+let f x y = let (a, b) = (x + 1, y * 2) in a + b;;
+let g l = let (p, q) = (Cons(1, l), l) in len p + len q;;
+print_int (f 3 4);;
+print_int (g (Cons(5, Cons(6, Nil))));;
+let x,y = 42,108 ~> (fun t -> print_str "with destructor ");;
+print_int (x + y);;
+)", {.expected_stdout = "12 5 with destructor 150 "});
+}
+
+TEST(Build, FrameBlocksReuseFreeSlots) {
+  std::string_view source = R"(
+type t = | A | B of int | C of int * int;;
+let rec weight x = match x with | A -> 1 | B n -> n + 2 | C (a, b) -> a * b;;
+let h a b = let x = weight (C (a, b)) in let y = weight (B (x + a)) in let z = weight (C (y, b)) in x + y + z;;
+print_int (h 3 4);;
+)";
+  test_build(source, {.expected_stdout = "97 "});
+  // each block dies before the next one, which takes its slots instead of growing the frame
+  std::stringstream oasm;
+  build_ir(source, oasm);
+  EXPECT_THAT(oasm.str(), testing::HasSubstr("in the frame, in free slots"));
+}
+
+TEST(Build, UnboxedTupleReturns) {
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec len l = match l with | Nil -> 0 | Cons(_, t) -> 1 + len t;;
+let rec split l = match l with | Nil -> (0, 0) | Cons(h, t) -> let (a, b) = split t in (b, a + h);;
+let rec partition p l = match l with
+  | Nil -> (Nil, Nil)
+  | Cons(h, t) -> let (a, b) = partition p t in if p h then (Cons(h, a), b) else (a, Cons(h, b));;
+let dup x = (x, x);;
+let l = Cons(1, Cons(2, Cons(3, Cons(4, Cons(5, Nil)))));;
+let (x, y) = split l;;
+print_int (x * 100 + y);;
+let (small, big) = partition (fun x -> x < 3) l;;
+print_int (len small * 10 + len big);;
+let (d, _) = dup l;;
+print_int (len d);;
+let twice = dup;;
+let (a, b) = twice 21;;
+print_int (a + b);;
+)", {.expected_stdout = "609 23 5 42 "});
+}
+
+TEST(Build, Inlining) {
+  std::string_view source = R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec length_ l acc = match l with | Nil -> acc | Cons(_, l) -> length_ l (acc + 1)
+and length l = length_ l 0;;
+let tee f x = f x; x;;
+let k = 10;;
+let addk x = x + k;;
+let k = 1000;;
+let fst (a, _) = a;;
+let compose f g = fun x -> f (g x);;
+let pick a b = b;;
+let twice f = f (f 1);;
+print_int (tee addk 5 + fst (7, ()));;
+print_int (length (Cons(1, Cons(2, Nil))));;
+print_int ((compose addk addk) k);;
+print_int (pick (print_int 1; 2) (print_int 3; 4));;
+let a = 5;;
+print_int (twice (fun x -> x + a));;
+print_int (let k = 7 in addk k);;
+)";
+  test_build(source, {.expected_stdout = "12 2 1020 1 3 4 11 17 "});
+  test_build(source, {.expected_stdout = "12 2 1020 1 3 4 11 17 ", .inline_budget = 0});
+}
+
+TEST(Build, InliningLocalArgs) {
+  std::string_view source = R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec len l = match l with | Nil -> 0 | Cons(_, t) -> 1 + len t;;
+let d a b = a / b;;
+let apply f x = f x;;
+let pair x y = (x, y);;
+let go n m = let q = d n m in let k = (fun z -> z + q) in let (a, b) = pair q n in apply k a + b + d q m;;
+let both l = let (x, y) = pair l l in len x + len y;;
+print_int (go 100 7);;
+print_int (both (Cons(1, Cons(2, Nil))));;
+)";
+  test_build(source, {.expected_stdout = "130 4 "});
+  // the local names passed are substituted for the parameters, instead of being copied into them
+  testing::internal::CaptureStderr();
+  std::stringstream oasm;
+  build_ir(source, oasm);
+  EXPECT_THAT(testing::internal::GetCapturedStderr(), testing::Not(testing::HasSubstr("Variable copy")));
+}
+
+TEST(Build, InliningReportsWarningsOnce) {
+  std::string_view source = R"(
+let f x = match x with | _ -> 1 | 2 -> 3;;
+print_int (f 1 + f 2 + f 3);;
+)";
+  test_build(source, {.expected_stdout = "3 "});
+  // the inlined copies of the match don't repeat the warning of the original
+  testing::internal::CaptureStdout();
+  std::stringstream oasm;
+  build_ir(source, oasm);
+  const std::string warnings = testing::internal::GetCapturedStdout();
+  const std::string_view unreachable = "is unreachable";
+  const size_t first = warnings.find(unreachable);
+  EXPECT_NE(first, std::string::npos);
+  EXPECT_EQ(warnings.find(unreachable, first + 1), std::string::npos);
+}
+
+TEST(Build, LambdaLifting) {
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec sum_scaled l k acc =
+  let scale x = x * k + acc in
+  match l with
+  | Nil -> acc
+  | Cons(h, t) -> sum_scaled t k (scale h);;
+print_int (sum_scaled (Cons(1, Cons(2, Cons(3, Nil)))) 2 0);;
+let rec map f l = match l with | Nil -> Nil | Cons(h, t) -> Cons(f h, map f t);;
+let rec print_list l = match l with | Nil -> () | Cons(h, t) -> print_int h; print_list t;;
+let shift_all l d =
+  let shift x = x + d in
+  map shift l;;
+print_list (shift_all (Cons(1, Cons(2, Nil))) 10);;
+let pick c a b =
+  let f x = if c then x + a else x + b in
+  (fun y -> if y > 0 then f y else a);;
+print_int ((pick true 100 200) 1);;
+print_int ((pick false 100 200) 1);;
+print_int ((pick false 100 200) 0);;
+let outer l =
+  let tag = Cons(7, Nil) in
+  let g x = match tag with | Nil -> x | Cons(t, _) -> x + t in
+  let h y = g (g y) in
+  h 1 + g 2;;
+print_int (outer Nil);;
+let adders n = let add x = x + n in (add 1, add 2);;
+let (p, q) = adders 40;;
+print_int (p + q);;
+)", {.expected_stdout = "12 11 12 101 201 100 24 83 "});
+}
+
+TEST(Build, CompileTimeEvaluation) {
+  std::string_view source = R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+type 'a option = | None | Some of 'a;;
+let rec range a b = if a > b then Nil else Cons(a, range (a + 1) b);;
+let rec map f l = match l with | Nil -> Nil | Cons(h, t) -> Cons(f h, map f t);;
+let rec sum l = match l with | Nil -> 0 | Cons(h, t) -> h + sum t;;
+let rec find k l = match l with | Nil -> None | Cons((a, b), t) -> if a = k then Some b else find k t;;
+let squares = map (fun x -> x * x) (range 1 1000);;
+let total = sum squares;;
+let table = map (fun x -> (x, x * 10 - 7 / 2)) (range 1 20);;
+let (lo, hi) = (total / 1000 - 1000, Cons(total, squares));;
+let add = (+);;
+let flag = find 3 table;;
+let late = (print_int 5; sum (range 1 3));;
+let inc = add 1;;
+let deep = sum (range 1 1900);;
+print_int total;;
+print_int lo;;
+print_int (match hi with | Nil -> 0 | Cons(a, Cons(b, _)) -> a - b | _ -> 1);;
+print_int (match flag with | None -> 0 | Some v -> v);;
+print_int (match find 7 table with | None -> 0 | Some v -> v);;
+print_int (add late (inc deep));;
+)";
+  test_build(source, {.expected_stdout = "5 333833500 332833 333833499 27 67 1805957 "});
+  test_build(source, {.expected_stdout = "5 333833500 332833 333833499 27 67 1805957 ", .eval_fuel = 100});
+  test_build(source, {.expected_stdout = "5 333833500 332833 333833499 27 67 1805957 ", .eval_fuel = 0});
+}
+
+TEST(Build, IterativeDestruction) {
+  std::string_view source = R"(
+type tree = | Leaf | Node of tree * int * tree;;
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec left n acc = if n = 0 then acc else left (n - 1) (Node (acc, n, Leaf));;
+let rec right n acc = if n = 0 then acc else right (n - 1) (Node (Leaf, n, acc));;
+let rec range a b acc = if a > b then acc else range a (b - 1) (Cons (b, acc));;
+let rec count l acc = match l with | Nil -> acc | Cons (_, t) -> count t (acc + 1);;
+let rec many n = if n = 0 then 0 else (let t = left 100 Leaf in match t with | Leaf -> many (n - 1) | Node (_, v, _) -> v + many (n - 1));;
+print_int (count (range 1 200000 Nil) 0);;
+print_int (match right 200000 Leaf with | Leaf -> 0 | Node (_, v, _) -> v);;
+print_int (match left 200000 Leaf with | Leaf -> 0 | Node (_, v, _) -> v);;
+print_int (many 1000);;
+)";
+  test_build(source, {.expected_stdout = "200000 1 1 1000 "});
+  test_build(source, {.expected_stdout = "200000 1 1 1000 ", .lazy_free = "8"});
+}
+
+TEST(Build, SpecialisedDestructors) {
+  std::string_view source = R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+type 'a option = | None | Some of 'a;;
+type shape = | Dot | Seg of int * int | Poly of int * int list option;;
+let rec range a b acc = if a > b then acc else range a (b - 1) (Cons (b, acc));;
+let rec sum l acc = match l with | Nil -> acc | Cons (x, t) -> sum t (acc + x);;
+let rec rows n acc = if n = 0 then acc else rows (n - 1) (Cons (range 1 n Nil, acc));;
+let rec sums l acc = match l with | Nil -> acc | Cons (r, t) -> sums t (acc + sum r 0);;
+let rec shapes n acc = if n = 0 then acc else shapes (n - 1) (Cons ((if n - n / 3 * 3 = 0 then Dot else if n - n / 3 * 3 = 1 then Seg (n, n) else Poly (n, Some (range 1 3 Nil))), acc));;
+let area s = match s with | Dot -> 0 | Seg (a, b) -> a + b | Poly (n, None) -> n | Poly (n, Some l) -> sum l n;;
+let rec areas l acc = match l with | Nil -> acc | Cons (s, t) -> areas t (acc + area s);;
+print_int (sum (range 1 100000 Nil) 0);;
+print_int (sums (rows 300 Nil) 0);;
+print_int (areas (shapes 3000 Nil) 0);;
+)";
+  test_build(source, {.expected_stdout = "5000050000 4545100 4505500 "});
+  test_build(source, {.expected_stdout = "5000050000 4545100 4505500 ", .lazy_free = "8"});
+}
+
+TEST(Build, SpecialisedDestructorsOfSizes) {
+  //the last constructor is the one left once the others are ruled out, each block goes back to the class of its size
+  std::string_view source = R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+type t = | Big of int * int * int * int | Small of int list;;
+let mk n = if n = 0 then Big (1, 2, 3, 4) else Small (Cons (n, Cons (n, Nil)));;
+let get v = match v with | Big (a, b, c, d) -> a + b + c + d | Small l -> (match l with | Nil -> 0 | Cons (x, _) -> x);;
+let rec loop i acc = if i = 0 then acc else (let bg = mk 0 in let s1 = mk 7 in let s2 = mk 9 in loop (i - 1) (acc + get bg + get s1 + get s2));;
+print_int (loop 100 0);;
+)";
+  test_build(source, {.expected_stdout = "2600 ", .expected_stderr = ::testing::MatchesRegex(
+      R"(fast_malloc: [0-9]+ chunks of [0-9]+ bytes
+ +words +allocated +bumped +freed +live
+( +[0-9a-z]+ +[0-9]+ +[-0-9]+ +[0-9]+ +0
+)+)"), .alloc_stats = true});
+}
+
+TEST(Build, DestructorSlotLiveCounts) {
+  //a block whose destructor has run is freed with its destructor slot, into the class it was allocated from
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec mk n acc = if n = 0 then acc else mk (n - 1) (Cons (n, acc) ~> (fun t -> ()));;
+let rec len l acc = match l with | Nil -> acc | Cons (_, t) -> len t (acc + 1);;
+print_int (len (mk 100 Nil) 0);;
+)", {.expected_stdout = "100 ", .expected_stderr = ::testing::MatchesRegex(
+      R"(fast_malloc: [0-9]+ chunks of [0-9]+ bytes
+ +words +allocated +bumped +freed +live
+( +[0-9a-z]+ +[0-9]+ +[-0-9]+ +[0-9]+ +0
+)+)"), .alloc_stats = true});
+}
+
+TEST(Build, DroppedPartialApplicationLiveCounts) {
+  //an unsaturated Arg block is freed with the room for its missing args, into the class it was allocated from
+  test_build(R"(
+let add3 a b c = a + b + c;;
+let first f g = f 0 0;;
+let rec loop n acc = if n = 0 then acc else loop (n - 1) (acc + first (add3 n) (add3 1 n));;
+print_int (loop 1000 0);;
+)", {.expected_stdout = "500500 ", .expected_stderr = ::testing::MatchesRegex(
+      R"(fast_malloc: [0-9]+ chunks of [0-9]+ bytes
+ +words +allocated +bumped +freed +live
+( +[0-9a-z]+ +[0-9]+ +[-0-9]+ +[0-9]+ +0
+)+)"), .alloc_stats = true});
+}
+
+TEST(Build, AllocationFusion) {
+  std::string_view source = R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+type 'a option = | None | Some of 'a;;
+let rec sum l = match l with | Nil -> 0 | Cons (x, t) -> x + sum t;;
+let rec len l = match l with | Nil -> 0 | Cons (_, t) -> 1 + len t;;
+let three a b c = Cons (a, Cons (b, Cons (c, Nil)));;
+let pair a b = (Cons (a, Nil), Some (Cons (b, Nil)));;
+let rec loop n acc = if n = 0 then acc else loop (n - 1) (acc + sum (three n 1 2));;
+let rec loop2 n acc = if n = 0 then acc else (match pair n n with | (l, Some m) -> loop2 (n - 1) (acc + sum l + len m) | (_, None) -> 0);;
+let rec push n l = if n = 0 then l else push (n - 1) (Cons (n, Cons (n, Cons (n, Cons (n, Cons (n, Cons (n, l)))))));;
+print_int (loop 10000 0);;
+print_int (loop2 10000 0);;
+print_int (len (push 1000 Nil));;
+print_int (sum (Cons (1, Cons (2, Cons (3, Cons (4, Cons (5, Cons (6, Cons (7, Nil)))))))));;
+)";
+  test_build(source, {.expected_stdout = "50035000 50015000 6000 28 ", .fused_words = ir::fast_malloc_max_words});
+  test_build(source, {.expected_stdout = "50035000 50015000 6000 28 ", .fused_words = 4});
+  test_build(source, {.expected_stdout = "50035000 50015000 6000 28 ", .fused_words = 0});
+}
+
+TEST(Build, AllocationProfile) {
+  std::string_view source = R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec map f l = match l with | Nil -> Nil | Cons (x, t) -> Cons (f x, map f t);;
+let rec range a b = if a > b then Nil else Cons (a, range (a + 1) b);;
+let rec sum l = match l with | Nil -> 0 | Cons (x, t) -> x + sum t;;
+let add k = fun x -> x + k;;
+let pairs l = map (fun x -> (x, x)) l;;
+let rec fsts l = match l with | Nil -> 0 | Cons ((a, _), t) -> a + fsts t;;
+print_int (sum (map (add 3) (range 1 100)));;
+print_int (fsts (pairs (range 1 10)));;
+)";
+  //the sites come by bytes allocated; the blocks of map are reused in place, the partial applications are the runtime's
+  //(the tags of the constructors depend on the tests before)
+  test_build(source, {.expected_stdout = "5350 55 ", .expected_stderr = ::testing::MatchesRegex(
+      R"(\{"allocated": 234, "reused": 110, "freed": 234, "increments": [0-9]+, "decrements": [0-9]+, "live_bytes": 0, .*)"
+      R"(\{"tag": 2, "allocated": 113, "runtime_allocated": 113, "reused": 0, "freed": 113, "overwritten": 0\}.*)"
+      R"(\{"location": "source.ml:4:44", "kind": "Cons", "tag": [0-9]+, "bytes": 24, "allocated": 110, "reused": 0\}.*)"
+      R"(\{"location": "source.ml:3:62", "kind": "Cons", "tag": [0-9]+, "bytes": 24, "allocated": 0, "reused": 110\}\]\}
+)"), .profile = true});
+}
+
+TEST(Build, AllocationProfileRetags) {
+  //a block reused in place for another constructor counts as overwritten for its old tag, as reused for its new one
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+type ab = | A of int * int | B of int * int;;
+let flip v = match v with | A (x, y) -> B (y, x) | B (x, y) -> A (y, x);;
+let rec mk n acc = if n = 0 then acc else mk (n - 1) (Cons (A (n, 0), acc));;
+let rec flips l = match l with | Nil -> Nil | Cons (v, t) -> Cons (flip v, flips t);;
+let rec sum l = match l with | Nil -> 0 | Cons (A (x, y), t) -> x + sum t | Cons (B (x, y), t) -> y + sum t;;
+print_int (sum (flips (mk 10 Nil)));;
+)", {.expected_stdout = "55 ", .expected_stderr = ::testing::MatchesRegex(
+      R"(\{"allocated": 22, "reused": 20, "freed": 22, .*)"
+      R"(\{"tag": [0-9]+, "allocated": 10, "runtime_allocated": 0, "reused": 0, "freed": 0, "overwritten": 10\}.*)"
+      R"(\{"tag": [0-9]+, "allocated": 0, "runtime_allocated": 0, "reused": 10, "freed": 10, "overwritten": 0\}.*)"),
+      .profile = true});
+}
+
+TEST(Build, AllocationProfileLocalFunctions) {
+  //the closure of a local function is located at its binding
+  test_build(R"(
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let rec map f l = match l with | Nil -> Nil | Cons (x, t) -> Cons (f x, map f t);;
+let rec sum l = match l with | Nil -> 0 | Cons (x, t) -> x + sum t;;
+let scale k l =
+  let h x = x * k in
+  map h l;;
+print_int (sum (scale 3 (Cons (1, Cons (2, Nil)))));;
+)", {.expected_stdout = "9 ", .expected_stderr = ::testing::MatchesRegex(
+      R"(.*\{"location": "source.ml:6:7", "kind": "closure", "tag": 1, "bytes": 32, "allocated": 1, "reused": 0\}.*)"),
+      .profile = true});
+}
+
+TEST(Build, MatchDecisionTree) {
+  test_build(R"(
+type color = | Red | Green | Blue | Yellow | Rgb of int * int * int;;
+let name c = match c with | Red -> 1 | Green -> 2 | Blue -> 3 | Yellow -> 4 | Rgb(r,_,_) -> r;;
+print_int (name Red + name Blue * 10 + name Yellow * 100 + name (Rgb(7,0,0)) * 1000);;
+type 'a list = | Nil | Cons of 'a * 'a list;;
+let both a b = match (a, b) with
+  | (Nil, Nil) -> 1
+  | (Cons(_, _), Nil) -> 2
+  | (_, Cons(y, _)) -> 10 * y;;
+print_int (both Nil Nil + both (Cons(1, Nil)) Nil * 10 + both Nil (Cons(3, Nil)) * 100 + both (Cons(1, Nil)) (Cons(4, Nil)) * 1000);;
+let f n = match n with | 0 -> 10 | 1 -> 11 | 2 -> 12 | 3 -> 13 | _ -> 99;;
+print_int (f 0 + f 2 + f 3 + f 7);;
+let g l = match l with | Cons(_, Nil) -> 1 | Cons(_, Cons(_, _)) -> 2 | Nil -> 0 | Cons(_, _) -> 5;;
+print_int (g Nil + g (Cons(1, Nil)) * 10 + g (Cons(1, Cons(2, Nil))) * 100);;
+let cmp3 a b = match (a > b, a = b) with | (true, _) -> 1 | (_, true) -> 0 | (false, false) -> 2;;
+print_int (cmp3 5 1 * 100 + cmp3 1 1 * 10 + cmp3 1 5);;
+let big x = match x with | 5000000000 -> 1 | 7 -> 2 | 12 -> 4 | _ -> 5;;
+print_int (big 5000000000 + big 7 * 10 + big 12 * 1000 + big 5000000001 * 10000);;
+)", {.expected_stdout = "7431 43021 134 210 102 54021 "});
+}
+
 TEST(Build, DeepCapture) {
   test_build("let deep_capture x = fun () -> fun () -> fun () -> fun () -> fun () -> fun () -> fun () -> x ;;"
              "      print_int (deep_capture 1729 () () () () () () ());;",
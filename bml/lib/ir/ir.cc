@@ -1,6 +1,8 @@
 #include <ir.h>
 #include <lang.h>
 #include <iostream>
+#include <functional>
+#include <map>
 
 namespace ir {
 using namespace util;
@@ -49,13 +51,57 @@ std::string_view to_string(register_t r) {
   }
   THROW_INTERNAL_ERROR
 }
+std::string_view to_string_low_byte(register_t r) {
+  switch (r) {
+
+    case rax:return "al";
+    case rcx:return "cl";
+    case rdx:return "dl";
+    case r8:return "r8b";
+    case r9:return "r9b";
+    case r10:return "r10b";
+    case r11:return "r11b";
+    case rdi:return "dil";
+    case rbx:return "bl";
+    case rbp:return "bpl";
+    case rsi:return "sil";
+    case r12:return "r12b";
+    case r13:return "r13b";
+    case r14:return "r14b";
+    case r15:return "r15b";
+  }
+  THROW_INTERNAL_ERROR
+}
 }
 namespace {
 
+size_t branch_id_factory = 0; // labels are shared by all the functions of the output
+
+// x86 immediates are 32 bits, sign extended to 64: wider constants have to be loaded in a register first
+void materialize_wide_immediate(context_t &c, var v, std::ostream &os) {
+  if (auto k = c.is_constant(v); k && int64_t(*k) != int64_t(int32_t(*k)))c.devirtualize(v, os);
+}
+
+// where loop_back jumps: past the saves of the non-volatiles, that are made once at the entry of the function
+std::string loop_head(std::string_view function) { return std::string(function) + ".loop"; }
+
 template<typename T, typename V>
 bool contains(const V &v, const T &k) {
   return std::find(v.cbegin(), v.cend(), k) != v.cend();
 }
+
+// the profiling mode counts the words taken from the allocator, and the most of them live at once; the runtime scratch
+// register must be free
+void count_live_words(size_t words, std::ostream &os) {
+  const std::string scratch(reg::to_string(reg::runtime_scratch));
+  const size_t done = ++branch_id_factory;
+  os << "add qword [alloc_profile_live_words], " << words << "\n";
+  os << "mov " << scratch << ", qword [alloc_profile_live_words]\n";
+  os << "cmp " << scratch << ", qword [alloc_profile_peak_words]\n";
+  os << "jbe .L" << done << "\n";
+  os << "mov qword [alloc_profile_peak_words], " << scratch << "\n";
+  os << ".L" << done << "\n";
+}
 }
 std::ostream &operator<<(std::ostream &os, const context_t::streamable &s) {
   s.context.retrieve(s.v, os);
@@ -68,6 +114,36 @@ std::ostream &operator<<(std::ostream &os, const offset &o) {
   return os;
 }
 context_t::streamable::streamable(const context_t &context, var v) : context(context), v(v) {}
+size_t alloc_sites::add(std::string_view loc, std::string_view kind, uint32_t tag, size_t words) {
+  std::string location(filename);
+  if (!loc.empty() && loc.begin() >= source.begin() && loc.end() <= source.end()) {
+    const size_t line = std::count(source.begin(), loc.begin(), '\n') + 1;
+    const size_t column = loc.begin() - std::find(std::make_reverse_iterator(loc.begin()), source.rend(), '\n').base() + 1;
+    location.append(":").append(std::to_string(line)).append(":").append(std::to_string(column));
+  }
+  entries.push_back(entry{.location = std::move(location), .kind = std::string(kind), .tag = tag, .words = words});
+  return entries.size();
+}
+std::string alloc_sites::allocated(size_t site) {
+  assert(site);
+  return "qword [alloc_profile_sites+" + std::to_string((site - 1) * entry_words * 8) + "]";
+}
+std::string alloc_sites::reused(size_t site) {
+  assert(site);
+  return "qword [alloc_profile_sites+" + std::to_string((site - 1) * entry_words * 8 + 8) + "]";
+}
+void alloc_sites::emit(std::ostream &data) const {
+  data << "global alloc_profile_sites, alloc_profile_n_sites\n";
+  data << "alloc_profile_n_sites dq " << entries.size() << "\n";
+  data << "alloc_profile_sites:\n";
+  for (size_t k = 0; k < entries.size(); ++k)
+    data << "dq 0,0," << entries[k].words << "," << entries[k].tag << ",__alloc_site_location_" << k
+         << "__,__alloc_site_kind_" << k << "__\n";
+  for (size_t k = 0; k < entries.size(); ++k) {
+    data << "__alloc_site_location_" << k << "__ db \"" << entries[k].location << "\",0\n";
+    data << "__alloc_site_kind_" << k << "__ db \"" << entries[k].kind << "\",0\n";
+  }
+}
 std::unordered_set<var> scope_setup_destroys(scope &s, std::unordered_set<var> to_destroy) {
   s.destroys.clear();
   s.destroys.resize(s.body.size() + 1, {});
@@ -75,6 +151,7 @@ std::unordered_set<var> scope_setup_destroys(scope &s, std::unordered_set<var> t
     if (std::holds_alternative<instruction::assign>(i)) {
       const auto &ia = std::get<instruction::assign>(i);
       to_destroy.insert(ia.dst);
+      if (const auto *cd = std::get_if<rhs_expr::call_direct>(&ia.src))to_destroy.insert(cd->results.begin(), cd->results.end());
     }
 
   auto destroy_here = [&](var v, size_t i) {
@@ -96,12 +173,21 @@ std::unordered_set<var> scope_setup_destroys(scope &s, std::unordered_set<var> t
               [&](rhs_expr::memory_access &ma) {
                 destroy_here(ma.base, i);
               },
-              [](rhs_expr::malloc &m) {
+              [&](rhs_expr::malloc &m) {
+                if (m.reuse)destroy_here(*m.reuse, i);
+                if (m.carved_from)destroy_here(*m.carved_from, i);
               },
               [&](rhs_expr::apply_fn &a) {
                 destroy_here(a.f, i);
                 destroy_here(a.x, i);
               },
+              [&](rhs_expr::call_direct &cd) {
+                for (var x : cd.args)destroy_here(x, i);
+                for (var r : cd.results)destroy_here(r, i); // only if never used
+              },
+              [&](rhs_expr::loop_back &lb) {
+                for (var x : lb.args)destroy_here(x, i);
+              },
               [&](rhs_expr::branch &b) {
                 auto s1 = scope_setup_destroys(b->jmp_branch, to_destroy);
                 auto s2 = scope_setup_destroys(b->nojmp_branch, to_destroy);
@@ -118,6 +204,21 @@ std::unordered_set<var> scope_setup_destroys(scope &s, std::unordered_set<var> t
                 assert(s1 == s2);
                 to_destroy = s1;
               },
+              [&](rhs_expr::switch_branch &sw) {
+                // as for branch: a var that dies in some cases only is destroyed at the start of the others
+                std::vector<std::unordered_set<var>> left;
+                for (scope *b : sw->branches())left.push_back(scope_setup_destroys(*b, to_destroy));
+                std::unordered_set<var> in_all = left.front();
+                for (const auto &l : left)std::erase_if(in_all, [&](var v) { return !l.contains(v); });
+                for (size_t k = 0; k < left.size(); ++k)
+                  for (var v : left[k])
+                    if (!in_all.contains(v))sw->branches()[k]->destroys[0].push_back(v);
+                to_destroy = in_all;
+                if (to_destroy.contains(sw->v)) {
+                  for (scope *b : sw->branches())b->destroys[0].push_back(sw->v);
+                  to_destroy.erase(sw->v);
+                }
+              },
               [&](rhs_expr::unary_op &b) { destroy_here(b.x, i); },
               [&](rhs_expr::binary_op &b) {
                 destroy_here(b.x1, i);
@@ -153,6 +254,22 @@ std::unordered_set<var> scope_setup_destroys(scope &s, std::unordered_set<var> t
     }, s.body[i]);
   return to_destroy;
 }
+bool is_borrowed(const rhs_expr::call_direct &cd, size_t j) {
+  return j < cd.borrowed.size() && cd.borrowed[j];
+}
+// whether x is passed to a borrowed arg
+bool is_lent(const rhs_expr::call_direct &cd, var x) {
+  for (size_t j = 0; j < cd.args.size(); ++j)if (cd.args[j] == x && is_borrowed(cd, j))return true;
+  return false;
+}
+// whether a call lends a refcounted var, that will have to be destroyed after it returns
+bool lends_owned(const rhs_expr::t &e) {
+  const auto *cd = std::get_if<rhs_expr::call_direct>(&e);
+  if (!cd)return false;
+  for (size_t j = 0; j < cd->args.size(); ++j)
+    if (is_borrowed(*cd, j) && (cd->args[j].destroy_class() & non_trivial))return true;
+  return false;
+}
 bool unroll_last_copy(scope &s) {
   if (s.body.empty())return false;
   if (!std::holds_alternative<instruction::assign>(s.body.back()))return false;
@@ -164,8 +281,55 @@ bool unroll_last_copy(scope &s) {
   return true;
 }
 
+namespace {
+constexpr size_t jump_table_min_cases = 3;
+// jumps to the branch of sw selected by sw.v; returns the labels to put in front of each of sw.branches()
+std::vector<size_t> switch_dispatch(const switch_table &sw, context_t &c, std::ostream &os) {
+  std::vector<size_t> labels;
+  for (size_t k = 0; k <= sw.cases.size(); ++k)labels.push_back(++branch_id_factory);
+  c.make_non_mem(sw.v, os);
+  if (sw.cases.empty()) {
+    os << "jmp .L" << labels.back() << "\n";
+    return labels;
+  }
+  const uint64_t lo = sw.cases.front().first, hi = sw.cases.back().first;
+  const bool dense = sw.cases.size() >= jump_table_min_cases && (hi - lo) / 2 < 2 * sw.cases.size()
+      && lo <= uint64_t(std::numeric_limits<int32_t>::max());
+  if (!dense) {
+    //keys wider than a sign extended imm32 are compared through the runtime scratch register
+    const auto wide = [](uint64_t key) { return int64_t(key) != int64_t(int32_t(key)); };
+    const std::string scratch(reg::to_string(reg::runtime_scratch));
+    if (std::any_of(sw.cases.begin(), sw.cases.end(), [&](const auto &k) { return wide(k.first); }))
+      c.clobber({reg::runtime_scratch}, os);
+    for (size_t k = 0; k < sw.cases.size(); ++k) {
+      if (wide(sw.cases[k].first)) {
+        os << "mov " << scratch << ", " << sw.cases[k].first << "\n";
+        os << "cmp " << c.at(sw.v) << ", " << scratch << "\n";
+      } else os << "cmp " << c.at(sw.v) << ", " << sw.cases[k].first << "\n";
+      os << "je .L" << labels[k] << "\n";
+    }
+    os << "jmp .L" << labels.back() << "\n";
+    return labels;
+  }
+  //keys are odd, so v - lo is already the offset of its entry, halved
+  const std::string scratch(reg::to_string(reg::runtime_scratch));
+  c.clobber({reg::runtime_scratch}, os);
+  const size_t table = ++branch_id_factory;
+  os << "mov " << scratch << ", " << c.at(sw.v) << "\n";
+  os << "sub " << scratch << ", " << lo << "\n";
+  os << "cmp " << scratch << ", " << hi - lo << "\n";
+  os << "ja .L" << labels.back() << "\n";
+  os << "jmp qword [.L" << table << "+" << scratch << "*4]\n";
+  os << "align 8\n";
+  os << ".L" << table << "\n";
+  for (uint64_t key = lo, k = 0; key <= hi; key += 2) {
+    if (sw.cases[k].first == key)os << "dq .L" << labels[k++] << "\n";
+    else os << "dq .L" << labels.back() << "\n";
+  }
+  return labels;
+}
+}
 context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_call) {
-  static size_t branch_id_factory = 0;
   while (unroll_last_copy(s)); //TODO: unroll all better
 
   bool need_to_return = last_call; //whether we'll return the final value
@@ -176,11 +340,37 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
 
   for (size_t i = 0; i < s.body.size(); ++i) {
     //os<<"; ";c.debug_vars(os);os<<"\n"; // print state infos
+    c.reach(s, i);
     std::vector<var> &destroys = s.destroys.at(i + 1);
     std::visit(overloaded{
         [&](instruction::assign &a) {
+          //move args into reg::args_order, leaving nothing else alive, then jump to label
+          auto tail_jump = [&](const std::vector<var> &args, std::string_view label, bool loop) {
+            assert(args.size() <= reg::args_order.size());
+            std::vector<std::pair<var, register_t>> moved;
+            std::vector<std::pair<var, register_t>> copied;
+            for (size_t j = 0; j < args.size(); ++j) {
+              const var x = args[j];
+              if (contains(destroys, x)) {
+                moved.emplace_back(x, reg::args_order[j]);
+                destroys.erase(std::find(destroys.begin(), destroys.end(), x));
+              } else {
+                //either virtual, or passed more than once
+                assert(c.is_virtual(x) || std::find(args.begin(), args.begin() + j, x) != args.begin() + j);
+                copied.emplace_back(x, reg::args_order[j]);
+              }
+            }
+            assert(destroys.empty());
+            for (const auto&[v, r] : copied)c.increment_refcount(v, os);
+            if (loop)c.loop_clean(moved, os);
+            else c.return_clean(moved, os);
+            c.call_copy(copied, os);
+            os << "jmp " << label << "\n";
+          };
           if (last_call && (i == s.body.size() - 1) && (a.dst==s.ret) && (std::holds_alternative<rhs_expr::apply_fn>(a.src)
-              || std::holds_alternative<rhs_expr::branch>(a.src))) {
+              || std::holds_alternative<rhs_expr::call_direct>(a.src) || std::holds_alternative<rhs_expr::loop_back>(a.src)
+              || std::holds_alternative<rhs_expr::branch>(a.src) || std::holds_alternative<rhs_expr::switch_branch>(a.src))
+              && !lends_owned(a.src)) {
             need_to_return = false;
             std::visit(overloaded{
                 [](const std::variant<rhs_expr::constant,
@@ -201,6 +391,11 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
                   c.return_clean({{fun.f, rdi}, {fun.x, rsi}}, os);
                   os << "jmp apply_fn\n"; //TODO avoid 2 jumps, go directly to function
                 },
+                [&](rhs_expr::call_direct &cd) { tail_jump(cd.args, cd.name, false); },
+                [&](rhs_expr::loop_back &lb) {
+                  os << "; loop back\n";
+                  tail_jump(lb.args, loop_head(lb.head), true);
+                },
                 [&](rhs_expr::branch &b) {
                   if (last_skipped_cmp_vars_simplified + 1 == i) {
                     os << "; optimized out branch\n";
@@ -213,6 +408,19 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
                   scope_compile_rec(b->nojmp_branch, os, c, true);
                   os << ".L" << this_branch << "\n";
                   scope_compile_rec(b->jmp_branch, os, c, true);
+                },
+                [&](rhs_expr::switch_branch &sw) {
+                  if (auto key = c.is_constant(sw->v); key) {
+                    os << "; optimized out switch\n";
+                    c = scope_compile_rec(sw->taken(key.value()), os, c, true);
+                    return;
+                  }
+                  const std::vector<size_t> labels = switch_dispatch(*sw, c, os);
+                  const std::vector<scope *> branches = sw->branches();
+                  for (size_t k = 0; k < branches.size(); ++k) {
+                    os << ".L" << labels[k] << "\n";
+                    scope_compile_rec(*branches[k], os, c, true);
+                  }
                 }
             }, a.src);
           } else {
@@ -249,9 +457,117 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
                   c.increment_refcount(a.dst, os);
                 },
                 [&](rhs_expr::malloc &m) {
-                  c.call_clean({}, os);
-                  os << "mov rdi, " << m.size * 8 << " \n";
-                  os << "call malloc\n";
+                  if (m.in_frame) {
+                    c.declare_frame_block(a.dst, m.size, os);
+                    return;
+                  }
+                  if (m.in_regs) {
+                    c.declare_register_block(a.dst, m.size);
+                    return;
+                  }
+                  if (m.carved_from) {
+                    c.declare_free(a.dst, os);
+                    c.make_both_non_mem(*m.carved_from, a.dst, os);
+                    os << "lea " << c.at(a.dst) << ", [" << c.at(*m.carved_from) << offset(m.carved_at * 8) << "]\n";
+                    if (m.site)os << "add " << alloc_sites::allocated(m.site) << ", 1 ; its words are counted with "
+                                  << *m.carved_from << "\n";
+                    return;
+                  }
+                  //only rax and the runtime scratch register are touched, even on the slow path
+                  const std::string scratch(reg::to_string(reg::runtime_scratch));
+                  c.clobber({rax, reg::runtime_scratch}, os);
+                  const size_t this_alloc_end = ++branch_id_factory;
+                  //a block reused in place skips the counting of the fresh ones
+                  const size_t this_alloc_counted = m.site && m.reuse ? ++branch_id_factory : this_alloc_end;
+                  if (m.reuse) {
+                    //a unique block of the same size is overwritten in place, once its fields are dropped
+                    const var v = *m.reuse;
+                    assert(contains(destroys, v));
+                    destroys.erase(std::find(destroys.begin(), destroys.end(), v));
+                    const size_t this_alloc_fresh = ++branch_id_factory;
+                    const size_t this_alloc_shared = ++branch_id_factory;
+                    const size_t this_alloc_unfit = ++branch_id_factory;
+                    os << "; reusing " << v << " : " << destroy_class_to_string(v.destroy_class()) << " \n";
+                    os << "mov rax, " << c.at(v) << "\n";
+                    if (v.destroy_class() & unboxed) {
+                      os << "test rax, 1\n";
+                      os << "jnz .L" << this_alloc_fresh << "\n";
+                    }
+                    os << "cmp dword [rax], 3\n";
+                    os << "jne .L" << this_alloc_shared << "\n";
+                    os << "cmp word [rax+4], " << 2 * (m.size - header_words) << " ; same size, no destructor\n";
+                    os << "jne .L" << this_alloc_unfit << "\n";
+                    os << "cmp word [rax+6], 1 ; Tag_Fun\n";
+                    os << "je .L" << this_alloc_unfit << "\n";
+                    os << "cmp word [rax+6], 3 ; Tag_String\n";
+                    os << "je .L" << this_alloc_unfit << "\n";
+                    for (size_t j = header_words; j < m.size; ++j) {
+                      const size_t field_done = ++branch_id_factory;
+                      os << "mov " << scratch << ", qword [rax+" << j * 8 << "]\n";
+                      os << "test " << scratch << ", 1\n";
+                      os << "jnz .L" << field_done << "\n";
+                      os << "cmp dword [" << scratch << "], 0\n";
+                      os << "je .L" << field_done << "\n";
+                      os << "sub dword [" << scratch << "], 2\n";
+                      if (c.profiling())os << "add qword [alloc_profile_decrements], 1\n";
+                      os << "cmp dword [" << scratch << "], 1\n";
+                      os << "jne .L" << field_done << "\n";
+                      os << "call destroy_nontrivial_preserving\n";
+                      os << ".L" << field_done << "\n";
+                    }
+                    if (m.site) {
+                      //the block changes tag: it counts as overwritten for the one it had (see alloc_profile_print)
+                      os << "add " << alloc_sites::reused(m.site) << ", 1\n";
+                      os << "movzx " << scratch << ", word [rax+6]\n";
+                      os << "add qword [alloc_profile_overwritten+" << scratch << "*8], 1\n";
+                    }
+                    os << "jmp .L" << this_alloc_counted << "\n";
+                    os << ".L" << this_alloc_unfit << "\n";
+                    os << "mov " << scratch << ", rax\n";
+                    os << "call destroy_nontrivial_preserving\n";
+                    os << "jmp .L" << this_alloc_fresh << "\n";
+                    os << ".L" << this_alloc_shared << "\n";
+                    if (v.destroy_class() & destroy_class_t::global) {
+                      os << "cmp dword [rax], 0\n";
+                      os << "je .L" << this_alloc_fresh << "\n";
+                    }
+                    os << "sub dword [rax], 2\n";
+                    if (c.profiling())os << "add qword [alloc_profile_decrements], 1\n";
+                    os << ".L" << this_alloc_fresh << "\n";
+                    c.avoid_destruction(v);
+                  }
+                  const size_t words = m.words(); // the block, and those carved out of it
+                  assert(m.carved.empty() || (!m.reuse && words <= fast_malloc_max_words));
+                  if (words > fast_malloc_max_words) {
+                    os << "mov " << scratch << ", " << words << " \n";
+                    os << "call fast_malloc_preserving\n";
+                  } else {
+                    //pop the size class free list inline, call the runtime only when it is empty
+                    size_t this_alloc_slow = ++branch_id_factory;
+                    os << "mov rax, qword [fast_malloc_free_list+" << words * 8 << "]\n";
+                    os << "test rax, rax\n";
+                    os << "jz .L" << this_alloc_slow << "\n";
+                    os << "mov " << scratch << ", qword [rax]\n";
+                    os << "mov qword [fast_malloc_free_list+" << words * 8 << "], " << scratch << "\n";
+                    os << "jmp .L" << this_alloc_end << "\n";
+                    os << ".L" << this_alloc_slow << "\n";
+                    os << "mov " << scratch << ", " << words << " \n";
+                    os << "call fast_malloc_preserving\n";
+                  }
+                  os << ".L" << this_alloc_end << "\n";
+                  if (!m.carved.empty()) {
+                    //the words are handed out as blocks of other size classes, see fast_malloc_carved in rt.c
+                    std::map<size_t, size_t> blocks{{m.size, 1}};
+                    for (size_t size : m.carved)++blocks[size];
+                    os << "sub qword [fast_malloc_carved+" << words * 8 << "], 1\n";
+                    for (const auto&[size, n] : blocks)
+                      os << "add qword [fast_malloc_carved+" << size * 8 << "], " << n << "\n";
+                  }
+                  if (m.site) {
+                    os << "add " << alloc_sites::allocated(m.site) << ", 1\n";
+                    count_live_words(words, os);
+                  }
+                  if (this_alloc_counted != this_alloc_end)os << ".L" << this_alloc_counted << "\n";
                   c.declare_in(a.dst, rax);
                 },
                 [&](rhs_expr::apply_fn &fun) {
@@ -274,6 +590,35 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
                   c.call_happened(moved);
                   c.declare_in(a.dst, rax);
                 },
+                [&](rhs_expr::call_direct &cd) {
+                  assert(cd.args.size() <= reg::args_order.size());
+                  std::vector<std::pair<var, register_t>> moved;
+                  std::vector<std::pair<var, register_t>> copied;
+                  std::vector<std::pair<var, register_t>> lent; // stay owned here, destroyed after the call
+                  for (size_t j = 0; j < cd.args.size(); ++j) {
+                    const var x = cd.args[j];
+                    if (is_borrowed(cd, j))lent.emplace_back(x, reg::args_order[j]);
+                    else if (contains(destroys, x) && !is_lent(cd, x)) {
+                      moved.emplace_back(x, reg::args_order[j]);
+                      destroys.erase(std::find(destroys.begin(), destroys.end(), x));
+                    } else copied.emplace_back(x, reg::args_order[j]);
+                  }
+                  for (const auto&[v, r] : copied)c.increment_refcount(v, os);
+                  c.call_clean(moved, os);
+                  c.call_copy(copied, os);
+                  c.call_copy(lent, os);
+                  c.align_stack_16_precall(os);
+                  os << "call " << cd.name << "\n";
+                  c.call_happened(moved);
+                  if (cd.results.empty()) {
+                    c.declare_in(a.dst, rax);
+                    return;
+                  }
+                  assert(cd.results.size() <= reg::returns_order.size());
+                  for (size_t k = 0; k < cd.results.size(); ++k)c.declare_in(cd.results[k], reg::returns_order[k]);
+                  c.declare_const(a.dst, 1);
+                },
+                [](rhs_expr::loop_back &) { THROW_INTERNAL_ERROR }, // only valid as a tail call
                 [&](rhs_expr::branch &b) {
                   if (last_skipped_cmp_vars_simplified + 1 == i) {
                     os << "; optimized out branch\n";
@@ -298,6 +643,33 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
                   os << ".L" << this_branch_end << "\n";
                   //TODO: optimize jump structure for when either of the body is empty
                 },
+                [&](rhs_expr::switch_branch &sw) {
+                  if (auto key = c.is_constant(sw->v); key) {
+                    os << "; optimized out switch\n";
+                    scope &taken = sw->taken(key.value());
+                    c = scope_compile_rec(taken, os, c, false);
+                    c.declare_move(a.dst, taken.ret);
+                    return;
+                  }
+                  const std::vector<size_t> labels = switch_dispatch(*sw, c, os);
+                  const std::vector<scope *> branches = sw->branches();
+                  //the cases are merged two at a time, nested as a chain of branches would be
+                  std::function<context_t(size_t, std::ostream &)> compile_from = [&](size_t k, std::ostream &ok) {
+                    ok << ".L" << labels[k] << "\n";
+                    context_t ck = scope_compile_rec(*branches[k], ok, c, false);
+                    ck.declare_move(a.dst, branches[k]->ret);
+                    if (k + 1 == branches.size())return ck;
+                    std::stringstream rest;
+                    context_t cr = compile_from(k + 1, rest);
+                    ck = context_t::merge(ck, ok, cr, rest);
+                    size_t end = ++branch_id_factory;
+                    ok << "jmp .L" << end << "\n";
+                    ok << rest.str();
+                    ok << ".L" << end << "\n";
+                    return ck;
+                  };
+                  c = compile_from(0, os);
+                },
                 [&](rhs_expr::unary_op &u) {
                   if (auto opt = c.is_constant(u.x); opt) {
                     c.declare_const(a.dst, u.of_constant(opt.value()));
@@ -330,18 +702,44 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
                   if (!destroys.empty() && operator_commutative && contains(destroys, b.x2) && !c.is_virtual(b.x2))
                     std::swap(b.x1, b.x2);
 
-                  if (c.is_virtual(b.x1) && c.is_virtual(b.x2)) {
-                    //if both virtual, create virtual result
+                  if (c.is_constant(b.x1) && c.is_constant(b.x2)) {
+                    //if both constant, create virtual result
                     c.declare_const(a.dst, b.of_constant(c.is_constant(b.x1).value(), c.is_constant(b.x2).value()));
+                  } else if (rhs_expr::binary_op::is_comparison(b.op)) {
+                    //cmp leaves the inputs untouched (they might not even be trivial, e.g. for ==), then setcc
+                    //turns the flag into 0/1 and lea into the tagged bool 1/3
+                    if (c.is_virtual(b.x1)) {
+                      std::swap(b.x1, b.x2);
+                      b.op = rhs_expr::binary_op::mirror(b.op);
+                    }
+                    if (c.is_virtual(b.x1))c.devirtualize(b.x1, os); // e.g. the addresses of two static blocks
+                    materialize_wide_immediate(c, b.x2, os);
+                    c.make_non_both_mem(b.x1, b.x2, os);
+                    os << "cmp " << c.at(b.x1) << ", " << c.at(b.x2) << "\n";
+                    c.declare_free(a.dst, os); // at most a mov or a push, which leave the flags alone
+                    register_t r = c.is_on_register(a.dst).value();
+                    os << rhs_expr::binary_op::ops_to_string(b.op) << " " << reg::to_string_low_byte(r) << "\n";
+                    os << "movzx " << reg::to_string(r) << ", " << reg::to_string_low_byte(r) << "\n";
+                    os << "lea " << reg::to_string(r) << ", [" << reg::to_string(r) << "+1+" << reg::to_string(r)
+                       << "]\n";
+                  } else if (b.op == rhs_expr::binary_op::imulh) {
+                    //one-operand imul: rdx:rax = rax * x2, the constant (if any) is the one loaded in rax
+                    if (c.is_virtual(b.x2))std::swap(b.x1, b.x2);
+                    c.clobber({rax, rdx}, os);
+                    os << "mov rax, " << c.at(b.x1) << "\n";
+                    os << "imul " << c.at(b.x2) << "\n";
+                    c.declare_in(a.dst, rdx);
                   } else if (contains(destroys, b.x1)) {
 
                     //we materialize it if needed
                     if (c.is_virtual(b.x1))c.devirtualize(b.x1, os);
+                    materialize_wide_immediate(c, b.x2, os);
 
 
                     //variable move
                     assert(c.contains((b.x1)));
                     assert(c.contains((b.x2)));
+                    if (b.op == rhs_expr::binary_op::imul)c.make_non_mem(b.x1, os); // imul only writes registers
                     c.make_non_both_mem(b.x1, b.x2, os);
                     os << rhs_expr::binary_op::ops_to_string(b.op) << " " << c.at(b.x1) << ", " << c.at(b.x2) << "\n";
 
@@ -361,6 +759,8 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
                       c.declare_move(a.dst, b.x1);
                     } else c.declare_copy(a.dst, b.x1, os);
 
+                    materialize_wide_immediate(c, b.x2, os);
+                    if (b.op == rhs_expr::binary_op::imul)c.make_non_mem(a.dst, os);
                     c.make_non_both_mem(a.dst, b.x2, os);
                     os << rhs_expr::binary_op::ops_to_string(b.op) << " " << c.at(a.dst) << ", " << c.at(b.x2)
                        << "\n";
@@ -374,6 +774,13 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
           };
         },
         [&](instruction::write_uninitialized_mem &m) {
+          if (c.is_register_block(m.base)) {
+            //the field keeps its own var, that goes on to be returned; the header is left out
+            const bool moved = m.block_offset >= header_words && contains(destroys, m.src);
+            if (moved)destroys.erase(std::find(destroys.begin(), destroys.end(), m.src));
+            c.write_register_field(m.base, m.block_offset, m.src, moved, os);
+            return;
+          }
           c.make_both_non_mem(m.src, m.base, os);
           if (c.is_constant(m.src) && c.is_constant(m.src).value() > uint64_t(std::numeric_limits<uint32_t>::max())) {
             //we need two ops
@@ -386,6 +793,7 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
           } else {
             os << "mov qword [" << c.at(m.base) << offset(m.block_offset * 8) << "], " << c.at(m.src) << "\n";
           }
+          c.track_field(m.base, m.block_offset, m.src);
           if (contains(destroys, m.src)) {
             destroys.erase(std::find(destroys.begin(), destroys.end(), m.src));
             c.avoid_destruction(m.src);
@@ -402,29 +810,29 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
             ternary::jmp_instr
                 jinstr = std::get<rhs_expr::branch>(std::get<instruction::assign>(s.body.at(i + 1)).src)->cond;
 
-            int64_t op1 = int64_t(c.is_constant(cmp.v1).value());
-            int64_t op2 = int64_t(c.is_constant(cmp.v2).value());
-            int64_t result;
-
+            uint64_t op1 = c.is_constant(cmp.v1).value();
+            uint64_t op2 = c.is_constant(cmp.v2).value();
             switch (cmp.op) {
-              case instruction::cmp_vars::test:result = op1 & op2;
-                break;
-              case instruction::cmp_vars::cmp:result = op1 - op2;
-                break;
-            }
-
-            switch (jinstr) {
-              case ternary::jmp: last_skipped_will_jump = true;
+              case instruction::cmp_vars::test: {
+                //test clears the carry: the result is "above" zero unless it is zero
+                int64_t result = int64_t(op1 & op2);
+                last_skipped_will_jump = ternary::taken(jinstr, result <=> 0, uint64_t(result) <=> uint64_t(0));
                 break;
-              case ternary::jne: last_skipped_will_jump = result != 0;
-                break;
-              case ternary::jle:last_skipped_will_jump = result <= 0;
-                break;
-              case ternary::jz: last_skipped_will_jump = result == 0;
+              }
+              case instruction::cmp_vars::cmp:
+                last_skipped_will_jump = ternary::taken(jinstr, int64_t(op1) <=> int64_t(op2), op1 <=> op2);
                 break;
             }
             return;
           }
+          if (c.is_virtual(cmp.v1)) {
+            //an immediate can only be the second operand
+            std::swap(cmp.v1, cmp.v2);
+            auto &b = std::get<rhs_expr::branch>(std::get<instruction::assign>(s.body.at(i + 1)).src);
+            b->cond = ternary::mirror(b->cond);
+          }
+          if (c.is_virtual(cmp.v1))c.devirtualize(cmp.v1, os); // e.g. the address of a static block against a tag
+          materialize_wide_immediate(c, cmp.v2, os);
           c.make_non_both_mem(cmp.v1, cmp.v2, os);
           os << instruction::cmp_vars::ops_to_string(cmp.op) << " " << c.at(cmp.v1) << ", " << c.at(cmp.v2) << "\n";
           //assert all trivially destructible
@@ -438,25 +846,866 @@ context_t scope_compile_rec(scope &s, std::ostream &os, context_t c, bool last_c
   }
 
   if (need_to_return) {
-    c.return_clean({{s.ret, rax}}, os);
+    if (c.is_register_block(s.ret))c.return_clean(c.register_block_fields(s.ret), os);
+    else c.return_clean({{s.ret, rax}}, os);
     os << "ret\n";
   }
 
   return c;
 }
 
+namespace {
+bool self_tail_calls_to_loops_rec(scope &s, const function &f) {
+  while (unroll_last_copy(s));
+  if (s.body.empty() || !std::holds_alternative<instruction::assign>(s.body.back()))return false;
+  instruction::assign &last = std::get<instruction::assign>(s.body.back());
+  if (last.dst != s.ret)return false;
+  if (auto *cd = std::get_if<rhs_expr::call_direct>(&last.src); cd && cd->name == f.name) {
+    assert(cd->args.size() == f.args.size());
+    rhs_expr::loop_back lb{.head = std::move(cd->name), .args = std::move(cd->args)};
+    last.src = std::move(lb);
+    return true;
+  }
+  if (auto *b = std::get_if<rhs_expr::branch>(&last.src)) {
+    const bool in_nojmp = self_tail_calls_to_loops_rec((*b)->nojmp_branch, f);
+    const bool in_jmp = self_tail_calls_to_loops_rec((*b)->jmp_branch, f);
+    return in_nojmp || in_jmp;
+  }
+  if (auto *sw = std::get_if<rhs_expr::switch_branch>(&last.src)) {
+    bool any = false;
+    for (scope *b : (*sw)->branches())any |= self_tail_calls_to_loops_rec(*b, f);
+    return any;
+  }
+  return false;
+}
+bool has_loop_back(const scope &s) {
+  if (s.body.empty() || !std::holds_alternative<instruction::assign>(s.body.back()))return false;
+  const rhs_expr::t &last = std::get<instruction::assign>(s.body.back()).src;
+  if (std::holds_alternative<rhs_expr::loop_back>(last))return true;
+  if (const auto *b = std::get_if<rhs_expr::branch>(&last))
+    return has_loop_back((*b)->nojmp_branch) || has_loop_back((*b)->jmp_branch);
+  if (const auto *sw = std::get_if<rhs_expr::switch_branch>(&last)) {
+    const switch_table &table = **sw;
+    const std::vector<const scope *> branches = table.branches();
+    return std::any_of(branches.begin(), branches.end(), [](const scope *b) { return has_loop_back(*b); });
+  }
+  return false;
+}
+}
+
+//Self tail calls become backward jumps to the loop head of the function, past the saves of the non-volatiles: the
+//loop-carried args stay in reg::args_order, and are neither boxed in Arg blocks nor unrolled again. Returns whether
+//any loop was made.
+bool function::self_tail_calls_to_loops() {
+  return self_tail_calls_to_loops_rec(*this, *this);
+}
+
+namespace {
+void collect_matched_blocks(const scope &s, std::unordered_set<var> &blocks, std::unordered_set<var> &globals) {
+  for (const auto &i : s.body)
+    if (const auto *a = std::get_if<instruction::assign>(&i)) {
+      if (const auto *ma = std::get_if<rhs_expr::memory_access>(&a->src))blocks.insert(ma->base);
+      if (std::holds_alternative<rhs_expr::global>(a->src))globals.insert(a->dst);
+      if (const auto *m = std::get_if<rhs_expr::malloc>(&a->src); m && m->in_frame)globals.insert(a->dst);
+      if (const auto *b = std::get_if<rhs_expr::branch>(&a->src)) {
+        collect_matched_blocks((*b)->nojmp_branch, blocks, globals);
+        collect_matched_blocks((*b)->jmp_branch, blocks, globals);
+      }
+      if (const auto *sw = std::get_if<rhs_expr::switch_branch>(&a->src))
+        for (const scope *b : (*sw)->branches())collect_matched_blocks(*b, blocks, globals);
+    }
+}
+// whether i takes the ownership of v, rather than leaving it to be destroyed afterwards
+bool takes_ownership(const instruction::t &i, var v) {
+  return std::visit(overloaded{
+      [&](const instruction::assign &a) {
+        return std::visit(overloaded{
+            [&](const rhs_expr::copy &c) { return c.v == v; },
+            [&](const rhs_expr::malloc &m) { return m.reuse == v; },
+            [&](const rhs_expr::apply_fn &af) { return af.f == v || af.x == v; },
+            [&](const rhs_expr::call_direct &cd) { return contains(cd.args, v); },
+            [&](const rhs_expr::loop_back &lb) { return contains(lb.args, v); },
+            [](const auto &) { return false; },
+        }, a.src);
+      },
+      [&](const instruction::write_uninitialized_mem &w) { return w.src == v; },
+      [](const instruction::cmp_vars &) { return false; },
+  }, i);
+}
+// the first block of a fused allocation is put in the frame or reuses a dead one: the next one, in the same scope, is
+// allocated in its place along with the others
+void leave_fused_allocation(scope &s, var base, rhs_expr::malloc &m) {
+  std::optional<var> next;
+  for (auto &i : s.body)
+    if (auto *a = std::get_if<instruction::assign>(&i))
+      if (auto *c = std::get_if<rhs_expr::malloc>(&a->src); c && c->carved_from == base) {
+        c->carved_at -= m.size;
+        if (next) {
+          c->carved_from = next;
+          continue;
+        }
+        assert(c->carved_at == 0);
+        next = a->dst;
+        c->carved_from.reset();
+        c->carved.assign(m.carved.begin() + 1, m.carved.end());
+      }
+  assert(next);
+  m.carved.clear();
+}
+bool reuse_dead_blocks_rec(scope &s, const std::unordered_set<var> &blocks) {
+  bool changed = false;
+  std::vector<var> dead; // destroyed blocks of this scope, still to be reused
+  for (size_t i = 0; i < s.body.size(); ++i) {
+    for (var v : s.destroys.at(i))
+      if (blocks.contains(v) && (v.destroy_class() & non_trivial) && (i == 0 || !takes_ownership(s.body.at(i - 1), v)))
+        dead.push_back(v);
+    auto *a = std::get_if<instruction::assign>(&s.body[i]);
+    if (!a)continue;
+    if (auto *m = std::get_if<rhs_expr::malloc>(&a->src);
+        m && !m->reuse && !m->in_frame && !m->in_regs && !m->carved_from && m->size <= fast_malloc_max_words
+        && !dead.empty()) {
+      m->reuse = dead.back();
+      dead.pop_back();
+      if (!m->carved.empty()) leave_fused_allocation(s, a->dst, *m);
+      changed = true;
+    } else if (auto *b = std::get_if<rhs_expr::branch>(&a->src)) {
+      changed |= reuse_dead_blocks_rec((*b)->nojmp_branch, blocks);
+      changed |= reuse_dead_blocks_rec((*b)->jmp_branch, blocks);
+    } else if (auto *sw = std::get_if<rhs_expr::switch_branch>(&a->src)) {
+      for (scope *b : (*sw)->branches())changed |= reuse_dead_blocks_rec(*b, blocks);
+    }
+  }
+  return changed;
+}
+}
+
+//Perceus-style reuse: a block that was matched upon and dies before an allocation in the same scope is kept alive
+//until then, so that if it turns out to be unique and of the right size, it's overwritten instead of being freed.
+//Needs the destroys to be set up, and sets them up again when it pairs anything. Returns whether any pair was made.
+bool function::reuse_dead_blocks() {
+  std::unordered_set<var> blocks, globals;
+  collect_matched_blocks(*this, blocks, globals);
+  // the block of a global is owned by global_dealloc, not by whoever reads it; a block in the frame isn't in the heap
+  for (var g : globals)blocks.erase(g);
+  if (!reuse_dead_blocks_rec(*this, blocks))return false;
+  setup_destruction();
+  return true;
+}
+
+namespace {
+// vars that may outlive the frame if they're blocks: returned, stored, passed on to who could keep them, or aliased;
+// blocks with a destructor too, as it gets them
+void collect_escaping(const scope &s, std::unordered_set<var> &escaping, std::unordered_map<var, uint64_t> &constants) {
+  escaping.insert(s.ret);
+  for (const auto &i : s.body)
+    std::visit(overloaded{
+        [&](const instruction::assign &a) {
+          std::visit(overloaded{
+              [&](const rhs_expr::constant &c) { constants[a.dst] = c.v; },
+              [](const rhs_expr::global &) {},
+              [&](const rhs_expr::copy &c) { escaping.insert(c.v); },
+              [](const rhs_expr::memory_access &) {},
+              [&](const rhs_expr::malloc &m) { if (m.reuse)escaping.insert(*m.reuse); },
+              [&](const rhs_expr::apply_fn &af) { escaping.insert({af.f, af.x}); },
+              [&](const rhs_expr::call_direct &cd) {
+                // a lent arg is only read by the callee
+                for (size_t j = 0; j < cd.args.size(); ++j)if (!is_borrowed(cd, j))escaping.insert(cd.args[j]);
+              },
+              [&](const rhs_expr::loop_back &lb) { escaping.insert(lb.args.begin(), lb.args.end()); },
+              [&](const rhs_expr::branch &b) {
+                collect_escaping(b->nojmp_branch, escaping, constants);
+                collect_escaping(b->jmp_branch, escaping, constants);
+              },
+              [&](const rhs_expr::switch_branch &sw) {
+                escaping.insert(sw->v);
+                for (const scope *b : sw->branches())collect_escaping(*b, escaping, constants);
+              },
+              [&](const rhs_expr::unary_op &u) { escaping.insert(u.x); },
+              [&](const rhs_expr::binary_op &b) { escaping.insert({b.x1, b.x2}); }
+          }, a.src);
+        },
+        [&](const instruction::write_uninitialized_mem &w) {
+          escaping.insert(w.src);
+          if (auto it = constants.find(w.src); w.block_offset == 0 && it != constants.end() && header_has_destructor(it->second))
+            escaping.insert(w.base);
+        },
+        [&](const instruction::cmp_vars &c) { escaping.insert({c.v1, c.v2}); },
+    }, i);
+}
+bool allocate_blocks_in_frame_rec(scope &s, const std::unordered_set<var> &escaping) {
+  bool any = false;
+  for (auto &i : s.body)
+    if (auto *a = std::get_if<instruction::assign>(&i)) {
+      if (auto *m = std::get_if<rhs_expr::malloc>(&a->src);
+          m && !m->reuse && !m->carved_from && m->size <= fast_malloc_max_words && !escaping.contains(a->dst)) {
+        any = m->in_frame = true;
+        if (!m->carved.empty()) leave_fused_allocation(s, a->dst, *m);
+      }
+      if (auto *b = std::get_if<rhs_expr::branch>(&a->src)) {
+        any |= allocate_blocks_in_frame_rec((*b)->nojmp_branch, escaping);
+        any |= allocate_blocks_in_frame_rec((*b)->jmp_branch, escaping);
+      }
+      if (auto *sw = std::get_if<rhs_expr::switch_branch>(&a->src))
+        for (scope *b : (*sw)->branches())any |= allocate_blocks_in_frame_rec(*b, escaping);
+    }
+  return any;
+}
+}
+
+//Escape analysis: a block that is only read, written in place and lent to calls dies within the function, so it's
+//allocated in its stack frame rather than in the heap. Its header is still written, its fields are dropped when it is
+//destroyed. Returns whether any was found.
+bool function::allocate_blocks_in_frame() {
+  std::unordered_set<var> escaping;
+  std::unordered_map<var, uint64_t> constants;
+  collect_escaping(*this, escaping, constants);
+  return allocate_blocks_in_frame_rec(*this, escaping);
+}
+
+namespace {
+// borrow signatures: for every function called directly, whether it leaves the ownership of each arg to its callers
+typedef std::unordered_map<std::string, std::vector<bool>> borrow_signatures_t;
+
+bool is_lent_arg(const borrow_signatures_t &sigs, const std::string &name, size_t j) {
+  auto it = sigs.find(name);
+  return it != sigs.end() && it->second.at(j);
+}
+
+// vars whose ownership is taken in s; a copy only takes it if its destination does
+void collect_consumed(scope &s, const borrow_signatures_t &sigs, std::unordered_set<var> &consumed,
+                      std::vector<std::pair<var, var>> &copies) {
+  while (unroll_last_copy(s));
+  consumed.insert(s.ret);
+  for (auto &i : s.body)
+    std::visit(overloaded{
+        [&](instruction::assign &a) {
+          std::visit(overloaded{
+              [&](rhs_expr::copy &c) { copies.emplace_back(a.dst, c.v); },
+              [&](rhs_expr::malloc &m) { if (m.reuse)consumed.insert(*m.reuse); },
+              [&](rhs_expr::apply_fn &af) {
+                consumed.insert(af.f);
+                consumed.insert(af.x);
+              },
+              [&](rhs_expr::call_direct &cd) {
+                for (size_t j = 0; j < cd.args.size(); ++j)if (!is_lent_arg(sigs, cd.name, j))consumed.insert(cd.args[j]);
+              },
+              [&](rhs_expr::loop_back &lb) {
+                for (size_t j = 0; j < lb.args.size(); ++j)if (!is_lent_arg(sigs, lb.head, j))consumed.insert(lb.args[j]);
+              },
+              [&](rhs_expr::branch &b) {
+                collect_consumed(b->nojmp_branch, sigs, consumed, copies);
+                collect_consumed(b->jmp_branch, sigs, consumed, copies);
+              },
+              [&](rhs_expr::switch_branch &sw) {
+                for (scope *b : sw->branches())collect_consumed(*b, sigs, consumed, copies);
+              },
+              [](const auto &) {},
+          }, a.src);
+        },
+        [&](instruction::write_uninitialized_mem &w) { consumed.insert(w.src); },
+        [](instruction::cmp_vars &) {},
+    }, i);
+}
+
+// vars that can be borrowed: lent args, and what is read from or copied out of them, as long as it's never consumed
+void collect_borrowed(const scope &s, const std::unordered_set<var> &consumed, std::unordered_set<var> &borrowed) {
+  for (const auto &i : s.body)
+    if (const auto *a = std::get_if<instruction::assign>(&i)) {
+      std::visit(overloaded{
+          [&](const rhs_expr::memory_access &ma) {
+            if (borrowed.contains(ma.base) && !consumed.contains(a->dst))borrowed.insert(a->dst);
+          },
+          [&](const rhs_expr::copy &c) {
+            if (borrowed.contains(c.v) && !consumed.contains(a->dst))borrowed.insert(a->dst);
+          },
+          [&](const rhs_expr::branch &b) {
+            collect_borrowed(b->nojmp_branch, consumed, borrowed);
+            collect_borrowed(b->jmp_branch, consumed, borrowed);
+          },
+          [&](const rhs_expr::switch_branch &sw) {
+            for (const scope *b : sw->branches())collect_borrowed(*b, consumed, borrowed);
+          },
+          [](const auto &) {},
+      }, a->src);
+    }
+}
+
+// a tail call can't be followed by the destruction of an owned arg: its lent position is given up instead
+bool demote_tail_lent_args(const scope &s, borrow_signatures_t &sigs, const std::unordered_set<var> &borrowed) {
+  if (s.body.empty())return false;
+  const auto *last = std::get_if<instruction::assign>(&s.body.back());
+  if (!last || last->dst != s.ret)return false;
+  bool changed = false;
+  auto demote = [&](const std::string &name, const std::vector<var> &args) {
+    auto it = sigs.find(name);
+    if (it == sigs.end())return;
+    for (size_t j = 0; j < args.size(); ++j)
+      if (it->second.at(j) && !borrowed.contains(args[j]) && (args[j].destroy_class() & non_trivial)) {
+        it->second.at(j) = false;
+        changed = true;
+      }
+  };
+  if (const auto *cd = std::get_if<rhs_expr::call_direct>(&last->src))demote(cd->name, cd->args);
+  if (const auto *lb = std::get_if<rhs_expr::loop_back>(&last->src))demote(lb->head, lb->args);
+  if (const auto *b = std::get_if<rhs_expr::branch>(&last->src)) {
+    changed |= demote_tail_lent_args((*b)->nojmp_branch, sigs, borrowed);
+    changed |= demote_tail_lent_args((*b)->jmp_branch, sigs, borrowed);
+  }
+  if (const auto *sw = std::get_if<rhs_expr::switch_branch>(&last->src))
+    for (const scope *b : (*sw)->branches())changed |= demote_tail_lent_args(*b, sigs, borrowed);
+  return changed;
+}
+
+void collect_direct_calls(scope &s, std::vector<rhs_expr::call_direct *> &calls) {
+  for (auto &i : s.body)
+    if (auto *a = std::get_if<instruction::assign>(&i)) {
+      if (auto *cd = std::get_if<rhs_expr::call_direct>(&a->src))calls.push_back(cd);
+      if (auto *b = std::get_if<rhs_expr::branch>(&a->src)) {
+        collect_direct_calls((*b)->nojmp_branch, calls);
+        collect_direct_calls((*b)->jmp_branch, calls);
+      }
+      if (auto *sw = std::get_if<rhs_expr::switch_branch>(&a->src))
+        for (scope *b : (*sw)->branches())collect_direct_calls(*b, calls);
+    }
+}
+}
+
+//Borrowed args: an arg of a directly called function that is only read (matched upon, compared, passed on to other
+//borrowed args) is left owned by the caller, which skips the increment before the call or destroys it after the call,
+//while the callee reads it, and its fields, without touching the refcounts.
+//Starting with all the boxed args borrowed, the args that are consumed are demoted until nothing changes. Blocks
+//reused in place are consumed, so that reuse wins over borrowing. Tail calls from functions that aren't called
+//directly (e.g. the generic entry points) become normal calls when they lend an owned var.
+void lang::infer_borrowed_args(std::vector<function> &fs) {
+  borrow_signatures_t sigs;
+  std::vector<std::vector<rhs_expr::call_direct *>> calls(fs.size());
+  for (size_t k = 0; k < fs.size(); ++k) {
+    fs[k].self_tail_calls_to_loops();
+    fs[k].setup_destruction();
+    fs[k].reuse_dead_blocks();
+    collect_direct_calls(fs[k], calls[k]);
+  }
+  for (auto &f : fs)
+    if (std::any_of(calls.begin(), calls.end(), [&](const auto &cs) {
+      return std::any_of(cs.begin(), cs.end(), [&](const rhs_expr::call_direct *cd) { return cd->name == f.name; });
+    })) {
+      std::vector<bool> sig;
+      for (const var a : f.args)sig.push_back(a.destroy_class() & non_trivial);
+      sigs[f.name] = std::move(sig);
+    }
+
+  std::vector<std::unordered_set<var>> borrowed(fs.size());
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t k = 0; k < fs.size(); ++k) {
+      function &f = fs[k];
+      std::unordered_set<var> consumed;
+      std::vector<std::pair<var, var>> copies;
+      collect_consumed(f, sigs, consumed, copies);
+      for (bool more = true; more;) {
+        more = false;
+        for (const auto&[dst, src] : copies)if (consumed.contains(dst) && consumed.insert(src).second)more = true;
+      }
+      borrowed[k].clear();
+      if (auto it = sigs.find(f.name); it != sigs.end()) {
+        for (size_t j = 0; j < f.args.size(); ++j) {
+          if (it->second[j] && consumed.contains(f.args[j])) {
+            it->second[j] = false;
+            changed = true;
+          }
+          if (it->second[j])borrowed[k].insert(f.args[j]);
+        }
+      }
+      collect_borrowed(f, consumed, borrowed[k]);
+      if (sigs.contains(f.name))changed |= demote_tail_lent_args(f, sigs, borrowed[k]);
+    }
+  }
+
+  //borrowed vars are never refcounted
+  for (auto &b : borrowed)
+    for (var v : b)
+      if (v.destroy_class() & non_trivial)v.mark((v.destroy_class() & trivial) | global);
+  for (auto &cs : calls)
+    for (rhs_expr::call_direct *cd : cs)
+      if (auto it = sigs.find(cd->name); it != sigs.end())cd->borrowed = it->second;
+}
+
+namespace {
+// how many times each var is an operand, the value returned by a scope included; and the values of the constants
+void count_uses(const scope &s, std::unordered_map<var, size_t> &uses, std::unordered_map<var, uint64_t> &constants) {
+  ++uses[s.ret];
+  for (const auto &i : s.body)
+    std::visit(overloaded{
+        [&](const instruction::assign &a) {
+          std::visit(overloaded{
+              [&](const rhs_expr::constant &c) { constants[a.dst] = c.v; },
+              [](const rhs_expr::global &) {},
+              [&](const rhs_expr::copy &c) { ++uses[c.v]; },
+              [&](const rhs_expr::memory_access &ma) { ++uses[ma.base]; },
+              [&](const rhs_expr::malloc &m) {
+                if (m.reuse)++uses[*m.reuse];
+                if (m.carved_from)++uses[*m.carved_from];
+              },
+              [&](const rhs_expr::apply_fn &af) {
+                ++uses[af.f];
+                ++uses[af.x];
+              },
+              [&](const rhs_expr::call_direct &cd) { for (var x : cd.args)++uses[x]; },
+              [&](const rhs_expr::loop_back &lb) { for (var x : lb.args)++uses[x]; },
+              [&](const rhs_expr::branch &b) {
+                count_uses(b->nojmp_branch, uses, constants);
+                count_uses(b->jmp_branch, uses, constants);
+              },
+              [&](const rhs_expr::switch_branch &sw) {
+                ++uses[sw->v];
+                for (const scope *b : sw->branches())count_uses(*b, uses, constants);
+              },
+              [&](const rhs_expr::unary_op &u) { ++uses[u.x]; },
+              [&](const rhs_expr::binary_op &b) {
+                ++uses[b.x1];
+                ++uses[b.x2];
+              }
+          }, a.src);
+        },
+        [&](const instruction::write_uninitialized_mem &w) {
+          ++uses[w.base];
+          ++uses[w.src];
+        },
+        [&](const instruction::cmp_vars &c) {
+          ++uses[c.v1];
+          ++uses[c.v2];
+        },
+    }, i);
+}
+
+// the block returned by s, if s allocates it and writes every word of it once, with a refcount of 1 and a header without
+// destructor, and does nothing else with it: its malloc and its header
+std::optional<std::pair<rhs_expr::malloc *, uint64_t>> built_block(scope &s,
+                                                                    const std::unordered_map<var, size_t> &uses,
+                                                                    const std::unordered_map<var, uint64_t> &constants) {
+  rhs_expr::malloc *m = nullptr;
+  for (auto &i : s.body)
+    if (auto *a = std::get_if<instruction::assign>(&i); a && a->dst == s.ret)m = std::get_if<rhs_expr::malloc>(&a->src);
+  if (!m || m->reuse || m->in_frame || !m->carved.empty() || m->carved_from || m->size <= header_words)return {};
+  std::vector<std::optional<var>> words(m->size);
+  for (const auto &i : s.body)
+    if (const auto *w = std::get_if<instruction::write_uninitialized_mem>(&i); w && w->base == s.ret) {
+      if (w->block_offset >= m->size || words[w->block_offset])return {};
+      words[w->block_offset] = w->src;
+    }
+  if (uses.at(s.ret) != m->size + 1 || !words[0])return {};
+  auto header = constants.find(*words[0]);
+  if (header == constants.end() || uint32_t(header->second) != 3 || header_has_destructor(header->second))return {};
+  return std::make_pair(m, header->second);
+}
+
+// the blocks built in the tails of s, as in built_block; the self tail calls are collected apart. False if any other
+// tail returns something else
+bool collect_tail_blocks(scope &s, const std::string &self, const std::unordered_map<var, size_t> &uses,
+                         const std::unordered_map<var, uint64_t> &constants,
+                         std::vector<std::pair<rhs_expr::malloc *, uint64_t>> &blocks,
+                         std::vector<rhs_expr::call_direct *> &self_calls) {
+  while (unroll_last_copy(s));
+  if (!s.body.empty())
+    if (auto *last = std::get_if<instruction::assign>(&s.body.back()); last && last->dst == s.ret) {
+      if (auto *cd = std::get_if<rhs_expr::call_direct>(&last->src); cd && cd->name == self) {
+        self_calls.push_back(cd);
+        return true;
+      }
+      if (auto *b = std::get_if<rhs_expr::branch>(&last->src))
+        return collect_tail_blocks((*b)->nojmp_branch, self, uses, constants, blocks, self_calls)
+            && collect_tail_blocks((*b)->jmp_branch, self, uses, constants, blocks, self_calls);
+      if (auto *sw = std::get_if<rhs_expr::switch_branch>(&last->src)) {
+        for (scope *b : (*sw)->branches())
+          if (!collect_tail_blocks(*b, self, uses, constants, blocks, self_calls))return false;
+        return true;
+      }
+    }
+  auto block = built_block(s, uses, constants);
+  if (block)blocks.push_back(*block);
+  return block.has_value();
+}
+
+// a call whose result is only read, each field at most once, right after it in the same scope
+struct destructured_call {
+  instruction::assign *call;
+  std::vector<instruction::assign *> reads;
+};
+void collect_destructured_calls(scope &s, const std::unordered_map<var, size_t> &uses,
+                                std::vector<destructured_call> &calls) {
+  for (size_t i = 0; i < s.body.size(); ++i) {
+    auto *a = std::get_if<instruction::assign>(&s.body[i]);
+    if (!a)continue;
+    if (std::holds_alternative<rhs_expr::call_direct>(a->src)) {
+      destructured_call dc{.call = a};
+      for (size_t j = i + 1; j < s.body.size(); ++j)
+        if (auto *r = std::get_if<instruction::assign>(&s.body[j]))
+          if (auto *ma = std::get_if<rhs_expr::memory_access>(&r->src); ma && ma->base == a->dst)dc.reads.push_back(r);
+      if (auto it = uses.find(a->dst); !dc.reads.empty() && it != uses.end() && dc.reads.size() == it->second)
+        calls.push_back(std::move(dc));
+    }
+    if (auto *b = std::get_if<rhs_expr::branch>(&a->src)) {
+      collect_destructured_calls((*b)->nojmp_branch, uses, calls);
+      collect_destructured_calls((*b)->jmp_branch, uses, calls);
+    }
+    if (auto *sw = std::get_if<rhs_expr::switch_branch>(&a->src))
+      for (scope *b : (*sw)->branches())collect_destructured_calls(*b, uses, calls);
+  }
+}
+
+std::string unboxed_name(std::string_view name) {
+  if (name.ends_with("__"))name.remove_suffix(2);
+  return std::string(name).append("_unboxed__");
+}
+}
+
+//Worker/wrapper split of the functions whose every tail builds a block of the same shape, tuple literals mostly (the
+//self tail calls aside): the worker never allocates it, it returns its fields in reg::returns_order instead, for the
+//calls that only read the fields of the result. The function becomes the wrapper, that boxes them again for every
+//other caller (e.g. the generic entry point). Functions that no call destructures are left alone.
+void lang::unbox_tuple_returns(std::vector<function> &fs) {
+  std::vector<std::unordered_map<var, size_t>> uses(fs.size());
+  std::unordered_map<var, uint64_t> constants;
+  for (size_t k = 0; k < fs.size(); ++k)count_uses(fs[k], uses[k], constants);
+
+  struct unboxable {
+    size_t index;
+    size_t size;
+    uint64_t header;
+    std::vector<rhs_expr::malloc *> blocks;
+    std::vector<rhs_expr::call_direct *> self_calls;
+    std::vector<destructured_call> calls = {};
+  };
+  std::unordered_map<std::string, unboxable> unboxables;
+  for (size_t k = 0; k < fs.size(); ++k) {
+    std::vector<std::pair<rhs_expr::malloc *, uint64_t>> blocks;
+    std::vector<rhs_expr::call_direct *> self_calls;
+    if (!collect_tail_blocks(fs[k], fs[k].name, uses[k], constants, blocks, self_calls) || blocks.empty())continue;
+    const size_t size = blocks.front().first->size;
+    const uint64_t header = blocks.front().second;
+    if (size - header_words > reg::returns_order.size())continue;
+    if (std::any_of(blocks.begin(), blocks.end(), [&](const auto &b) {
+      return b.first->size != size || b.second != header;
+    }))
+      continue;
+    unboxable u{.index = k, .size = size, .header = header, .self_calls = std::move(self_calls)};
+    for (const auto &b : blocks)u.blocks.push_back(b.first);
+    unboxables.emplace(fs[k].name, std::move(u));
+  }
+  for (size_t k = 0; k < fs.size(); ++k) {
+    std::vector<destructured_call> calls;
+    collect_destructured_calls(fs[k], uses[k], calls);
+    for (auto &c : calls) {
+      auto it = unboxables.find(std::get<rhs_expr::call_direct>(c.call->src).name);
+      if (it == unboxables.end())continue;
+      if (std::all_of(c.reads.begin(), c.reads.end(), [&](const instruction::assign *r) {
+        const size_t offset = std::get<rhs_expr::memory_access>(r->src).block_offset;
+        return offset >= header_words && offset < it->second.size && std::count_if(c.reads.begin(), c.reads.end(), [&](auto *o) {
+          return std::get<rhs_expr::memory_access>(o->src).block_offset == offset;
+        }) == 1;
+      }))
+        it->second.calls.push_back(std::move(c));
+    }
+  }
+
+  std::vector<function> workers;
+  for (auto &[name, u] : unboxables) {
+    if (u.calls.empty())continue;
+    const std::string worker_name = unboxed_name(name);
+    //the reads of the fields become moves out of the results of the call
+    for (auto &c : u.calls) {
+      auto &cd = std::get<rhs_expr::call_direct>(c.call->src);
+      cd.name = worker_name;
+      cd.results.clear();
+      for (size_t k = header_words; k < u.size; ++k)cd.results.emplace_back();
+      for (instruction::assign *r : c.reads) {
+        var field = cd.results.at(std::get<rhs_expr::memory_access>(r->src).block_offset - header_words);
+        field.destroy_class() = r->dst.destroy_class();
+        r->src = rhs_expr::copy{.v = field};
+      }
+      c.call->dst.destroy_class() = trivial;
+    }
+    for (rhs_expr::malloc *m : u.blocks)m->in_regs = true;
+    for (rhs_expr::call_direct *cd : u.self_calls)cd->name = worker_name;
+
+    function &f = fs[u.index];
+    function &worker = workers.emplace_back();
+    static_cast<scope &>(worker) = std::move(static_cast<scope &>(f));
+    worker.name = worker_name;
+    worker.args = std::move(f.args);
+
+    f.body.clear();
+    f.destroys.clear();
+    f.comments.clear();
+    f.args.clear();
+    rhs_expr::call_direct cd{.name = worker_name};
+    for (const var x : worker.args) {
+      var arg;
+      arg.destroy_class() = x.destroy_class();
+      f.args.push_back(arg);
+    }
+    cd.args = f.args;
+    for (size_t k = header_words; k < u.size; ++k)cd.results.emplace_back();
+    const std::vector<var> fields = cd.results;
+    f.declare_assign(std::move(cd)).destroy_class() = trivial;
+    f.ret = f.declare_assign(rhs_expr::malloc{.size = u.size});
+    f.push_back(instruction::write_uninitialized_mem{.base = f.ret, .block_offset = 0, .src = f.declare_constant(u.header)});
+    for (size_t k = 0; k < fields.size(); ++k)
+      f.push_back(instruction::write_uninitialized_mem{.base = f.ret, .block_offset = header_words + k, .src = fields[k]});
+  }
+  for (auto &w : workers)fs.push_back(std::move(w));
+}
+
 void function::pre_compile() {
   //TODO: destroyability analysis
+  self_tail_calls_to_loops();
+  sink_loads();
   setup_destruction();
+  allocate_blocks_in_frame();
+  reuse_dead_blocks();
   scope::tight_inference();
 }
 
-void function::compile(std::ostream &os) {
+namespace {
+// backward liveness over s, given what is live after it: returns the vars live at its start, and adds to across the ones
+// whose value has to survive a call (lent args included, since they're destroyed after it)
+std::unordered_set<var> live_in(const scope &s, std::unordered_set<var> live, std::unordered_set<var> &across) {
+  live.insert(s.ret);
+  for (size_t i = s.body.size(); i-- > 0;)
+    std::visit(overloaded{
+        [&](const instruction::assign &a) {
+          live.erase(a.dst);
+          std::visit(overloaded{
+              [](const rhs_expr::constant &) {},
+              [](const rhs_expr::global &) {},
+              [&](const rhs_expr::copy &ce) { live.insert(ce.v); },
+              [&](const rhs_expr::memory_access &ma) { live.insert(ma.base); },
+              [&](const rhs_expr::malloc &m) {
+                if (m.reuse)live.insert(*m.reuse);
+                if (m.carved_from)live.insert(*m.carved_from);
+              },
+              [&](const rhs_expr::apply_fn &af) {
+                across.insert(live.begin(), live.end());
+                live.insert({af.f, af.x});
+              },
+              [&](const rhs_expr::call_direct &cd) {
+                for (var r : cd.results)live.erase(r);
+                across.insert(live.begin(), live.end());
+                for (size_t j = 0; j < cd.args.size(); ++j)if (is_borrowed(cd, j))across.insert(cd.args[j]);
+                live.insert(cd.args.begin(), cd.args.end());
+              },
+              [&](const rhs_expr::loop_back &lb) { live.insert(lb.args.begin(), lb.args.end()); },
+              [&](const rhs_expr::branch &b) {
+                auto in_nojmp = live_in(b->nojmp_branch, live, across);
+                auto in_jmp = live_in(b->jmp_branch, std::move(live), across);
+                live = std::move(in_nojmp);
+                live.insert(in_jmp.begin(), in_jmp.end());
+              },
+              [&](const rhs_expr::switch_branch &sw) {
+                std::unordered_set<var> in_any{sw->v};
+                for (const scope *b : sw->branches()) {
+                  auto in_b = live_in(*b, live, across);
+                  in_any.insert(in_b.begin(), in_b.end());
+                }
+                live = std::move(in_any);
+              },
+              [&](const rhs_expr::unary_op &u) { live.insert(u.x); },
+              [&](const rhs_expr::binary_op &b) { live.insert({b.x1, b.x2}); }
+          }, a.src);
+        },
+        [&](const instruction::write_uninitialized_mem &w) { live.insert({w.base, w.src}); },
+        [&](const instruction::cmp_vars &c) { live.insert({c.v1, c.v2}); },
+    }, s.body[i]);
+  return live;
+}
+}
+
+namespace {
+void number_rec(const scope &s,
+                std::unordered_map<const scope *, std::vector<size_t>> &positions,
+                std::unordered_map<var, std::pair<size_t, size_t>> &intervals,
+                size_t &pos) {
+  auto use = [&](var v) { if (auto it = intervals.find(v); it != intervals.end())it->second.second = pos; };
+  auto def = [&](var v) { intervals.try_emplace(v, pos, pos); };
+  for (const auto &i : s.body) {
+    positions[&s].push_back(++pos);
+    std::visit(overloaded{
+        [&](const instruction::assign &a) {
+          std::visit(overloaded{
+              [](const rhs_expr::constant &) {},
+              [](const rhs_expr::global &) {},
+              [&](const rhs_expr::copy &c) { use(c.v); },
+              [&](const rhs_expr::memory_access &ma) { use(ma.base); },
+              [&](const rhs_expr::malloc &m) {
+                if (m.reuse)use(*m.reuse);
+                if (m.carved_from)use(*m.carved_from);
+              },
+              [&](const rhs_expr::apply_fn &af) {
+                use(af.f);
+                use(af.x);
+              },
+              [&](const rhs_expr::call_direct &cd) {
+                for (var x : cd.args)use(x);
+                for (var r : cd.results)def(r);
+              },
+              [&](const rhs_expr::loop_back &lb) { for (var x : lb.args)use(x); },
+              [&](const rhs_expr::branch &b) {
+                number_rec(b->nojmp_branch, positions, intervals, pos);
+                number_rec(b->jmp_branch, positions, intervals, pos);
+              },
+              [&](const rhs_expr::switch_branch &sw) {
+                use(sw->v);
+                for (const scope *b : sw->branches())number_rec(*b, positions, intervals, pos);
+              },
+              [&](const rhs_expr::unary_op &u) { use(u.x); },
+              [&](const rhs_expr::binary_op &b) {
+                use(b.x1);
+                use(b.x2);
+              }
+          }, a.src);
+          // after the branches, that define it where they merge; constants and globals take no register
+          if (!std::holds_alternative<rhs_expr::constant>(a.src) && !std::holds_alternative<rhs_expr::global>(a.src))
+            def(a.dst);
+        },
+        [&](const instruction::write_uninitialized_mem &w) {
+          use(w.base);
+          use(w.src);
+        },
+        [&](const instruction::cmp_vars &c) {
+          use(c.v1);
+          use(c.v2);
+        },
+    }, i);
+  }
+  ++pos;
+  use(s.ret);
+}
+}
+
+live_intervals::live_intervals(const function &f) {
+  size_t pos = 0;
+  for (var a : f.args)intervals.try_emplace(a, pos, pos);
+  number_rec(f, positions, intervals, pos);
+}
+std::optional<size_t> live_intervals::position(const scope &s, size_t i) const {
+  auto it = positions.find(&s);
+  if (it == positions.end() || i >= it->second.size())return {};
+  return it->second[i];
+}
+size_t live_intervals::end(var v) const {
+  auto it = intervals.find(v);
+  return it == intervals.end() ? std::numeric_limits<size_t>::max() : it->second.second;
+}
+size_t live_intervals::max_overlap(const std::unordered_set<var> &vs) const {
+  //a var takes a register from after its definition to its last use, which the var defined there can take over: at the
+  //same position, the ends come before the starts
+  std::vector<std::pair<size_t, int>> events;
+  for (var v : vs)
+    if (auto it = intervals.find(v); it != intervals.end() && it->second.first < it->second.second) {
+      events.emplace_back(it->second.first, 1);
+      events.emplace_back(it->second.second, -1);
+    }
+  std::sort(events.begin(), events.end());
+  size_t live = 0, most = 0;
+  for (const auto &[p, e] : events) {
+    if (e > 0)most = std::max(most, ++live);
+    else --live;
+  }
+  return most;
+}
+
+namespace {
+std::vector<scope *> branches_of(instruction::t &i) {
+  if (auto *a = std::get_if<instruction::assign>(&i)) {
+    if (auto *b = std::get_if<rhs_expr::branch>(&a->src))return {&(*b)->nojmp_branch, &(*b)->jmp_branch};
+    if (auto *sw = std::get_if<rhs_expr::switch_branch>(&a->src))return (*sw)->branches();
+  }
+  return {};
+}
+// instructions can't be assigned, a body is rebuilt rather than edited in place; the comments keep their instruction
+void insert_front(scope &s, instruction::t &&i) {
+  std::vector<instruction::t> body;
+  body.reserve(s.body.size() + 1);
+  body.push_back(std::move(i));
+  for (auto &j : s.body)body.push_back(std::move(j));
+  s.body = std::move(body);
+  for (auto &c : s.comments)++c.first;
+}
+void erase_instruction(scope &s, size_t i) {
+  std::vector<instruction::t> body;
+  body.reserve(s.body.size() - 1);
+  for (size_t j = 0; j < s.body.size(); ++j)
+    if (j != i)body.push_back(std::move(s.body[j]));
+  s.body = std::move(body);
+  for (auto &c : s.comments)if (c.first > i)--c.first;
+}
+bool scope_sink_loads(scope &s) {
+  bool any = false;
+  for (bool moved = true; moved;) {
+    moved = false;
+    std::unordered_map<var, size_t> uses;
+    std::unordered_map<var, uint64_t> constants;
+    count_uses(s, uses, constants);
+    std::vector<std::vector<std::unordered_map<var, size_t>>> case_uses(s.body.size()); // per instruction, per case
+    for (size_t j = 0; j < s.body.size(); ++j)
+      for (scope *c : branches_of(s.body[j]))count_uses(*c, case_uses[j].emplace_back(), constants);
+    for (size_t i = s.body.size(); i-- > 0 && !moved;) {
+      const auto *a = std::get_if<instruction::assign>(&s.body[i]);
+      const auto *ma = a ? std::get_if<rhs_expr::memory_access>(&a->src) : nullptr;
+      if (!ma || !uses.contains(a->dst))continue;
+      for (size_t j = i + 1; j < s.body.size(); ++j) {
+        size_t n = 0;
+        for (const auto &cu : case_uses[j])
+          if (auto it = cu.find(a->dst); it != cu.end())n += it->second;
+        if (n == 0)continue;
+        if (n == uses.at(a->dst)) {
+          const var dst = a->dst;
+          const rhs_expr::memory_access load = *ma;
+          std::vector<scope *> cases = branches_of(s.body[j]);
+          for (size_t k = 0; k < cases.size(); ++k)
+            if (case_uses[j][k].contains(dst))insert_front(*cases[k], instruction::assign{.dst = dst, .src = load});
+          erase_instruction(s, i);
+          moved = any = true;
+        }
+        break; // the first instruction using the load decides
+      }
+    }
+  }
+  for (auto &i : s.body)
+    for (scope *c : branches_of(i))any |= scope_sink_loads(*c);
+  return any;
+}
+}
+
+//Code sinking: a load from a block used only in some of the cases of a later branch is moved into those cases, each
+//getting its own copy, so that the paths which don't need the field neither load it nor keep it alive. The captures
+//of a closure are loaded at its start, this way each is loaded only where it is used. Returns whether any was moved.
+bool function::sink_loads() { return scope_sink_loads(*this); }
+
+allocation_stats function::compile(std::ostream &os, bool profile) {
   //TODO: destroyability analysis
+  self_tail_calls_to_loops();
+  sink_loads();
   setup_destruction();
+  allocate_blocks_in_frame();
+  reuse_dead_blocks();
   scope::tight_inference();
+  std::unordered_set<var> across_calls;
+  live_in(*this, {}, across_calls);
+  const live_intervals intervals(*this);
+  allocation_stats stats;
+  context_t c(args.begin(), args.end());
+  c.set_allocation_hints(across_calls, intervals, stats);
+  c.set_profile(profile);
   os << name << ":\n";
-  scope_compile_rec(*this, os, context_t(args.begin(), args.end()), true);
+  if (has_loop_back(*this)) {
+    c.enter_loop(os);
+    os << loop_head(name) << ":\n";
+  }
+  scope_compile_rec(*this, os, std::move(c), true);
+  os << "; " << name << ": " << stats.spills << " spills, " << stats.stack_slots << " stack slots\n";
+  return stats;
 }
 function function::parse(std::string_view source) {
   parse::tokenizer tk(source);
@@ -495,7 +1744,8 @@ bool scope::tight_inference() {
                   reduce_space(ia.dst, trivial);
                 },
                 [&](const rhs_expr::global &) {
-                  reduce_space(ia.dst, global);
+                  // a symbol may also stand for an immediate (e.g. stdout), already known by its type
+                  if (ia.dst.destroy_class() != unboxed)reduce_space(ia.dst, global);
                 },
                 [&](const rhs_expr::copy &c) {
                   reduce_space(ia.dst, c.v.destroy_class());
@@ -520,11 +1770,21 @@ bool scope::tight_inference() {
                 [&](const rhs_expr::apply_fn &f) {
                   //reduce_space(f.f,boxed);
                 },
+                [&](const rhs_expr::call_direct &) {},
+                [&](const rhs_expr::loop_back &) {},
                 [&](const rhs_expr::branch &b) {
                   actioned |= b->nojmp_branch.tight_inference();
                   actioned |= b->jmp_branch.tight_inference();
                   reduce_space(ia.dst, b->nojmp_branch.ret.destroy_class() | b->jmp_branch.ret.destroy_class());
                 },
+                [&](const rhs_expr::switch_branch &sw) {
+                  destroy_class_t dc = unvalid_destroy_class;
+                  for (scope *b : sw->branches()) {
+                    actioned |= b->tight_inference();
+                    dc = dc | b->ret.destroy_class();
+                  }
+                  reduce_space(ia.dst, dc);
+                },
             }, ia.src);
           },
           [&](const instruction::cmp_vars &c) {
@@ -579,6 +1839,7 @@ void context_t::assert_consistency() const {
         [&](var v) {
           assert(vars.at(v) == location_t{r});
         },
+        [](frame_word) { assert(false); },
     }, regs[r]);
   }
   //stack
@@ -591,6 +1852,9 @@ void context_t::assert_consistency() const {
         [&](var v) {
           assert(vars.at(v) == location_t{on_stack{i}});
         },
+        [&](frame_word w) {
+          assert(frame_blocks.contains(w.block));
+        },
     }, stack[i]);
   }
   //vars
@@ -730,9 +1994,91 @@ void context_t::avoid_destruction(var v) {
   vars.erase(v);
   assert_consistency();
 }
+void context_t::declare_frame_block(var v, size_t size, std::ostream &os) {
+  assert_consistency();
+  //the block takes a run of slots whose previous contents' intervals are over, if any, otherwise new ones on top
+  auto run = std::search_n(stack.begin(), stack.end(), size, content_t{free{}});
+  if (run == stack.end()) {
+    os << "sub rsp, " << 8 * size << " ; " << v << " in the frame\n";
+    run = stack.insert(stack.end(), size, free{});
+    if (stats)stats->stack_slots = std::max(stats->stack_slots, stack.size());
+  } else os << "; " << v << " in the frame, in free slots\n";
+  //word 0 is the lowest address, i.e. the last slot
+  for (size_t j = size; j-- > 0; ++run)*run = frame_word{v, j};
+  frame_blocks[v] = {};
+  declare_free(v, os); // might push a saved register
+  auto word_0 = std::find(stack.begin(), stack.end(), content_t{frame_word{v, 0}});
+  os << "lea " << at(v) << ", [rsp" << offset((stack.end() - word_0 - 1) * 8) << "]\n";
+  assert_consistency();
+}
+void context_t::track_field(var block, size_t block_offset, var src) {
+  if (auto it = frame_blocks.find(block); it != frame_blocks.end() && (src.destroy_class() & non_trivial))
+    it->second.emplace_back(block_offset, src.destroy_class());
+}
+void context_t::declare_register_block(var v, size_t size) {
+  assert(size >= header_words);
+  register_blocks[v].resize(size - header_words);
+  declare_const(v, 1);
+}
+bool context_t::is_register_block(var v) const {
+  return register_blocks.contains(v);
+}
+//the block takes the ownership of a moved src, otherwise of a copy of it
+void context_t::write_register_field(var block, size_t block_offset, var src, bool moved, std::ostream &os) {
+  if (block_offset < header_words)return;
+  if (!moved) {
+    var copy;
+    copy.destroy_class() = src.destroy_class();
+    declare_copy(copy, src, os);
+    increment_refcount(copy, os);
+    src = copy;
+  }
+  std::optional<var> &field = register_blocks.at(block).at(block_offset - header_words);
+  assert(!field);
+  field = src;
+}
+std::vector<std::pair<var, register_t>> context_t::register_block_fields(var v) const {
+  const auto &fields = register_blocks.at(v);
+  assert(fields.size() <= reg::returns_order.size());
+  std::vector<std::pair<var, register_t>> placed;
+  for (size_t k = 0; k < fields.size(); ++k)placed.emplace_back(fields[k].value(), reg::returns_order[k]);
+  return placed;
+}
+//the fields are dropped as destroy_nontrivial would, reading them relative to rsp; then the words are given back
+void context_t::destroy_frame_block(var v, std::ostream &os) {
+  os << "; destroying " << v << " : in the frame\n";
+  const std::string scratch(reg::to_string(reg::runtime_scratch));
+  if (!frame_blocks.at(v).empty())clobber({reg::runtime_scratch}, os);
+  for (const auto&[block_offset, dc] : frame_blocks.at(v)) {
+    auto slot = std::find(stack.begin(), stack.end(), content_t{frame_word{v, block_offset}});
+    assert(slot != stack.end());
+    const size_t done = ++branch_id_factory;
+    os << "mov " << scratch << ", qword [rsp" << offset((stack.end() - slot - 1) * 8) << "]\n";
+    if (dc & unboxed) {
+      os << "test " << scratch << ", 1\n";
+      os << "jnz .L" << done << "\n";
+    }
+    if (dc & destroy_class_t::global) {
+      os << "cmp dword [" << scratch << "], 0\n";
+      os << "je .L" << done << "\n";
+    }
+    os << "sub dword [" << scratch << "], 2\n";
+    if (profile)os << "add qword [alloc_profile_decrements], 1\n";
+    os << "cmp dword [" << scratch << "], 1\n";
+    os << "jne .L" << done << "\n";
+    os << "call destroy_nontrivial_preserving\n";
+    os << ".L" << done << "\n";
+  }
+  frame_blocks.erase(v);
+  for (auto &w : stack)
+    if (auto *fw = std::get_if<frame_word>(&w); fw && fw->block == v)w = free{};
+}
 void context_t::destroy(var v, std::ostream &os) {
   assert_consistency();
-  if (v.destroy_class() & non_trivial) {
+  if (frame_blocks.contains(v))destroy_frame_block(v, os);
+  else if (auto *c = std::get_if<constant>(&vars.at(v)); c && (c->value & 1)) {
+    // a known immediate owns nothing, whatever its type allows (e.g. a None matched once inlined)
+  } else if (v.destroy_class() & non_trivial) {
     os << "; destroying " << v << " : " << destroy_class_to_string(v.destroy_class()) << " \n";
     //TODO: maybe deep destruction
     switch (v.destroy_class()) {
@@ -741,21 +2087,29 @@ void context_t::destroy(var v, std::ostream &os) {
       case non_trivial:
       case boxed:
       case non_global: {
-        //TODO : destroy with more specific fashion
-        move(reg::args_order.front(), location(v), os);
-        bool push_for_align = !(stack_size() & 1);
-        for (auto r : reg::volatiles)
-          if (r != reg::args_order.front() && !is_reg_free(r)) {
-            os << "push " << reg::to_string(r) << "\n";
-            push_for_align ^= 1;
-          }
-        if (push_for_align)os << "sub rsp, 8\n";
-        os << "call decrement_value\n";
-        if (push_for_align)os << "add rsp, 8\n";
-        for (auto r = reg::volatiles.rbegin(); r != reg::volatiles.rend(); ++r)
-          if (*r != reg::args_order.front() && !is_reg_free(*r)) {
-            os << "pop " << reg::to_string(*r) << "\n";
-          }
+        //inline decrement of the refcount, call the runtime only to free the block
+        make_non_mem(v, os);
+        const std::string r = retrieve_to_string(v);
+        const size_t done = ++branch_id_factory;
+        if (v.destroy_class() & unboxed) {
+          os << "test " << r << ", 1\n";
+          os << "jnz .L" << done << "\n";
+        }
+        if (v.destroy_class() & destroy_class_t::global) {
+          os << "cmp dword [" << r << "], 0\n";
+          os << "je .L" << done << "\n";
+        }
+        os << "sub dword [" << r << "], 2\n";
+        if (profile)os << "add qword [alloc_profile_decrements], 1\n";
+        os << "cmp dword [" << r << "], 1\n";
+        os << "jne .L" << done << "\n";
+        const register_t r_v = std::get<on_reg>(vars.at(v));
+        const bool save_scratch = r_v != reg::runtime_scratch && !is_reg_free(reg::runtime_scratch);
+        if (save_scratch)os << "push " << reg::to_string(reg::runtime_scratch) << "\n";
+        if (r_v != reg::runtime_scratch)os << "mov " << reg::to_string(reg::runtime_scratch) << ", " << r << "\n";
+        os << "call " << v.destructor() << "\n";
+        if (save_scratch)os << "pop " << reg::to_string(reg::runtime_scratch) << "\n";
+        os << ".L" << done << "\n";
       };
         break;
       case unboxed:break;
@@ -780,7 +2134,6 @@ void context_t::destroy(var v, std::ostream &os) {
   assert_consistency();
 }
 void context_t::increment_refcount(var v, std::ostream &os) {
-  //TODO: increment with more specific fashion
   assert_consistency();
   if (v.destroy_class() & non_trivial) {
     os << "; incrementing " << v << " : " << destroy_class_to_string(v.destroy_class()) << " \n";
@@ -789,24 +2142,21 @@ void context_t::increment_refcount(var v, std::ostream &os) {
       case non_trivial:
       case boxed:
       case non_global: {
-        move(reg::args_order.front(), location(v), os);
-        assert(location(v) == strict_location_t{reg::args_order.front()}); //increment preserve the calling register
-        bool push_for_align = !(stack_size() & 1);
-        for (auto r : reg::volatiles)
-          if (r != reg::args_order.front() && !is_reg_free(r)) {
-            os << "push " << reg::to_string(r) << "\n";
-            push_for_align ^= 1;
-          }
-        if (push_for_align)os << "sub rsp, 8\n";
-        os << "call increment_value\n";
-        if (push_for_align)os << "add rsp, 8\n";
-        os << "mov " << reg::to_string(reg::args_order.front()) << ", rax \n";
-        for (auto r = reg::volatiles.rbegin(); r != reg::volatiles.rend(); ++r)
-          if (*r != reg::args_order.front() && !is_reg_free(*r)) {
-            os << "pop " << reg::to_string(*r) << "\n";
-          }
-        assert(location(v) == strict_location_t{reg::args_order.front()}); //increment preserve the calling register
-
+        //fully inlined, skipping immediates and static blocks
+        make_non_mem(v, os);
+        const std::string r = retrieve_to_string(v);
+        const size_t done = ++branch_id_factory;
+        if (v.destroy_class() & unboxed) {
+          os << "test " << r << ", 1\n";
+          os << "jnz .L" << done << "\n";
+        }
+        if (v.destroy_class() & destroy_class_t::global) {
+          os << "cmp dword [" << r << "], 0\n";
+          os << "je .L" << done << "\n";
+        }
+        os << "add dword [" << r << "], 2\n";
+        if (profile)os << "add qword [alloc_profile_increments], 1\n";
+        os << ".L" << done << "\n";
       };
         break;
       case unboxed:break;
@@ -831,6 +2181,11 @@ std::optional<uint64_t> context_t::is_constant(var v) const {
       [](const on_stack &) -> std::optional<uint64_t> { return {}; }
   }, vars.at(v));
 }
+std::optional<register_t> context_t::is_on_register(var v) const {
+  assert(vars.contains(v));
+  if (const auto *r = std::get_if<on_reg>(&vars.at(v)))return *r;
+  return {};
+}
 
 void context_t::declare_global(var v, std::string_view name) {
   assert_consistency();
@@ -865,14 +2220,51 @@ void context_t::declare_copy(var dst, var src, std::ostream &os) {
 }
 void context_t::declare_free(var v, std::ostream &os) {
   assert_consistency();
-  register_t r = free_reg(os);
+  register_t r = free_reg(v, os);
   regs[r] = v;
   vars[v] = r;
   assert_consistency();
 }
+void context_t::set_allocation_hints(const std::unordered_set<var> &across,
+                                     const live_intervals &li,
+                                     allocation_stats &s) {
+  across_calls = &across;
+  intervals = &li;
+  stats = &s;
+}
+void context_t::reach(const scope &s, size_t i) {
+  if (!intervals)return;
+  if (auto p = intervals->position(s, i))now = *p;
+}
+//a free register for v, if any: a callee-saved one if v lives across a call, so the call won't have to move it away, and
+//a caller-saved one otherwise, to leave the others to who does. If none is free, a callee-saved one is still worth
+//pushing its saved value for the former, otherwise the least recently used register is spilled.
+register_t context_t::free_reg(var v, std::ostream &os) {
+  assert_consistency();
+  const bool long_lived = across_calls && across_calls->contains(v);
+  auto r = lru.first_if([&](register_t x) { return is_reg_free(x) && reg::is_non_volatile(x) == long_lived; });
+  auto holds_save = [&](register_t x) { return reg::is_non_volatile(x) && std::holds_alternative<save>(regs[x]); };
+  if (!r && long_lived && (r = lru.first_if(holds_save)))move_to_stack(*r, os);
+  if (!r)r = lru.first_if([&](register_t x) { return is_reg_free(x); });
+  if (!r)return free_reg(os);
+  lru.bring_back(*r);
+  assert_consistency();
+  return *r;
+}
+//No register is free: as in a linear scan, the content whose interval ends last is spilled, a saved value before any
+//var. It's taken among the least recently used half of the registers, which leaves out the operands at hand.
 register_t context_t::free_reg(std::ostream &os) {
   assert_consistency();
   register_t r = lru.front();
+  if (intervals)
+    r = lru.max_of_first(reg::all.size() / 2, [&](register_t x) {
+      return std::visit(overloaded{
+          [](free) { return std::pair{2, size_t(0)}; },
+          [](save) { return std::pair{1, size_t(0)}; },
+          [](frame_word) { return std::pair{0, size_t(0)}; },
+          [&](var v) { return std::pair{0, intervals->end(v)}; },
+      }, regs[x]);
+    });
   lru.bring_back(r);
   free_reg(r, os);
   assert_consistency();
@@ -894,14 +2286,16 @@ void context_t::move_to_stack(register_t r, std::ostream &os) {
     stack_id = stack.size();
     os << "push " << reg::to_string(r) << "\n";
     stack.emplace_back(regs[r]);
+    if (stats)stats->stack_slots = std::max(stats->stack_slots, stack.size());
   } else {
     stack_id = std::distance(stack.begin(), it);
     os << "mov qword [rsp+" << (stack.size() - stack_id - 1) * 8 << "], " << reg::to_string(r) << "\n";
     stack[stack_id] = regs[r];
   }
+  if (stats && std::holds_alternative<var>(regs[r]))++stats->spills;
   regs[r] = free{};
   std::visit(overloaded{
-      ignore<free>(),
+      ignore<free, frame_word>(),
       [&](save sr) { saved[sr] = on_stack{stack_id}; },
       [&](var v) { vars[v] = on_stack{stack_id}; }
   }, stack[stack_id]);
@@ -920,6 +2314,19 @@ void context_t::declare_in(var v, register_t r) {
   vars[v] = r;
   assert_consistency();
 }
+void context_t::clobber(std::initializer_list<register_t> rs, std::ostream &os) {
+  assert_consistency();
+  for (register_t r : rs) {
+    if (is_reg_free(r))continue;
+    //prefer another free register to the stack
+    auto it = std::find_if(reg::volatiles.begin(), reg::volatiles.end(), [&](register_t o) {
+      return is_reg_free(o) && std::find(rs.begin(), rs.end(), o) == rs.end();
+    });
+    if (it != reg::volatiles.end())move(*it, r, os);
+    else move_to_stack(r, os);
+  }
+  assert_consistency();
+}
 void context_t::make_non_mem(var v, std::ostream &os) {
   assert_consistency();
   assert(vars.contains(v));
@@ -929,7 +2336,7 @@ void context_t::make_non_mem(var v, std::ostream &os) {
         lru.bring_back(r);
       },
       [&](on_stack p) {
-        register_t r = free_reg(os);
+        register_t r = free_reg(v, os);
         if (p == stack.size() - 1) {
           os << "pop " << reg::to_string(r) << "\n";
           stack.pop_back();
@@ -988,8 +2395,11 @@ void context_t::return_clean(const std::vector<std::pair<var, register_t>> &args
   //assert(vars.size() == args.size()); // there shouldn't be more living variables //TODO: verify statement
 
 
-  //Step 1. restore nonvolatiles
-  for (auto r : reg::non_volatiles)move(r, location(r), os);
+  //Step 1. restore nonvolatiles, along with the args that are stored somewhere
+  std::vector<std::pair<content_t, strict_location_t>> targets;
+  for (auto r : reg::non_volatiles)targets.emplace_back(save{r}, r);
+  for (const auto&[v, r] : args)if (!is_virtual(v))targets.emplace_back(v, r);
+  parallel_move(std::move(targets), true, os);
 
   assert_consistency();
   assert(are_nonvolatiles_restored());
@@ -1001,11 +2411,18 @@ void context_t::return_clean(const std::vector<std::pair<var, register_t>> &args
     std::visit(overloaded{
         [](free) {},
         [](save) { THROW_INTERNAL_ERROR },
+        [](frame_word) { THROW_INTERNAL_ERROR }, // frame blocks die before returning
         [&](var v) {
           assert(var_target.contains(v));
           register_t r = var_target.at(v);
           if (!is_reg_free(r)) {
-            r = lru.front_volatile(); //TODO: this should return a free register
+            //prefer a register which is not the target of another arg
+            auto is_available = [&](register_t x) { return reg::is_volatile(x) && is_reg_free(x); };
+            if (std::any_of(reg::volatiles.begin(), reg::volatiles.end(), [&](register_t x) {
+              return is_available(x) && !reg_target.contains(x);
+            }))
+              r = lru.front_if([&](register_t x) { return is_available(x) && !reg_target.contains(x); });
+            else r = lru.front_if(is_available);
           }
           if (!is_reg_free(r)) {
             assert(is_reg_free(r));
@@ -1083,7 +2500,7 @@ void context_t::devirtualize(var v, std::ostream &os) {
   assert(vars.contains(v));
   assert_consistency();
   if (!is_virtual(v))return;
-  register_t r = free_reg(os);
+  register_t r = free_reg(v, os);
   os << "mov " << reg::to_string(r) << ", ";
   std::visit(overloaded{ignore<on_reg, on_stack>(),
                         [&](constant c) { os << c.value; },
@@ -1120,52 +2537,103 @@ context_t context_t::merge(context_t c1, std::ostream &os1, context_t c2, std::o
     if (c1.is_virtual(v))assert(c1.vars[v] == c2.vars[v]);
   }
 
-  //strategy: make c1 equal to c2
-  //1. stack
-  {
-    if (c1.stack_size() < c2.stack_size()) {
-      os1 << "sub rsp, " << 8 * (c2.stack_size() - c1.stack_size()) << "\n";
-      c1.stack.resize(c2.stack_size(), free{});
-    }
-    for (size_t i = 0; i < c2.stack_size(); ++i) {
-      while (!is_free(c1.stack[i]) && c1.stack[i] != c2.stack[i]) {
-        c1.move(c2.location(c1.stack[i]), on_stack{i}, os1);
-      }
-      if (!is_free(c2.stack[i]))c1.move(on_stack{i}, c1.location(c2.stack[i]), os1);
-    }
+  //either branch can keep its layout, while the other one moves to it: the cheaper of the two is chosen
+  std::stringstream moves1, moves2;
+  context_t c1_as_c2 = c1, c2_as_c1 = c2;
+  c1_as_c2.become(c2, moves1);
+  c2_as_c1.become(c1, moves2);
+  auto instructions = [](const std::stringstream &ss) {
+    const std::string str = ss.str();
+    return std::count(str.begin(), str.end(), '\n');
+  };
+  //intersection must match on unborn, deads, union of {constant,global,on_stack,on_reg}
+  //at most one variable can change from true store {on_stack,on_reg} to virtual {constant,global}
 
+  assert(c1_as_c2.vars == c2.vars);
+  assert(c2_as_c1.vars == c1.vars);
+  if (instructions(moves2) < instructions(moves1)) {
+    os2 << moves2.str();
+    return c2_as_c1;
   }
-
-  assert(std::equal(c2.stack.begin(), c2.stack.end(), c1.stack.begin()));//note that c1.stack might be longer
-
-  //2. regs
-  if (c1.regs != c2.regs) {
-    for (auto r : reg::all) {
-      while (!c2.is_reg_free(r) && !(c1.regs[r] == c2.regs[r])) {
-        c1.move(r, c1.location(c2.regs[r]), os1);
-      }
-    }
+  os1 << moves1.str();
+  return c1_as_c2;
+}
+//makes the layout the same as target's, which holds the same contents
+void context_t::become(const context_t &target, std::ostream &os) {
+  assert_consistency();
+  if (stack_size() < target.stack_size()) {
+    os << "sub rsp, " << 8 * (target.stack_size() - stack_size()) << "\n";
+    stack.resize(target.stack_size(), free{});
   }
-
-  assert(c1.regs == c2.regs);
-  if (c1.stack_size() > c2.stack_size()) {
-    assert(std::all_of(c1.stack.begin() + c2.stack_size(), c1.stack.end(), is_free));
-    os1 << "add rsp, " << 8 * (c1.stack_size() - c2.stack_size()) << "\n";
-    c1.stack.resize(c2.stack_size(), free{});
+  std::vector<std::pair<content_t, strict_location_t>> targets;
+  for (auto r : reg::all)if (!is_free(target.regs[r]))targets.emplace_back(target.regs[r], r);
+  for (size_t i = 0; i < target.stack_size(); ++i)
+    if (!is_free(target.stack[i]))targets.emplace_back(target.stack[i], i);
+  parallel_move(std::move(targets), false, os);
+  if (stack_size() > target.stack_size()) {
+    assert(std::all_of(stack.begin() + target.stack_size(), stack.end(), is_free));
+    os << "add rsp, " << 8 * (stack_size() - target.stack_size()) << "\n";
+    stack.resize(target.stack_size(), free{});
   }
-  assert(c1.stack == c2.stack);
-
-
-
-
-
-  //intersection must match on unborn, deads, union of {constant,global,on_stack,on_reg}
-  //at most one variable can change from true store {on_stack,on_reg} to virtual {constant,global}
-
-  assert(c1.stack == c2.stack);
-  assert(c1.regs == c2.regs);
-  assert(c1.vars == c2.vars);
-  return c1;
+  assert(stack == target.stack);
+  assert(regs == target.regs);
+  assert_consistency();
+}
+//Moves every content to its target location at once: a content is moved as soon as its target is free, so that movs
+//are ordered not to overwrite what is still to be moved. A content in the way that doesn't have to move is swapped
+//aside. Cycles are broken through a free register when they pass through the stack, by xchg between registers
+//otherwise. With may_pop, loading a free register from the top of the stack is a pop.
+void context_t::parallel_move(std::vector<std::pair<content_t, strict_location_t>> targets,
+                              bool may_pop,
+                              std::ostream &os) {
+  assert_consistency();
+  auto is_pending = [&](content_t c) {
+    return std::any_of(targets.begin(), targets.end(), [&](const auto &t) { return t.first == c; });
+  };
+  auto free_register = [&] { return lru.first_if([&](register_t r) { return is_reg_free(r); }); };
+  auto from_stack = [&](const auto &t) { return std::holds_alternative<on_stack>(location(t.first)); };
+  while (true) {
+    std::erase_if(targets, [&](const auto &t) { return location(t.first) == t.second; });
+    if (targets.empty())break;
+    auto to_free = std::find_if(targets.begin(), targets.end(), [&](const auto &t) {
+      return is_free(content(t.second));
+    });
+    if (to_free != targets.end()) {
+      auto pop = std::find_if(targets.begin(), targets.end(), [&](const auto &t) {
+        return std::holds_alternative<on_reg>(t.second) && is_free(content(t.second))
+            && location(t.first) == strict_location_t{stack_size() - 1};
+      });
+      if (may_pop && pop != targets.end()) {
+        const register_t r = std::get<on_reg>(pop->second);
+        os << "pop " << reg::to_string(r) << "\n";
+        regs[r] = stack.back();
+        stack.pop_back();
+        reassign(r);
+      } else move(to_free->second, location(to_free->first), os);
+      continue;
+    }
+    auto in_the_way = std::find_if(targets.begin(), targets.end(), [&](const auto &t) {
+      return !is_pending(content(t.second));
+    });
+    if (in_the_way != targets.end()) {
+      const strict_location_t l = in_the_way->second;
+      auto r = free_register();
+      if (r && (std::holds_alternative<on_stack>(l) || from_stack(*in_the_way)))move(*r, l, os);
+      else move(l, location(in_the_way->first), os);
+      continue;
+    }
+    //only cycles are left
+    auto through_stack = std::find_if(targets.begin(), targets.end(), from_stack);
+    if (auto r = free_register(); r && through_stack != targets.end())move(*r, location(through_stack->first), os);
+    else move(targets.front().second, location(targets.front().first), os);
+  }
+  assert_consistency();
+}
+context_t::content_t context_t::content(strict_location_t l) const {
+  return std::visit(overloaded{
+      [&](on_reg r) { return regs[r]; },
+      [&](on_stack p) { return p < stack.size() ? stack[p] : content_t{free{}}; },
+  }, l);
 }
 //Args are MOVED. If you need copy, after calling perform the right copies.
 void context_t::call_clean(const std::vector<std::pair<var, register_t>> &args, std::ostream &os) {
@@ -1183,54 +2651,22 @@ void context_t::call_clean(const std::vector<std::pair<var, register_t>> &args,
   }
 
   //move non virtual
-  for (const auto&[v, r] : args)
-    if (!is_virtual(v) && vars[v] != location_t{r}) {
-      std::visit(overloaded{
-          [](const constant &c) { THROW_INTERNAL_ERROR },
-          [](const global &g) { THROW_INTERNAL_ERROR },
-          [&, r = r, v = v](on_reg sr) {
-            if (is_reg_free(r)) {
-              std::swap(regs[r], regs[sr]);
-              vars[v] = r;
-              os << "mov " << reg::to_string(r) << ", " << reg::to_string(sr) << "\n";
-            } else {
-              var v2 = std::get<var>(regs[r]);
-              std::swap(vars[v2], vars[v]);
-              std::swap(regs[r], regs[sr]);
-              os << "xchg " << reg::to_string(r) << ", " << reg::to_string(sr) << "\n";
-            }
-          },
-          [&, r = r, v = v](on_stack p) {
-            if (is_reg_free(r)) {
-              regs[r] = v;
-              stack[p] = free{};
-              vars[v] = r;
-              if (p == stack.size() - 1) {
-                os << "pop " << reg::to_string(r) << "\n";
-                stack.pop_back();
-              } else {
-                os << "mov " << reg::to_string(r) << ", qword [rsp" << offset((stack.size() - 1 - p) * 8) << "]\n";
-              }
-            } else {
-              var v2 = std::get<var>(regs[r]);
-              std::swap(vars[v2], vars[v]);
-              std::swap(regs[r], stack[p]);
-              os << "xchg " << reg::to_string(r) << ", qword [rsp" << offset((stack.size() - 1 - p) * 8) << "]\n";
-            }
-          }
-      }, vars[v]);
-    }
+  std::vector<std::pair<content_t, strict_location_t>> targets;
+  for (const auto&[v, r] : args)if (!is_virtual(v))targets.emplace_back(v, r);
+  parallel_move(std::move(targets), true, os);
 
   //move registers
   for (register_t r : reg::volatiles)
     if (!is_reg_free(r) && (!reg_target.contains(r) || content_t{reg_target.at(r)} != regs[r])) {
-      //try first registers
-      auto nr = lru.front_non_volatile();
-      if (is_reg_free(nr)) {
+      //try first registers: a free callee-saved one, or else one whose saved value can be pushed in place of r's
+      auto nr = lru.first_if([&](register_t x) { return reg::is_non_volatile(x) && is_reg_free(x); });
+      auto holds_save = [&](register_t x) { return reg::is_non_volatile(x) && std::holds_alternative<save>(regs[x]); };
+      if (!nr && std::holds_alternative<var>(regs[r]) && (nr = lru.first_if(holds_save)))move_to_stack(*nr, os);
+      if (nr) {
         //use reg
-        assert(reg::is_non_volatile(nr));
-        move_to_register(nr, r, os);
-        lru.bring_back(nr);
+        assert(reg::is_non_volatile(*nr));
+        move_to_register(*nr, r, os);
+        lru.bring_back(*nr);
       } else {
         //use stack
         move_to_stack(r, os);
@@ -1272,6 +2708,52 @@ void context_t::call_copy(const std::vector<std::pair<var, register_t>> &args, s
   }
 }
 
+//Only as many saves as there are vars living across calls at once go to the stack, see live_intervals: the other
+//non-volatiles keep their saved values at the loop head, and are restored on each iteration where they've been taken.
+void context_t::enter_loop(std::ostream &os) {
+  assert_consistency();
+  assert(stack.empty());
+  size_t needed = reg::non_volatiles.size();
+  if (intervals && across_calls)needed = std::min(needed, intervals->max_overlap(*across_calls));
+  for (size_t k = 0; k < needed; ++k)move_to_stack(reg::non_volatiles[k], os);
+  loop_stack = stack;
+  assert_consistency();
+}
+
+//Args are MOVED, as in return_clean: the copies are done by the caller afterwards.
+void context_t::loop_clean(const std::vector<std::pair<var, register_t>> &args, std::ostream &os) {
+  assert_consistency();
+  assert(stack_size() >= loop_stack.size());
+
+  //Step 1. saves back to where they were at the loop head, along with the args that are stored somewhere
+  std::vector<std::pair<content_t, strict_location_t>> targets;
+  for (size_t i = 0; i < loop_stack.size(); ++i)targets.emplace_back(loop_stack[i], i);
+  for (auto r : reg::non_volatiles)
+    if (std::find(loop_stack.begin(), loop_stack.end(), content_t{save{r}}) == loop_stack.end())
+      targets.emplace_back(save{r}, r);
+  for (const auto&[v, r] : args)if (!is_virtual(v))targets.emplace_back(v, r);
+  parallel_move(std::move(targets), false, os);
+
+  //Step 2. shrink the stack to the one of the loop head
+  assert(std::all_of(stack.begin() + loop_stack.size(), stack.end(), is_free));
+  if (stack_size() > loop_stack.size()) {
+    os << "add rsp, " << 8 * (stack_size() - loop_stack.size()) << "\n";
+    stack.resize(loop_stack.size());
+  }
+
+  //Step 3. make concrete non-stored vars
+  for (const auto&[v, r] : args) {
+    if (vars[v] == location_t{r})continue;
+    assert(is_virtual(v) && is_reg_free(r));
+    os << "mov " << reg::to_string(r) << ", " << at(v) << "\n";
+    regs[r] = v;
+    vars[v] = r;
+  }
+  assert(stack == loop_stack);
+  assert(are_volatiles_free(args));
+  assert_consistency();
+}
+
 void context_t::align_stack_16_precall(std::ostream &os) {
   assert_consistency();
   if (stack.size() & 1)return; //already aligned
@@ -1300,14 +2782,14 @@ void context_t::reassign(context_t::strict_location_t l) {
   std::visit(overloaded{
       [&](on_reg r) {
         std::visit(overloaded{
-            ignore<free>(),
+            ignore<free, frame_word>(),
             [&](var v) { vars[v] = r; },
             [&](save sr) { saved[sr] = r; }
         }, regs[r]);
       },
       [&](on_stack p) {
         std::visit(overloaded{
-            ignore<free>(),
+            ignore<free, frame_word>(),
             [&](var v) { vars[v] = p; },
             [&](save sr) { saved[sr] = p; }
         }, stack[p]);
@@ -1357,6 +2839,12 @@ void context_t::move(strict_location_t dst, strict_location_t src, std::ostream
             },
             [&](on_stack p_src) {
               if (p_src == p_dst)return;
+              if (is_free(stack[p_dst]))
+                if (auto r = lru.first_if([&](register_t x) { return is_reg_free(x); })) {
+                  move(*r, p_src, os);
+                  move(p_dst, *r, os);
+                  return;
+                }
               os << "xchg rax, qword [rsp" << offset((stack.size() - 1 - p_dst) * 8) << "]\n";
               os << "xchg rax, qword [rsp" << offset((stack.size() - 1 - p_src) * 8) << "]\n";
               os << "xchg rax, qword [rsp" << offset((stack.size() - 1 - p_dst) * 8) << "]\n";
@@ -1381,7 +2869,12 @@ context_t::strict_location_t context_t::location(content_t c) const {
         }, vars.at(v));
       },
       [&](save r) -> strict_location_t { return saved[r]; },
+      [&](frame_word) -> strict_location_t { return size_t(std::find(stack.begin(), stack.end(), c) - stack.begin()); },
   }, c);
 }
 
-}
\ No newline at end of file
+}
+
+size_t ir_sections_t::alloc_site(std::string_view loc, std::string_view kind, uint32_t tag, size_t words) const {
+  return sites ? sites->add(loc, kind, tag, words) : 0;
+}
@@ -7,15 +7,23 @@
 #include <vector>
 #include <unordered_set>
 
+namespace ir { struct alloc_sites; }
+
 struct ir_sections_t {
   std::ostream &data;
   std::back_insert_iterator<std::vector<ir::lang::function>> text;
   ir::lang::scope &main;
+  size_t fused_words; // largest allocation the blocks of nested constructors are carved out of, 0 disables the fusion
+  ir::alloc_sites *sites; // null unless compiling for the profiling mode
   ir_sections_t(const ir_sections_t&) = default;
-  ir_sections_t(std::ostream& d, std::back_insert_iterator<std::vector<ir::lang::function>> t, ir::lang::scope &m) : data(d), text(t), main(m) {}
+  ir_sections_t(std::ostream& d, std::back_insert_iterator<std::vector<ir::lang::function>> t, ir::lang::scope &m,
+                size_t fused_words, ir::alloc_sites *sites = nullptr)
+      : data(d), text(t), main(m), fused_words(fused_words), sites(sites) {}
   ir_sections_t with_main(ir::lang::scope &m)  {
-    return ir_sections_t(data, text, m);
+    return ir_sections_t(data, text, m, fused_words, sites);
   }
+  // the site a heap block is counted in by the profiling mode, 0 if not profiling
+  size_t alloc_site(std::string_view loc, std::string_view kind, uint32_t tag, size_t words) const;
 };
 
 namespace ir {
@@ -29,10 +37,57 @@ namespace reg {
 bool is_volatile(register_t r);
 bool is_non_volatile(register_t r);
 std::string_view to_string(register_t r);
+std::string_view to_string_low_byte(register_t r); // e.g. al for rax, for setcc
 constexpr auto all = util::make_array(rax, rcx, rdx, rsi, r8, r9, r10, r11, rbx, rbp, rdi, r12, r13, r14, r15);
 constexpr auto non_volatiles = util::make_array(rbx, rbp, r12, r13, r14, r15);
 constexpr auto volatiles = util::make_array(rax, rcx, rdx, rdi, rsi, r8, r9, r10, r11);
 static constexpr auto args_order = util::make_array(rdi, rsi, rdx, rcx, r8, r9);
+// where the fields of a block returned unboxed go, see lang::unbox_tuple_returns
+static constexpr auto returns_order = util::make_array(rax, rdx, rcx, rsi, rdi, r8, r9);
+// argument of the register-preserving runtime helpers (e.g. destroy_nontrivial_preserving in rt.c): besides their
+// result in rax, it's the only register they clobber
+constexpr register_t runtime_scratch = r11;
+};
+
+// largest block (in words) served by the runtime size-class free lists - must match FAST_MALLOC_MAX_WORDS in rt.c
+constexpr size_t fast_malloc_max_words = 16;
+
+// blocks start with a single header word: the refcount in the low dword ((n << 1) | 1, or 0 for static blocks), then
+// the destructor bit (bit 32), the size of the fields (bits 33-47) and the tag (bits 48-63); the fields follow.
+// Must match make_header in rt.c
+constexpr size_t header_words = 1;
+constexpr uint32_t header_max_size = 0x7fff;
+constexpr uint32_t header_max_tag = 0xffff;
+constexpr uint64_t make_header(uint32_t tag, uint32_t size, bool d, uint32_t refcount = 3) {
+  return (uint64_t(tag) << 48) | (uint64_t(size) << 33) | (uint64_t(d) << 32) | refcount;
+}
+constexpr bool header_has_destructor(uint64_t header) {
+  return (header >> 32) & 1;
+}
+constexpr uint32_t header_tag(uint64_t header) {
+  return header >> 48;
+}
+
+// The allocation sites of the profiling mode: every expression that allocates heap blocks (a constructor, a tuple, a
+// closure) gets an entry of the table alloc_profile_sites, whose counters the generated code increments along with the
+// refcount operations and the live words. The runtime built with ALLOC_PROFILE reports it at exit, see rt.c. An entry is
+// [allocated, reused, words, tag, location, kind], the last two pointing to strings; must match alloc_profile_site.
+struct alloc_sites {
+  static constexpr size_t entry_words = 6;
+  alloc_sites(std::string_view source, std::string_view filename) : source(source), filename(filename) {}
+  size_t add(std::string_view loc, std::string_view kind, uint32_t tag, size_t words); // the site id, from 1
+  static std::string allocated(size_t site); // the memory operands of the counters of a site
+  static std::string reused(size_t site);
+  void emit(std::ostream &data) const;
+ private:
+  struct entry {
+    std::string location; // file:line:column
+    std::string kind;
+    uint32_t tag;
+    size_t words;
+  };
+  std::string_view source, filename;
+  std::vector<entry> entries;
 };
 
 /*
@@ -201,6 +256,18 @@ struct reg_lru {
   register_t front_volatile() const { return volatile_list.front(); }
   register_t front_non_volatile() const { return non_volatile_list.front(); }
   template<typename Pred>
+  std::optional<register_t> first_if(Pred p) const {
+    auto it = std::find_if(list.begin(), list.end(), p);
+    if (it == list.end())return {};
+    return *it;
+  }
+  // among the n least recently used registers, the first one with the greatest key
+  template<typename Key>
+  register_t max_of_first(size_t n, Key key) const {
+    auto end = std::next(list.begin(), std::min(n, list.size()));
+    return *std::max_element(list.begin(), end, [&](register_t a, register_t b) { return key(a) < key(b); });
+  }
+  template<typename Pred>
   register_t front_if(Pred p) const {
     auto it = std::find_if(list.begin(), list.end(), p);
     if (it == list.end())THROW_INTERNAL_ERROR;
@@ -242,11 +309,24 @@ struct reg_lru {
 };
 
 using namespace lang;
+// the instructions of a function numbered in the order they are compiled, each var being live from the first to the
+// last position it appears at: the intervals of a linear scan, which the allocation hints of context_t are taken from
+struct live_intervals {
+  explicit live_intervals(const function &f);
+  std::optional<size_t> position(const scope &s, size_t i) const; // of the i-th instruction of s
+  size_t end(var v) const; // the last position v is used at, past all of them if v isn't known
+  size_t max_overlap(const std::unordered_set<var> &vs) const; // the most of vs live at once
+ private:
+  std::unordered_map<const scope *, std::vector<size_t>> positions;
+  std::unordered_map<var, std::pair<size_t, size_t>> intervals;
+};
+
 struct context_t {
  private:
 
   void assert_consistency() const;
   register_t free_reg(std::ostream &os);
+  register_t free_reg(var v, std::ostream &os);
   void free_reg(register_t, std::ostream &os);
   void move_to_stack(register_t, std::ostream &os);
   void move_to_register(register_t dst, register_t src, std::ostream &os);
@@ -268,6 +348,15 @@ struct context_t {
     }
   }
   void debug_vars(std::ostream &os) const;
+  // vars in across_calls get callee-saved registers when possible, spills take the registers whose intervals end last,
+  // and get counted in stats
+  void set_allocation_hints(const std::unordered_set<var> &across_calls,
+                            const live_intervals &intervals,
+                            allocation_stats &stats);
+  void reach(const scope &s, size_t i); // the i-th instruction of s is compiled next
+  // the inline refcount operations are counted in alloc_profile_increments/decrements, see ir::alloc_sites
+  void set_profile(bool p) { profile = p; }
+  bool profiling() const { return profile; }
 
   void devirtualize(var v, std::ostream &os);
   void destroy(var v, std::ostream &);
@@ -276,13 +365,21 @@ struct context_t {
   void increment_refcount(var v, std::ostream &);
   void declare_const(var v, uint64_t value);
   std::optional<uint64_t> is_constant(var v) const;
+  std::optional<register_t> is_on_register(var v) const;
   void declare_global(var v, std::string_view name);
   bool is_virtual(var v) const;
   void declare_copy(var dst, var src, std::ostream &os);
   void declare_move(var dst, var src);
   void declare_free(var v, std::ostream &os);
   void declare_in(var v, register_t r);// the register must have been empty before, and now its content it's a variable
+  void declare_frame_block(var v, size_t size, std::ostream &os); // v points to a new block of size words in the stack
+  void track_field(var block, size_t block_offset, var src); // a frame block drops its non trivial fields with it
+  void declare_register_block(var v, size_t size); // v is never allocated, its fields stay in vars until returned
+  bool is_register_block(var v) const;
+  void write_register_field(var block, size_t block_offset, var src, bool moved, std::ostream &os);
+  std::vector<std::pair<var, register_t>> register_block_fields(var v) const; // in reg::returns_order
   void make_non_mem(var v, std::ostream &os);
+  void clobber(std::initializer_list<register_t> rs, std::ostream &os); // empties rs, for the runtime helpers
   void make_non_both_mem(var v1, var v2, std::ostream &os);
   void make_both_non_mem(var v1, var v2, std::ostream &os);
   static context_t merge(context_t c1, std::ostream &os1, context_t c2, std::ostream &os2);
@@ -292,6 +389,9 @@ struct context_t {
   void call_clean(const std::vector<std::pair<var, register_t>> &args,
                   std::ostream &os); // those variable will go in the specified volatile registers.
   void call_copy(const std::vector<std::pair<var, register_t>> &args, std::ostream &os);
+  void enter_loop(std::ostream &os); // the saves needed go to the stack once, the loop head keeps them there
+  void loop_clean(const std::vector<std::pair<var, register_t>> &args,
+                  std::ostream &os); // back to the state of the loop head - vars into registers, saves left on the stack
   void call_happened(const std::vector<std::pair<var, register_t>> &args);
   void align_stack_16_precall(std::ostream &os);
   void compress_stack(std::ostream &);
@@ -315,6 +415,11 @@ struct context_t {
   bool is_stack_empty() const;
  private:
   reg_lru lru;
+  const std::unordered_set<var> *across_calls = nullptr;
+  const live_intervals *intervals = nullptr;
+  size_t now = 0; // position of the instruction being compiled, in intervals
+  allocation_stats *stats = nullptr;
+  bool profile = false;
 
   struct constant {
     uint64_t value;
@@ -332,14 +437,26 @@ struct context_t {
 
   typedef std::monostate free;
   typedef register_t save;
-  typedef std::variant<free, var, save> content_t;
-  std::array<std::variant<free, var, save>, reg::all.size()> regs;
-  std::vector<std::variant<free, var, save>> stack;
+  struct frame_word { // a word of a block in the stack, that stays there until the block is destroyed
+    var block;
+    size_t word;
+    bool operator==(const frame_word &) const = default;
+  };
+  typedef std::variant<free, var, save, frame_word> content_t;
+  std::array<content_t, reg::all.size()> regs;
+  std::vector<content_t> stack;
+  std::vector<content_t> loop_stack; // the stack at the loop head, see enter_loop
+  std::unordered_map<var, std::vector<std::pair<size_t, destroy_class_t>>> frame_blocks; // with the fields to drop
+  void destroy_frame_block(var v, std::ostream &os);
+  std::unordered_map<var, std::vector<std::optional<var>>> register_blocks; // with the vars holding the fields
 
   void reassign(strict_location_t);
   static bool is_free(content_t);
   void move(strict_location_t, strict_location_t, std::ostream &);
   strict_location_t location(content_t) const;
+  content_t content(strict_location_t) const;
+  void parallel_move(std::vector<std::pair<content_t, strict_location_t>> targets, bool may_pop, std::ostream &);
+  void become(const context_t &target, std::ostream &);
 };
 
 std::ostream &operator<<(std::ostream &os, const context_t::streamable &);
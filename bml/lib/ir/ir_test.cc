@@ -99,10 +99,6 @@ struct value {
 #define Tag_Fun 1
 #define Tag_Arg 2
 
-  static uint64_t make_tag_size_d(uint32_t tag, uint32_t size, uint8_t d) {
-    return (((uint64_t) tag) << 32) | (((uint64_t) size) << 1) | (d & 1);
-  }
-
   uintptr_t uint_to_v(uint64_t x) {
     return (uintptr_t) ((x << 1) | 1);
   }
@@ -114,39 +110,36 @@ struct value {
           os << "push " << (2 * n + 1) << "\n";
         },
         [&](const fun &f) {
-          os << "mov " << reg::to_string(reg::args_order.front()) << ", " << (4 * 8) << "\n";
+          os << "mov " << reg::to_string(reg::args_order.front()) << ", " << (3 * 8) << "\n";
           os << "call malloc\n";
-          os << "mov qword [rax], 3\n";
-          os << "mov rbx, " << make_tag_size_d(Tag_Fun, 2, 0) << "\n";
-          os << "mov qword [rax+8], rbx\n";
-          os << "mov qword [rax+16], " << f.loc << "\n";
-          os << "mov qword [rax+24], " << f.n_params << "\n";
+          os << "mov rbx, " << make_header(Tag_Fun, 2, 0) << "\n";
+          os << "mov qword [rax], rbx\n";
+          os << "mov qword [rax+8], " << f.loc << "\n";
+          os << "mov qword [rax+16], " << f.n_params << "\n";
           os << "push rax\n";
 
         },
         [&](const tuple &t) {
           for (auto vit = t.rbegin(); vit != t.rend(); ++vit)vit->allocate_dynamically(os);
-          os << "mov " << reg::to_string(reg::args_order.front()) << ", " << ((t.size() + 2) * 8) << "\n";
+          os << "mov " << reg::to_string(reg::args_order.front()) << ", " << ((t.size() + header_words) * 8) << "\n";
           os << "call malloc\n";
-          os << "mov qword [rax], 3\n";
-          os << "mov rbx, " << make_tag_size_d(Tag_Tuple, t.size(), 0) << "\n";
-          os << "mov qword [rax+8], rbx\n";
+          os << "mov rbx, " << make_header(Tag_Tuple, t.size(), 0) << "\n";
+          os << "mov qword [rax], rbx\n";
           for (size_t i = 0; i < t.size(); ++i) {
             os << "pop rbx\n";
-            os << "mov qword [rax+" << ((i + 2) * 8) << "], rbx\n";
+            os << "mov qword [rax+" << ((i + header_words) * 8) << "], rbx\n";
           }
           os << "push rax\n";
         },
         [&](const tvar &tv) {
           if (tv.v) {
             tv.v->allocate_dynamically(os);
-            os << "mov " << reg::to_string(reg::args_order.front()) << ", " << (3 * 8) << "\n";
+            os << "mov " << reg::to_string(reg::args_order.front()) << ", " << (2 * 8) << "\n";
             os << "call malloc\n";
-            os << "mov qword [rax], 3\n";
-            os << "mov rbx, " << make_tag_size_d(tv.tag, 1, 0) << "\n";
-            os << "mov qword [rax+8], rbx\n";
+            os << "mov rbx, " << make_header(tv.tag, 1, 0) << "\n";
+            os << "mov qword [rax], rbx\n";
             os << "pop rbx\n";
-            os << "mov qword [rax+16], rbx\n";
+            os << "mov qword [rax+8], rbx\n";
             os << "push rax\n";
           } else {
             os << "push " << tv.tag << "\n";
@@ -162,7 +155,7 @@ struct value {
         [&](fun &f) {
           static size_t fun_blk_id = 0;
           id = fun_blk_id++;
-          os << "__fun_block_" << id << "__ dq 0, " << make_tag_size_d(Tag_Fun, 2, 0) << ", " << f.loc << ", "
+          os << "__fun_block_" << id << "__ dq " << make_header(Tag_Fun, 2, 0, 0) << ", " << f.loc << ", "
              << uint_to_v(f.n_params) << "\n";
 
         },
@@ -170,7 +163,7 @@ struct value {
           static size_t tup_blk_id = 0;
           for (value &v : t)v.declare(os);
           id = tup_blk_id++;
-          os << "__tuple_" << id << "__ dq 0, " << make_tag_size_d(Tag_Tuple, t.size(), 0);
+          os << "__tuple_" << id << "__ dq " << make_header(Tag_Tuple, t.size(), 0, 0);
           for (value &v : t) {
             os << ", ";
             v.retrieve(os);
@@ -182,7 +175,7 @@ struct value {
             tv.v->declare(os);
             static size_t tvar_blk_id = 0;
             id = tvar_blk_id++;
-            os << "__variant_block_" << id << "__ dq 0, " << make_tag_size_d(tv.tag, 1, 0) << ", ";
+            os << "__variant_block_" << id << "__ dq " << make_header(tv.tag, 1, 0, 0) << ", ";
             tv.v->retrieve(os);
             os << "\n";
           }
@@ -404,13 +397,13 @@ retcode_format db  10,"%llu", 0
   }
 
   for (const auto &[f, n] : params.curriables) {
-    oasm << "__fun_block_" << f << "__ dq 0, 4294967300, " << f << ", " << (2 * n + 1) << "\n";
+    oasm << "__fun_block_" << f << "__ dq " << make_header(Tag_Fun, 2, 0, 0) << ", " << f << ", " << (2 * n + 1) << "\n";
   }
 
   oasm << R"(
 section .text
 global main
-extern printf, malloc, exit, print_debug, _mllib_fn__int_add, apply_fn, decrement_nontrivial, decrement_value, increment_value, _mllib_fn__int_println, _mllib_fn__int_fprintln
+extern printf, malloc, fast_malloc, fast_malloc_preserving, fast_malloc_free_list, exit, print_debug, _mllib_fn__int_add, apply_fn, destroy_nontrivial_preserving, decrement_nontrivial, decrement_value, increment_value, _mllib_fn__int_println, _mllib_fn__int_fprintln
 
 )";
 
@@ -549,7 +542,7 @@ TEST(RegLru, CopyConstr) {
 TEST(Build, UnboxTuple) {
   std::string_view source = R"(
   test_function(tuple : non_trivial) {
-      x_v : trivial = tuple[2];
+      x_v : trivial = tuple[1];
       return x_v;
   }
 )";
@@ -560,8 +553,8 @@ TEST(Build, UnboxTuple) {
 TEST(Build, UnboxTupleOfTuple) {
   std::string_view source = R"(
   test_function(ttuple : non_trivial) {
-      tuple : non_trivial = ttuple[2];
-      x_v : trivial = tuple[2];
+      tuple : non_trivial = ttuple[1];
+      x_v : trivial = tuple[1];
       return x_v;
   }
 )";
@@ -572,9 +565,9 @@ TEST(Build, UnboxTupleOfTuple) {
 TEST(Build, IntMin) {
   std::string_view source = R"(
   test_function(argv : non_trivial) {
-      x_v : unboxed = argv[2];
+      x_v : unboxed = argv[1];
       x = v_to_int(x_v);
-      y_v = argv[3];
+      y_v = argv[2];
       y = v_to_int(y_v);
       cmp (y, x);
       z = if (jle) then { return x; } else { return y; };
@@ -589,9 +582,9 @@ TEST(Build, IntMin) {
 TEST(Build, IntMin_LastCall_PrevVar) {
   std::string_view source = R"(
   test_function(argv) {
-      x_v = argv[2];
+      x_v = argv[1];
       x = v_to_int(x_v);
-      y_v = argv[3];
+      y_v = argv[2];
       y = v_to_int(y_v);
       cmp (y, x);
       z_v = if (jle) then {
@@ -609,9 +602,9 @@ TEST(Build, IntMin_LastCall_PrevVar) {
 TEST(Build, IntMin_LastCall_NewVar_inside) {
   std::string_view source = R"(
   test_function(argv) {
-      x_v = argv[2];
+      x_v = argv[1];
       x = v_to_int(x_v);
-      y_v = argv[3];
+      y_v = argv[2];
       y = v_to_int(y_v);
       cmp (y, x);
       z_v = if (jle) then {
@@ -631,9 +624,9 @@ TEST(Build, IntMin_LastCall_NewVar_inside) {
 TEST(Build, ArgMin) {
   std::string_view source = R"(
   test_function(argv) {
-      x_v = argv[2];
+      x_v = argv[1];
       x = v_to_int(x_v);
-      y_v = argv[3];
+      y_v = argv[2];
       y = v_to_int(y_v);
       cmp (y, x);
       z_v = if (jle) then {
@@ -656,9 +649,9 @@ TEST(Build, ArgMin) {
 TEST(Build, ArgMin_ConvertOutside) {
   std::string_view source = R"(
   test_function(argv) {
-      x_v = argv[2];
+      x_v = argv[1];
       x = v_to_int(x_v);
-      y_v = argv[3];
+      y_v = argv[2];
       y = v_to_int(y_v);
       cmp (y, x);
       z = if (jle) then {
@@ -682,7 +675,7 @@ void sum_of_n_vars(const size_t n) {
 
   std::stringstream source;
   source << "test_function (argv) { \n";
-  for (int i = 0; i < n; ++i) source << "x_v" << i << " = argv[" << (i + 2) << "];\n";
+  for (int i = 0; i < n; ++i) source << "x_v" << i << " = argv[" << (i + header_words) << "];\n";
   for (int i = 0; i < n; ++i) source << "x" << i << " = v_to_int(x_v" << i << ");\n";
   source << "sum0 = 0;\n";
   for (int i = 0; i < n; ++i) source << "sum" << (i + 1) << " = add(sum" << i << ", x" << i << ");\n";
@@ -726,7 +719,7 @@ test_function() {
 TEST(Build, PassingVar) {
   std::string_view source = R"(
 test_function(argv) {
-a = argv[2];
+a = argv[1];
 b = a;
 c = b;
 d = c;
@@ -780,22 +773,199 @@ return yp_v;
   // as 63bit addition is x+y-1
 }
 
+TEST(Build, ConditionCodes) {
+  std::string_view source = R"(
+test_function(argv) {
+a_v = argv[1];
+b_v = argv[2];
+two : trivial = 2;
+three : trivial = 3;
+cmp(two,three);
+x = if (jb) then {
+  return two;
+} else {
+  cmp(three,a_v);
+  y = if (jb) then {
+    r_1 : trivial = setle(b_v,a_v);
+    return r_1;
+  } else {
+    r_2 : trivial = seta(a_v,b_v);
+    return r_2;
+  };
+  return y;
+};
+return x;
+}
+)";
+  auto test_with = [&](uint64_t a, uint64_t b, uint64_t expected) {
+    build_object::tuple args;
+    args.emplace_back(a);
+    args.emplace_back(b);
+    test_ir_build(source, build_object::value(std::move(args)), {.expected_return = expected});
+  };
+  test_with(1, 0, 1);
+  test_with(1, 5, 0);
+  test_with(7, 5, 1);
+  test_with(7, 9, 0);
+}
+
+TEST(Build, LiveAcrossCalls) {
+  std::string_view source = R"(
+twice(x : trivial) {
+  y : trivial = add(x,x);
+  return y;
+}
+test_function(argv) {
+  a_v = argv[1];
+  b_v = argv[2];
+  c_v = argv[3];
+  a : trivial = v_to_int(a_v);
+  b : trivial = v_to_int(b_v);
+  c : trivial = v_to_int(c_v);
+  x : trivial = call_direct twice(a);
+  y : trivial = call_direct twice(b);
+  z : trivial = call_direct twice(c);
+  s_1 : trivial = add(x,y);
+  s_2 : trivial = add(s_1,z);
+  s_3 : trivial = add(s_2,a);
+  s_4 : trivial = add(s_3,b);
+  s_5 : trivial = add(s_4,c);
+  s_v : trivial = int_to_v(s_5);
+  return s_v;
+}
+)";
+  build_object::tuple args;
+  for (uint64_t x : {1, 2, 3})args.emplace_back(x);
+  test_ir_build(source, build_object::value(std::move(args)), {.expected_return = uint64_t{2 + 4 + 6 + 1 + 2 + 3}});
+  // a, b, c and the partial results fit in the callee-saved registers, so none of them has to be spilled
+  parse::tokenizer tk(source);
+  function twice, f;
+  twice.parse(tk);
+  f.parse(tk);
+  f.setup_destruction();
+  std::stringstream oasm;
+  auto stats = f.compile(oasm);
+  EXPECT_EQ(stats.spills, 0);
+}
+
+TEST(Build, LoopSavesWhatLivesAcrossCalls) {
+  std::string_view source = R"(
+twice(x : trivial) {
+  y : trivial = add(x,x);
+  return y;
+}
+sum_twice(n : trivial, acc : trivial) {
+  zero : trivial = 0;
+  cmp (n, zero);
+  r : trivial = if (jle) then {
+    one : trivial = 1;
+    d : trivial = call_direct twice(n);
+    m : trivial = sub(n,one);
+    a : trivial = add(acc,d);
+    s : trivial = call_direct sum_twice(m,a);
+    return s;
+  } else {
+    return acc;
+  };
+  return r;
+}
+sum(n : trivial, acc : trivial) {
+  zero : trivial = 0;
+  cmp (n, zero);
+  r : trivial = if (jle) then {
+    one : trivial = 1;
+    m : trivial = sub(n,one);
+    a : trivial = add(acc,n);
+    s : trivial = call_direct sum(m,a);
+    return s;
+  } else {
+    return acc;
+  };
+  return r;
+}
+test_function(argv) {
+  n_v = argv[1];
+  n : trivial = v_to_int(n_v);
+  zero : trivial = 0;
+  x : trivial = call_direct sum_twice(n,zero);
+  y : trivial = call_direct sum(n,x);
+  y_v : trivial = int_to_v(y);
+  return y_v;
+}
+)";
+  build_object::tuple args;
+  args.emplace_back(uint64_t{10});
+  test_ir_build(source, build_object::value(std::move(args)), {.expected_return = uint64_t{110 + 55}});
+  // n and acc live across the call to twice, so the loop head keeps two saves on the stack, and the other loop none
+  parse::tokenizer tk(source);
+  function twice, sum_twice, sum;
+  twice.parse(tk);
+  sum_twice.parse(tk);
+  sum.parse(tk);
+  sum_twice.setup_destruction();
+  sum.setup_destruction();
+  auto pushes = [](const std::string &s) {
+    size_t n = 0;
+    for (size_t p = s.find("push "); p != std::string::npos; p = s.find("push ", p + 1))++n;
+    return n;
+  };
+  std::stringstream with_calls, without_calls;
+  sum_twice.compile(with_calls);
+  EXPECT_THAT(with_calls.str(), testing::HasSubstr("sum_twice.loop:"));
+  EXPECT_EQ(pushes(with_calls.str()), 2);
+  EXPECT_EQ(sum.compile(without_calls).stack_slots, 0);
+  EXPECT_EQ(pushes(without_calls.str()), 0);
+}
+
+TEST(Build, SwappedArgsTailCall) {
+  std::string_view source = R"(
+diff(x : trivial, y : trivial) {
+  d : trivial = sub(x,y);
+  return d;
+}
+swapped(x : trivial, y : trivial) {
+  d : trivial = call_direct diff(y,x);
+  return d;
+}
+test_function(argv) {
+  a_v = argv[1];
+  b_v = argv[2];
+  a : trivial = v_to_int(a_v);
+  b : trivial = v_to_int(b_v);
+  d : trivial = call_direct swapped(a,b);
+  d_v : trivial = int_to_v(d);
+  return d_v;
+}
+)";
+  build_object::tuple args;
+  for (uint64_t x : {2, 9})args.emplace_back(x);
+  test_ir_build(source, build_object::value(std::move(args)), {.expected_return = uint64_t{7}});
+  // the cycle between rdi and rsi is a single xchg, without going through the stack
+  parse::tokenizer tk(source);
+  function diff, swapped;
+  diff.parse(tk);
+  swapped.parse(tk);
+  swapped.setup_destruction();
+  std::stringstream oasm;
+  swapped.compile(oasm);
+  EXPECT_THAT(oasm.str(), testing::HasSubstr("xchg"));
+  EXPECT_THAT(oasm.str(), testing::Not(testing::HasSubstr("rsp")));
+}
+
 using build_object::fun;
 TEST(Memory, MakeTuple) {
   std::string_view source = R"(
 make_tuple(num) {
-block = malloc(5);
-zero = 0;
-block[0] := zero;
-tag_size_d = 6;
-block[1] := tag_size_d;
-block[2] := num;
+block = malloc(4);
+header = 25769803776;
+block[0] := header;
+block[1] := num;
 m1729 = 1729;
 m1729_v = int_to_v(m1729);
-block[3] := m1729_v;
+block[2] := m1729_v;
 m42 = 42;
 m42_v = int_to_v(m42);
-block[4] := m42_v;
+block[3] := m42_v;
 return block;
 }
 )";
@@ -809,9 +979,9 @@ TEST(Memory, CallApplyFn) {
   // apply2 : ('a -> 'b -> 'c) -> 'a -> 'b -> 'c = <fun>
   std::string_view source = R"(
 apply2(args) {
-f = args[2];
-x1 = args[3];
-x2 = args[4];
+f = args[3];
+x1 = args[4];
+x2 = args[5];
 y1 = apply_fn(f,x1);
 y2 = apply_fn(y1,x2);
 return y2;
@@ -826,16 +996,16 @@ TEST(Recursive, ListLength) {
   using build_object::tvar;
   std::string_view source = R"(
 length(args) {
-  x = args[4];
+  x = args[3];
   one = 1;
 
   one_v = int_to_v(one);
 
   test(x,one);
   ans_v = if (jne) then {
-    this_f = args[2];
-    cnt = x[2];
-    tl = cnt[3];
+    this_f = args[1];
+    cnt = x[1];
+    tl = cnt[2];
     tl_len_v = apply_fn(this_f,tl);
     tl_len = v_to_int(tl_len_v);
     all_len = add(tl_len,one);
@@ -863,19 +1033,18 @@ TEST(Recursive, ListLength_tailrecursive) {
   std::string_view source = R"(
 
 
-length_tl(acc_args) {
-  acc = acc_args[4];
-  args = acc_args[2];
-  x = args[4];
+length_tl(args) {
+  x = args[3];
+  acc = args[4];
   one = 1;
 
   one_v = int_to_v(one);
 
   test(x,one);
   ans_v = if (jne) then {
-    this_f = args[2];
-    cnt = x[2];
-    tl = cnt[3];
+    this_f = args[1];
+    cnt = x[1];
+    tl = cnt[2];
     two = 2;
     acc_p1 = add(acc,two);
     f_tl = apply_fn(this_f,tl);
@@ -889,7 +1058,7 @@ length_tl(acc_args) {
 }
 
 length(args) {
-  list = args[4];
+  list = args[3];
   zero_v = 1;
   fun = __fun_block_length_tl__;
   fl = apply_fn(fun, list);
@@ -915,19 +1084,18 @@ TEST(Recursive, ListLength_tailrecursive_annotated) {
   std::string_view source = R"(
 
 
-length_tl(acc_args : non_trivial) {
-  acc : unboxed = acc_args[4];
-  args : non_trivial = acc_args[2];
-  x : non_global = args[4];
+length_tl(args : non_trivial) {
+  x : non_global = args[3];
+  acc : unboxed = args[4];
   one : trivial = 1;
 
   one_v : trivial = int_to_v(one);
 
   test(x,one);
   ans_v : unboxed = if (jne) then {
-    this_f : global = args[2];
-    cnt : non_trivial = x[2];
-    tl : non_global = cnt[3];
+    this_f : global = args[1];
+    cnt : non_trivial = x[1];
+    tl : non_global = cnt[2];
     two : trivial = 2;
     acc_p1 : unboxed = add(acc,two);
     f_tl : non_trivial = apply_fn(this_f,tl);
@@ -941,7 +1109,7 @@ length_tl(acc_args : non_trivial) {
 }
 
 length(args : non_trivial) {
-  list = args[4];
+  list = args[3];
   zero_v = 1;
   fun = __fun_block_length_tl__;
   fl = apply_fn(fun, list);
@@ -1059,23 +1227,21 @@ test_function (x : trivial) {
 TEST(Memory, DestroyCallDestructor) {
   static constexpr std::string_view source = R"(
 print_box (args : non_trivial) {
-  boxed_int : boxed = args[4];
+  boxed_int : boxed = args[3];
   pint = __fun_block__mllib_fn__int_println__;
-  x : trivial = boxed_int[2];
+  x : trivial = boxed_int[1];
   unit : trivial = apply_fn(pint,x);
   return unit;
 }
 
 make_epitaffable_box(args : non_trivial) {
-  x : trivial = args[4];
-  tuple : non_trivial = malloc(4);
-  c3 = 3;
-  c2 = 2;
+  x : trivial = args[3];
+  tuple : non_trivial = malloc(3);
+  header = 12884901891;
   pb = __fun_block_print_box__;
-  tuple[0] := c3;
-  tuple[1] := c3;
-  tuple[2] := x;
-  tuple[3] := pb;
+  tuple[0] := header;
+  tuple[1] := x;
+  tuple[1] := pb;
   return tuple;
 }
 
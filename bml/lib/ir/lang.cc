@@ -154,6 +154,7 @@ std::string_view tokenizer::get_source() const {
 std::unordered_map<uint64_t, std::string> var::maybe_names;
 std::unordered_map<std::string_view, size_t> var::name_size;
 std::vector<destroy_class_t> var::destroy_classes;
+std::unordered_map<uint64_t, std::string> var::destructors;
 
 rhs_expr::memory_access var::operator*() const {
   return rhs_expr::memory_access{.base = *this, .block_offset = 0};
@@ -224,8 +225,50 @@ void scope::print(std::ostream &os, size_t offset) const {
                 ma.base.print(os);
                 if (ma.block_offset) os << "[" << ma.block_offset << "]";
               },
-              [&](const rhs_expr::malloc &m) { os << "malloc(" << m.size << ")"; },
+              [&](const rhs_expr::malloc &m) {
+                os << "malloc(" << m.size;
+                if (m.reuse)os << ", " << *m.reuse;
+                if (m.in_frame)os << ", frame";
+                if (m.in_regs)os << ", regs";
+                if (!m.carved.empty()) {
+                  os << ", carved";
+                  for (size_t c : m.carved)os << " " << c;
+                }
+                if (m.carved_from)os << ", carved_from " << *m.carved_from << " " << m.carved_at;
+                if (m.site)os << ", site " << m.site;
+                os << ")";
+              },
               [&](const rhs_expr::apply_fn &f) { os << "apply_fn(" << f.f << ", " << f.x << ")"; },
+              [&](const rhs_expr::call_direct &f) {
+                os << "call_direct " << f.name << "(";
+                bool comma = false;
+                for (const var x : f.args) {
+                  if (comma)os << ", ";
+                  comma = true;
+                  os << x;
+                }
+                os << ")";
+                if (!f.results.empty()) {
+                  os << " -> (";
+                  comma = false;
+                  for (const var x : f.results) {
+                    if (comma)os << ", ";
+                    comma = true;
+                    os << x;
+                  }
+                  os << ")";
+                }
+              },
+              [&](const rhs_expr::loop_back &l) {
+                os << "loop_back " << l.head << "(";
+                bool comma = false;
+                for (const var x : l.args) {
+                  if (comma)os << ", ";
+                  comma = true;
+                  os << x;
+                }
+                os << ")";
+              },
               [&](const rhs_expr::branch &b) {
                 os << "if (" <<
                    b->ops_to_string() << "){\n";
@@ -236,6 +279,23 @@ void scope::print(std::ostream &os, size_t offset) const {
                 for (int i = offset; i--;)os << "  ";
                 os << "}";
               },
+              [&](const rhs_expr::switch_branch &sw) {
+                os << "switch (" << sw->v << "){\n";
+                for (const auto &[key, c] : sw->cases) {
+                  for (int i = offset + 1; i--;)os << "  ";
+                  os << key << ": {\n";
+                  c.print(os, offset + 2);
+                  for (int i = offset + 1; i--;)os << "  ";
+                  os << "}\n";
+                }
+                for (int i = offset + 1; i--;)os << "  ";
+                os << "else {\n";
+                sw->otherwise.print(os, offset + 2);
+                for (int i = offset + 1; i--;)os << "  ";
+                os << "}\n";
+                for (int i = offset; i--;)os << "  ";
+                os << "}";
+              },
               [&](const rhs_expr::unary_op &u) { os << rhs_expr::unary_op::ops_to_string(u.op) << "(" << u.x << ")"; },
               [&](const rhs_expr::binary_op &b) {
                 os << rhs_expr::binary_op::ops_to_string(b.op) << "(" << b.x1 << "," << b.x2 << ")";
@@ -322,8 +382,43 @@ void scope::parse(parse::tokenizer &tk, std::unordered_map<std::string_view, var
             assert(
                 std::from_chars(tk.peek_sv().data(), tk.peek_sv().data() + tk.peek_sv().size(), val).ec == std::errc());
             tk.pop();
+            rhs_expr::malloc m{.size = val};
+            while (tk.peek() == COMMA) {
+              tk.pop();
+              tk.expect_peek(IDENTIFIER);
+              const std::string_view option = tk.peek_sv(); // a view of the source
+              tk.pop();
+              if (option == "frame")m.in_frame = true;
+              else if (option == "regs")m.in_regs = true;
+              else if (option == "carved") {
+                while (tk.peek() == CONSTANT) {
+                  size_t c;
+                  assert(std::from_chars(tk.peek_sv().data(), tk.peek_sv().data() + tk.peek_sv().size(), c).ec
+                             == std::errc());
+                  m.carved.push_back(c);
+                  tk.pop();
+                }
+              } else if (option == "carved_from") {
+                tk.expect_peek(IDENTIFIER);
+                assert(names.contains(tk.peek_sv()));
+                m.carved_from = names.at(tk.peek_sv());
+                tk.pop();
+                tk.expect_peek(CONSTANT);
+                assert(std::from_chars(tk.peek_sv().data(), tk.peek_sv().data() + tk.peek_sv().size(), m.carved_at).ec
+                           == std::errc());
+                tk.pop();
+              } else if (option == "site") {
+                tk.expect_peek(CONSTANT);
+                assert(std::from_chars(tk.peek_sv().data(), tk.peek_sv().data() + tk.peek_sv().size(), m.site).ec
+                           == std::errc());
+                tk.pop();
+              } else {
+                assert(names.contains(option));
+                m.reuse = names.at(option);
+              }
+            }
             tk.expect_pop(PARENS_CLOSE);
-            push_back(instruction::assign{.dst = v, .src=rhs_expr::malloc{.size = val}});
+            push_back(instruction::assign{.dst = v, .src=m});
           } else if (a == "apply_fn") {
             //apply_fn
             tk.expect_pop(PARENS_OPEN);
@@ -338,6 +433,71 @@ void scope::parse(parse::tokenizer &tk, std::unordered_map<std::string_view, var
             tk.expect_pop(IDENTIFIER);
             tk.expect_pop(PARENS_CLOSE);
             push_back(instruction::assign{.dst = v, .src=rhs_expr::apply_fn{.f = vf, .x = vx}});
+          } else if (a == "call_direct") {
+            //call_direct
+            tk.expect_peek(IDENTIFIER);
+            rhs_expr::call_direct cd{.name = std::string(tk.pop().sv)};
+            tk.expect_pop(PARENS_OPEN);
+            while (tk.peek() != PARENS_CLOSE) {
+              tk.expect_peek(IDENTIFIER);
+              assert(names.contains(tk.peek_sv()));
+              cd.args.push_back(names.at(tk.pop().sv));
+              if (tk.peek() == COMMA)tk.pop();
+            }
+            tk.expect_pop(PARENS_CLOSE);
+            if (tk.peek() == ARROW) {
+              tk.pop();
+              tk.expect_pop(PARENS_OPEN);
+              while (tk.peek() != PARENS_CLOSE) {
+                tk.expect_peek(IDENTIFIER);
+                assert(!names.contains(tk.peek_sv()));
+                var r(tk.peek_sv());
+                names.try_emplace(tk.peek_sv(), r);
+                inserted_names.push_back(tk.pop().sv);
+                cd.results.push_back(r);
+                if (tk.peek() == COMMA)tk.pop();
+              }
+              tk.expect_pop(PARENS_CLOSE);
+            }
+            push_back(instruction::assign{.dst = v, .src=std::move(cd)});
+          } else if (a == "loop_back") {
+            //loop_back
+            tk.expect_peek(IDENTIFIER);
+            rhs_expr::loop_back lb{.head = std::string(tk.pop().sv)};
+            tk.expect_pop(PARENS_OPEN);
+            while (tk.peek() != PARENS_CLOSE) {
+              tk.expect_peek(IDENTIFIER);
+              assert(names.contains(tk.peek_sv()));
+              lb.args.push_back(names.at(tk.pop().sv));
+              if (tk.peek() == COMMA)tk.pop();
+            }
+            tk.expect_pop(PARENS_CLOSE);
+            push_back(instruction::assign{.dst = v, .src=std::move(lb)});
+          } else if (a == "switch") {
+            //switch
+            tk.expect_pop(PARENS_OPEN);
+            tk.expect_peek(IDENTIFIER);
+            assert(names.contains(tk.peek_sv()));
+            rhs_expr::switch_branch sw = std::make_unique<switch_table>();
+            sw->v = names.at(tk.pop().sv);
+            tk.expect_pop(PARENS_CLOSE);
+            tk.expect_pop(CURLY_OPEN);
+            while (tk.peek() == CONSTANT) {
+              uint64_t key;
+              assert(std::from_chars(tk.peek_sv().data(), tk.peek_sv().data() + tk.peek_sv().size(), key).ec
+                         == std::errc());
+              tk.pop();
+              tk.expect_pop(COLON);
+              tk.expect_pop(CURLY_OPEN);
+              sw->cases.emplace_back(key, scope()).second.parse(tk, names);
+              tk.expect_pop(CURLY_CLOSE);
+            }
+            tk.expect_pop(ELSE);
+            tk.expect_pop(CURLY_OPEN);
+            sw->otherwise.parse(tk, names);
+            tk.expect_pop(CURLY_CLOSE);
+            tk.expect_pop(CURLY_CLOSE);
+            push_back(instruction::assign{.dst = v, .src=std::move(sw)});
           } else if (tk.peek() == PARENS_OPEN) {
             //operation
             tk.expect_pop(PARENS_OPEN);
@@ -529,4 +689,21 @@ ir::lang::var scope::declare_assign(rhs_expr::t &&rhs) {
   return v;
 }
 
+std::vector<scope *> switch_table::branches() {
+  std::vector<scope *> bs;
+  for (auto &c : cases)bs.push_back(&c.second);
+  bs.push_back(&otherwise);
+  return bs;
+}
+scope &switch_table::taken(uint64_t key) {
+  for (auto &c : cases)if (c.first == key)return c.second;
+  return otherwise;
+}
+std::vector<const scope *> switch_table::branches() const {
+  std::vector<const scope *> bs;
+  for (const auto &c : cases)bs.push_back(&c.second);
+  bs.push_back(&otherwise);
+  return bs;
+}
+
 }
@@ -9,6 +9,8 @@
 #include <string>
 #include <optional>
 #include <memory>
+#include <compare>
+#include <numeric>
 #include <util/message.h>
 
 namespace ir::lang {
@@ -17,6 +19,7 @@ class tokenizer;
 }
 struct var;
 struct ternary;
+struct switch_table;
 namespace instruction {
 namespace rhs_expr {
 struct constant;
@@ -25,10 +28,13 @@ struct copy;
 struct memory_access;
 struct malloc;
 struct apply_fn;
+struct call_direct;
+struct loop_back;
 typedef std::unique_ptr<ternary> branch;
+typedef std::unique_ptr<switch_table> switch_branch;
 struct unary_op;
 struct binary_op;
-typedef std::variant<constant, global, copy, memory_access, malloc, apply_fn, branch, unary_op, binary_op> t;
+typedef std::variant<constant, global, copy, memory_access, malloc, apply_fn, call_direct, loop_back, branch, switch_branch, unary_op, binary_op> t;
 }
 struct assign;
 struct write_uninitialized_mem;
@@ -105,6 +111,16 @@ struct var {
     destroy_class() = d;
     return *this;
   }
+  // called instead of destroy_nontrivial_preserving once the refcount drops to 0, e.g. one for the type of the var
+  static std::unordered_map<uint64_t, std::string> destructors;
+  [[nodiscard]] std::string_view destructor() const {
+    auto it = destructors.find(id);
+    return it == destructors.end() ? std::string_view("destroy_nontrivial_preserving") : std::string_view(it->second);
+  }
+  var &mark_destructor(std::string_view d) {
+    if (!d.empty())destructors.insert_or_assign(id, std::string(d));
+    return *this;
+  }
 };
 std::ostream &operator<<(std::ostream &os, const var &v);
 namespace instruction {
@@ -120,20 +136,56 @@ struct memory_access { //TODO: mark destruction_class
   var base;
   size_t block_offset;
 };
-struct malloc { size_t size; }; //TODO: mark destruction class
+// reuse: a dead block to overwrite, if unique at runtime; in_frame: the block never escapes, it's put in the stack;
+// in_regs: the block is only returned, as its fields, and never allocated, see unbox_tuple_returns;
+// carved: the sizes of the blocks allocated right after this one, at once, each at the sum of the sizes before it;
+// carved_from: nothing is allocated, the block is one of those, carved_at words past the one of carved_from;
+// site: the allocation site the block is counted in by the profiling mode (see ir::alloc_sites), 0 for none
+struct malloc {
+  size_t size;
+  std::optional<var> reuse = {};
+  bool in_frame = false;
+  bool in_regs = false;
+  std::vector<size_t> carved = {};
+  std::optional<var> carved_from = {};
+  size_t carved_at = 0;
+  size_t site = 0;
+  [[nodiscard]] size_t words() const { return std::accumulate(carved.begin(), carved.end(), size); }
+};
 struct apply_fn { var f, x; }; //TODO: mark destruction class (might be maybe_non_trivial)
+struct call_direct { // saturated call, args passed in reg::args_order
+  std::string name;
+  std::vector<var> args;
+  std::vector<bool> borrowed = {}; // args the callee doesn't take the ownership of, see infer_borrowed_args
+  std::vector<var> results = {}; // the fields of a block the callee returns unboxed, in reg::returns_order; dst is unused
+};
+struct loop_back { std::string head; std::vector<var> args; }; // self tail call: rebinds the args of function head, jumps back to its loop head
 struct binary_op { //Assert inputs are trivial; result should be trivial
-  enum ops { add, sub, sal, sar, mul, div, imul, idiv };
+  // set* compare the two words and produce the tagged bool of the condition, like the x86 setcc they compile to
+  // shr is the logical shift, imulh the high word of the signed 128-bit product
+  enum ops { add, sub, sal, sar, shr, mul, div, imul, imulh, idiv, sete, setne, setl, setle, setg, setge, setb, setbe, seta, setae };
   static std::string_view ops_to_string(ops op) {
     switch (op) {
       case add:return "add";
       case sub:return "sub";
       case sal:return "sal";
       case sar:return "sar";
+      case shr:return "shr";
       case mul:return "mul";
       case div:return "div";
       case imul:return "imul";
+      case imulh:return "imulh";
       case idiv:return "idiv";
+      case sete:return "sete";
+      case setne:return "setne";
+      case setl:return "setl";
+      case setle:return "setle";
+      case setg:return "setg";
+      case setge:return "setge";
+      case setb:return "setb";
+      case setbe:return "setbe";
+      case seta:return "seta";
+      case setae:return "setae";
       default:THROW_UNIMPLEMENTED;
     }
   }
@@ -142,35 +194,87 @@ struct binary_op { //Assert inputs are trivial; result should be trivial
     if (s == "sub")return sub;
     if (s == "sal")return sal;
     if (s == "sar")return sar;
+    if (s == "shr")return shr;
     if (s == "mul")return mul;
     if (s == "div")return div;
     if (s == "imul")return imul;
+    if (s == "imulh")return imulh;
     if (s == "idiv")return idiv;
+    if (s == "sete")return sete;
+    if (s == "setne")return setne;
+    if (s == "setl")return setl;
+    if (s == "setle")return setle;
+    if (s == "setg")return setg;
+    if (s == "setge")return setge;
+    if (s == "setb")return setb;
+    if (s == "setbe")return setbe;
+    if (s == "seta")return seta;
+    if (s == "setae")return setae;
     THROW_UNIMPLEMENTED
   }
   static bool is_commutative(ops op) {
     switch (op) {
       case mul:
       case imul:
+      case imulh:
+      case sete:
+      case setne:
       case add:return true;
       case sal:
       case sar:
+      case shr:
       case sub:
       case div:
-      case idiv:return false;
+      case idiv:
+      case setl:
+      case setle:
+      case setg:
+      case setge:
+      case setb:
+      case setbe:
+      case seta:
+      case setae:return false;
       default:THROW_UNIMPLEMENTED;
     }
   }
+  static bool is_comparison(ops op) { return op >= sete; }
+  // the comparison to use when the operands are swapped
+  static ops mirror(ops op) {
+    switch (op) {
+      case setl:return setg;
+      case setle:return setge;
+      case setg:return setl;
+      case setge:return setle;
+      case setb:return seta;
+      case setbe:return setae;
+      case seta:return setb;
+      case setae:return setbe;
+      default:return op;
+    }
+  }
   uint64_t of_constant(uint64_t a, uint64_t b) {
+    auto as_bool = [](bool x) -> uint64_t { return x ? 3 : 1; };
     switch (op) {
       case mul: return a * b;
       case imul: return int64_t(a) * int64_t(b);
       case add: return a + b;
       case sal: return int64_t(a) << b;
       case sar:return int64_t(a) >> b;
+      case shr:return a >> b;
+      case imulh:return uint64_t((__int128(int64_t(a)) * __int128(int64_t(b))) >> 64);
       case sub:return a - b;
       case div:return a / b;
       case idiv:return int64_t(a) / int64_t(b);
+      case sete:return as_bool(a == b);
+      case setne:return as_bool(a != b);
+      case setl:return as_bool(int64_t(a) < int64_t(b));
+      case setle:return as_bool(int64_t(a) <= int64_t(b));
+      case setg:return as_bool(int64_t(a) > int64_t(b));
+      case setge:return as_bool(int64_t(a) >= int64_t(b));
+      case setb:return as_bool(a < b);
+      case setbe:return as_bool(a <= b);
+      case seta:return as_bool(a > b);
+      case setae:return as_bool(a >= b);
       default:THROW_UNIMPLEMENTED;
     }
   }
@@ -294,6 +398,12 @@ struct scope {
   std::ostream &comment() { return comments.emplace_back(body.size(), std::stringstream{}).second; }
 };
 
+// what the register allocation of a function cost, reported by function::compile
+struct allocation_stats {
+  size_t spills = 0; // times the value of a variable was moved from a register to the stack
+  size_t stack_slots = 0; // the most words of stack used at once, for spills and saved registers
+};
+
 struct function : public scope {
   std::vector<var> args;
   std::string name;
@@ -301,12 +411,21 @@ struct function : public scope {
   void setup_destruction();
   void parse(parse::tokenizer &);
   void print(std::ostream &os, size_t offset = 0) const;
-  void compile(std::ostream &os);
+  // profile: count the refcount operations for the profiling mode, see ir::alloc_sites
+  allocation_stats compile(std::ostream &os, bool profile = false);
   void pre_compile();
+  bool self_tail_calls_to_loops();
+  bool reuse_dead_blocks();
+  bool allocate_blocks_in_frame();
+  bool sink_loads();
 };
+void infer_borrowed_args(std::vector<function> &fs);
+void unbox_tuple_returns(std::vector<function> &fs);
 
 struct ternary {
-  enum jmp_instr { jmp, jne, jle, jz, jnz }; //TODO: add others
+  // x86 conditional jumps: the signed ones (jl, jle, jg, jge) and the unsigned ones (jb, jbe, ja, jae) read the flags of
+  // the cmp_vars right before the branch, jz/je and jnz/jne are synonyms
+  enum jmp_instr { jmp, jne, jle, jz, jnz, je, jl, jg, jge, jb, jbe, ja, jae };
   jmp_instr cond;
   scope nojmp_branch, jmp_branch;
   static jmp_instr parse_jinstr(std::string_view s) {
@@ -315,6 +434,14 @@ struct ternary {
     if (s == "jle")return jle;
     if (s == "jz")return jz;
     if (s == "jnz")return jnz;
+    if (s == "je")return je;
+    if (s == "jl")return jl;
+    if (s == "jg")return jg;
+    if (s == "jge")return jge;
+    if (s == "jb")return jb;
+    if (s == "jbe")return jbe;
+    if (s == "ja")return ja;
+    if (s == "jae")return jae;
     THROW_INTERNAL_ERROR
   }
   std::string_view ops_to_string() {
@@ -326,10 +453,79 @@ struct ternary {
       case jle:return "jle";
       case jz:return "jz";
       case jnz:return "jnz";
+      case je:return "je";
+      case jl:return "jl";
+      case jg:return "jg";
+      case jge:return "jge";
+      case jb:return "jb";
+      case jbe:return "jbe";
+      case ja:return "ja";
+      case jae:return "jae";
+      default:THROW_UNIMPLEMENTED
+    }
+  }
+  // the jump taken exactly when j is not
+  static jmp_instr negate(jmp_instr j) {
+    switch (j) {
+      case jne:return je;
+      case jz:
+      case je:return jne;
+      case jnz:return jz;
+      case jl:return jge;
+      case jle:return jg;
+      case jg:return jle;
+      case jge:return jl;
+      case jb:return jae;
+      case jbe:return ja;
+      case ja:return jbe;
+      case jae:return jb;
+      default:THROW_INTERNAL_ERROR // jmp has no negation
+    }
+  }
+  // the jump to use when the operands of the cmp are swapped
+  static jmp_instr mirror(jmp_instr j) {
+    switch (j) {
+      case jl:return jg;
+      case jle:return jge;
+      case jg:return jl;
+      case jge:return jle;
+      case jb:return ja;
+      case jbe:return jae;
+      case ja:return jb;
+      case jae:return jbe;
+      default:return j;
+    }
+  }
+  // whether j jumps, given how the compared words are ordered as signed and as unsigned integers
+  static bool taken(jmp_instr j, std::strong_ordering as_signed, std::strong_ordering as_unsigned) {
+    switch (j) {
+      case jmp:return true;
+      case jz:
+      case je:return as_signed == 0;
+      case jnz:
+      case jne:return as_signed != 0;
+      case jl:return as_signed < 0;
+      case jle:return as_signed <= 0;
+      case jg:return as_signed > 0;
+      case jge:return as_signed >= 0;
+      case jb:return as_unsigned < 0;
+      case jbe:return as_unsigned <= 0;
+      case ja:return as_unsigned > 0;
+      case jae:return as_unsigned >= 0;
       default:THROW_UNIMPLEMENTED
     }
   }
 };
+// multiway branch on an immediate (a tag, a constant constructor or a literal): takes the case whose key is v, if any.
+// Compiled to a jump table when the keys are dense enough, to a chain of compares otherwise.
+struct switch_table {
+  var v;
+  std::vector<std::pair<uint64_t, scope>> cases; // sorted by key
+  scope otherwise;
+  std::vector<scope *> branches();
+  std::vector<const scope *> branches() const;
+  scope &taken(uint64_t key); // the branch selected when v is key
+};
 
 namespace parse {
 enum token_type {
@@ -351,6 +547,7 @@ enum token_type {
   ASSIGN,
   COMMA,
   COLON,
+  ARROW,
   END_OF_INPUT
 };
 
@@ -417,7 +614,7 @@ constexpr auto tokens_map = util::make_array(
     st{":", COLON},
     st{"if", IF}, st{"then", THEN},
     st{"else", ELSE}, st{"return", RETURN},
-    st{"*", STAR}, st{",", COMMA});
+    st{"*", STAR}, st{",", COMMA}, st{"->", ARROW});
 
 struct token {
 
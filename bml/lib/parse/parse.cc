@@ -286,11 +286,13 @@ std::string_view make_binary_op(token t) {
     case PLUS:return "__binary_op__PLUS__";
     case MINUS:return "__binary_op__MINUS__";
     case EQUAL:return "__binary_op__EQUAL__";
+    case NOT_EQUAL:return "__binary_op__NOT_EQUAL__";
     case LESS_THAN:return "__binary_op__LESS_THAN__";
     case LESS_EQUAL_THAN:return "__binary_op__LESS_EQUAL_THAN__";
     case GREATER_THAN:return "__binary_op__GREATER_THAN__";
     case GREATER_EQUAL_THAN:return "__binary_op__GREATER_EQUAL_THAN__";
     case PHYS_EQUAL:return "__binary_op__PHYS_EQUAL__";
+    case NOT_PHYS_EQUAL:return "__binary_op__NOT_PHYS_EQUAL__";
     default: throw parse::error::report_token( "",t.sv, " is not a recognized infix binary operator");
   }
 }
@@ -607,7 +609,7 @@ ptr parse(tokenizer &tk) {
       tk.expect_pop(EQUAL);
       auto fun = std::make_unique<expression::fun>(std::move(args), expression::parse(tk));
 
-      fun->loc = itr_sv(m->loc.begin(), fun->body->loc.end());
+      fun->loc = itr_sv(loc_start, fun->body->loc.end()); // the universal matcher m has no loc
 
       defs->defs.emplace_back(std::move(m), std::move(fun));
     } else {
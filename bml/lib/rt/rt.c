@@ -10,27 +10,37 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <time.h>
+#include <sys/mman.h>
 
 #define Tag_Tuple  0
 #define Tag_Fun 1
 #define Tag_Arg 2
 #define Tag_String 3
-#define Make_Tag_Size_D(tag, size, d) ((((uint64_t) tag) << 32) | (((uint64_t) size) << 1) | (d & 1))
+// BLOCK HEADER
+// Every block starts with a single header word: the refcount in the low 32 bits ((n << 1) | 1 for n references, 0 for
+// static blocks), then the destructor bit d (bit 32), the size in words of the fields (bits 33-47) and the tag
+// (bits 48-63). The fields follow from word 1, then the destructor if d is set (DESTRUCTOR_RAN once it has run).
+// The dword at byte 4 is (size << 1) | d, the word at byte 6 is the tag. Must match ir::make_header in ir.h.
+#define HEADER_MAX_SIZE 0x7fff
 
-uint64_t make_tag_size_d(uint32_t tag, uint32_t size, uint8_t d) {
-  return (((uint64_t) tag) << 32) | (((uint64_t) size) << 1) | (d & 1);
+uint64_t make_header(uint32_t tag, uint32_t size, uint8_t d, uint32_t refcount) {
+  return (((uint64_t) tag) << 48) | (((uint64_t) size) << 33) | (((uint64_t) (d & 1)) << 32) | refcount;
 }
 
-uint32_t get_tag(uintptr_t tag_size_d) {
-  return tag_size_d >> 32;
+uint32_t get_tag(uintptr_t header) {
+  return header >> 48;
 }
 
-uint32_t get_size(uintptr_t tag_size_d) {
-  return ((uint32_t) tag_size_d) >> 1;
+uint32_t get_size(uintptr_t header) {
+  return (header >> 33) & HEADER_MAX_SIZE;
 }
 
-uint8_t get_d(uintptr_t tag_size_d) {
-  return tag_size_d & 1;
+uint8_t get_d(uintptr_t header) {
+  return (header >> 32) & 1;
+}
+
+uint32_t get_refcount(uintptr_t header) {
+  return (uint32_t) header;
 }
 
 uintptr_t uint_to_v(uint64_t x) {
@@ -49,6 +59,12 @@ uint64_t v_to_int(uintptr_t x) {
   return ((int64_t) x) >> 1;
 }
 
+// the words a block was allocated with: an Arg block has room for the args still to be supplied
+static size_t block_words(const uintptr_t *x) {
+  const uint32_t tag = get_tag(x[0]);
+  return 1 + get_size(x[0]) + get_d(x[0]) + (tag == Tag_Arg ? v_to_uint(x[2]) : 0);
+}
+
 #define debug_stream stderr
 #define MAX_DEPTH 5
 #define VISITED_MAX_SIZE 10000
@@ -75,7 +91,7 @@ void __json_debug(uintptr_t x, int depth) {
 
     {
       fprintf(debug_stream, "{ \"address\" : \"%p\" , \"refcount\" : ", v);
-      uintptr_t refcount = v[0];
+      uintptr_t refcount = get_refcount(v[0]);
       if (refcount & 1) {
         refcount >>= 1;
         fprintf(debug_stream, "%lu", refcount);
@@ -83,16 +99,16 @@ void __json_debug(uintptr_t x, int depth) {
         fputs(refcount ? "\"abstract\"" : "\"static\"", debug_stream);
       }
     }
-    uint32_t tag = get_tag(v[1]);
-    uint32_t size = get_size(v[1]);
-    uint8_t d = get_d(v[1]);
+    uint32_t tag = get_tag(v[0]);
+    uint32_t size = get_size(v[0]);
+    uint8_t d = get_d(v[0]);
     fprintf(debug_stream, ", \"tag\" : ");
     switch (tag) {
       case Tag_Fun: {
         fputs("\"Fun\"", debug_stream);
         assert(size >= 2);
-        fprintf(debug_stream, ", \"text_ptr\" : \"%p\", \"n_args\" : %lu ", (const uintptr_t *) v[2], v_to_uint(v[3]));
-        v += 4;
+        fprintf(debug_stream, ", \"text_ptr\" : \"%p\", \"n_args\" : %lu ", (const uintptr_t *) v[1], v_to_uint(v[2]));
+        v += 3;
         size -= 2;
         if (size) {
           fprintf(debug_stream, ", \"captures\" : [");
@@ -111,20 +127,22 @@ void __json_debug(uintptr_t x, int depth) {
         break;
       case Tag_Arg: {
         fputs("\"Arg\"", debug_stream);
-        assert(size == 3);
-        fprintf(debug_stream, ", \"n_args_left\" : %lu , \"x\" : ", v_to_uint(v[3]));
-        __json_debug(v[4], depth + 1);
-        fputs(", \"f\" : ", debug_stream);
-        __json_debug(v[2], depth + 1);
-        v += 5;
-        size -= 3;
-        assert(size == 0);
+        assert(size >= 3);
+        fprintf(debug_stream, ", \"n_args_left\" : %lu , \"xs\" : [", v_to_uint(v[2]));
+        for (uint32_t i = 3; i < size + 1; ++i) {
+          if (i > 3)fputs(", ", debug_stream);
+          __json_debug(v[i], depth + 1);
+        }
+        fputs("], \"f\" : ", debug_stream);
+        __json_debug(v[1], depth + 1);
+        v += size + 1;
+        size = 0;
       };
         break;
       case Tag_String: {
         fputs("\"String\"", debug_stream);
-        fprintf(debug_stream, ", \"content\" : \"%s\"  : ", (const char *) (v + 2));
-        v += size + 2;
+        fprintf(debug_stream, ", \"content\" : \"%s\"  : ", (const char *) (v + 1));
+        v += size + 1;
         size = 0;
         assert(size == 0);
       };
@@ -138,7 +156,7 @@ void __json_debug(uintptr_t x, int depth) {
         }
         fprintf(debug_stream, ", \"size\" : %u, \"content\" : [", size);
         int comma = 0;
-        v += 2;
+        v += 1;
         while (size > 0) {
           --size;
           if (comma)fputs(", ", debug_stream);
@@ -173,7 +191,7 @@ void print_debug(uintptr_t x) {
     uintptr_t *v = (uintptr_t *) x;
     {
       fputs("{rc:", debug_stream);
-      uintptr_t refcount = v[0];
+      uintptr_t refcount = get_refcount(v[0]);
       if (refcount & 1) {
         refcount >>= 1;
         fprintf(debug_stream, "%lu", refcount);
@@ -181,11 +199,11 @@ void print_debug(uintptr_t x) {
         fputs(refcount ? "abstr" : "static", debug_stream);
       }
     }
-    uint32_t tag = get_tag(v[1]);
-    uint32_t size = get_size(v[1]);
-    uint8_t d = get_d(v[1]);
+    uint32_t tag = get_tag(v[0]);
+    uint32_t size = get_size(v[0]);
+    uint8_t d = get_d(v[0]);
     fprintf(debug_stream, ", tag:%u, size:%u | ", tag, size);
-    v += 2;
+    v += 1;
     if (tag == Tag_Fun) {
       --size;
       v += 1;
@@ -206,40 +224,399 @@ void println_debug(uintptr_t x) {
   putc(10, debug_stream);
 }
 
+// ALLOCATOR
+// Blocks of up to FAST_MALLOC_MAX_WORDS words are served from per-size-class free lists, refilled by bump allocation
+// from large mmap'd chunks. The free list of each class is a singly linked list threaded through word 0 of the free
+// blocks. Generated code pops fast_malloc_free_list[words] inline and only calls fast_malloc when the list is empty.
+// A block may be released into any class not larger than its capacity: this is what happens to blocks allocated outside
+// the runtime (e.g. by libc malloc), and to the blocks the compiler carves out of a single allocation (a fused one),
+// each released into the class of its own size and counted in fast_malloc_carved. As the pieces of a fused allocation
+// would be given to free() one by one, FAST_MALLOC_USE_LIBC builds don't define fast_malloc_carved, which the fused
+// allocations count in: programs compiled with fusion don't link with them (compile with -fused-words 0, the default).
+// The destructors the compiler generates for variant types push the blocks they free inline too, and count them in
+// fast_malloc_freed.
+// Compiling with -DFAST_MALLOC_USE_LIBC routes everything through malloc/free, e.g. for memory debuggers.
+#define FAST_MALLOC_MAX_WORDS 16
+#define FAST_MALLOC_CHUNK_BYTES (1 << 20)
+
+uintptr_t *fast_malloc_free_list[FAST_MALLOC_MAX_WORDS + 1];
+
+uint64_t fast_malloc_freed[FAST_MALLOC_MAX_WORDS + 1];
+#ifndef FAST_MALLOC_USE_LIBC
+// blocks of each class made by carving a fused allocation, less the fused allocations taken from it
+int64_t fast_malloc_carved[FAST_MALLOC_MAX_WORDS + 1];
+#endif
+
+struct {
+  uint64_t bumped[FAST_MALLOC_MAX_WORDS + 1];
+  uint64_t large_allocated;
+  uint64_t large_freed;
+  uint64_t chunks;
+} fast_malloc_stats;
+
+#ifndef FAST_MALLOC_USE_LIBC
+static uintptr_t *fast_malloc_bump_ptr = NULL;
+static uintptr_t *fast_malloc_bump_end = NULL;
+
+static uintptr_t *fast_malloc_bump(size_t words) {
+  if (fast_malloc_bump_ptr + words > fast_malloc_bump_end) {
+    void *chunk = mmap(NULL, FAST_MALLOC_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+      perror("fast_malloc: mmap");
+      exit(1);
+    }
+    ++fast_malloc_stats.chunks;
+    fast_malloc_bump_ptr = (uintptr_t *) chunk;
+    fast_malloc_bump_end = fast_malloc_bump_ptr + FAST_MALLOC_CHUNK_BYTES / 8;
+  }
+  uintptr_t *b = fast_malloc_bump_ptr;
+  fast_malloc_bump_ptr += words;
+  ++fast_malloc_stats.bumped[words];
+  return b;
+}
+#endif
+
+// the lazy mode of destruction (see DESTRUCTION below) reclaims on allocation
+#define LAZY_FREE_DEFAULT_STEPS 64
+size_t lazy_free_budget = 0; // read by the generated destructors too, which leave the lazy mode to the runtime
+static void lazy_free_steps(size_t steps);
+
+uintptr_t *fast_malloc(size_t words) {
+  if (lazy_free_budget)lazy_free_steps(lazy_free_budget);
+#ifdef FAST_MALLOC_USE_LIBC
+  return (uintptr_t *) malloc(8 * words);
+#else
+  if (words > FAST_MALLOC_MAX_WORDS) {
+    ++fast_malloc_stats.large_allocated;
+    return (uintptr_t *) malloc(8 * words);
+  }
+  uintptr_t *b = fast_malloc_free_list[words];
+  if (b) {
+    fast_malloc_free_list[words] = (uintptr_t *) b[0];
+    return b;
+  }
+  return fast_malloc_bump(words);
+#endif
+}
+
+void fast_free(uintptr_t *b, size_t words) {
+#ifdef FAST_MALLOC_USE_LIBC
+  free(b);
+#else
+  if (words > FAST_MALLOC_MAX_WORDS) {
+    ++fast_malloc_stats.large_freed;
+    free(b);
+    return;
+  }
+  ++fast_malloc_freed[words];
+  b[0] = (uintptr_t) fast_malloc_free_list[words];
+  fast_malloc_free_list[words] = b;
+#endif
+}
+
+void fast_malloc_print_stats(FILE *f) {
+  uint64_t total_allocated = fast_malloc_stats.large_allocated, total_freed = fast_malloc_stats.large_freed;
+  fprintf(f, "fast_malloc: %lu chunks of %d bytes\n", fast_malloc_stats.chunks, FAST_MALLOC_CHUNK_BYTES);
+  fprintf(f, "%6s %12s %12s %12s %12s\n", "words", "allocated", "bumped", "freed", "live");
+  for (size_t w = 1; w <= FAST_MALLOC_MAX_WORDS; ++w) {
+    uint64_t on_list = 0;
+    for (const uintptr_t *b = fast_malloc_free_list[w]; b; b = (const uintptr_t *) b[0])++on_list;
+    // every free-list pop is an allocation: pops = pushes - what is still on the list
+    uint64_t allocated = fast_malloc_stats.bumped[w] + fast_malloc_freed[w] - on_list;
+#ifndef FAST_MALLOC_USE_LIBC
+    allocated += fast_malloc_carved[w];
+#endif
+    if (!allocated && !fast_malloc_freed[w])continue;
+    total_allocated += allocated;
+    total_freed += fast_malloc_freed[w];
+    fprintf(f, "%6zu %12lu %12lu %12lu %12ld\n", w, allocated, fast_malloc_stats.bumped[w],
+            fast_malloc_freed[w], (int64_t) (allocated - fast_malloc_freed[w]));
+  }
+  fprintf(f, "%6s %12lu %12s %12lu %12ld\n", "large", fast_malloc_stats.large_allocated, "-",
+          fast_malloc_stats.large_freed, (int64_t) (fast_malloc_stats.large_allocated - fast_malloc_stats.large_freed));
+  fprintf(f, "%6s %12lu %12s %12lu %12ld\n", "total", total_allocated, "-", total_freed,
+          (int64_t) (total_allocated - total_freed));
+}
+
+static void fast_malloc_print_stats_at_exit() {
+  fast_malloc_print_stats(stderr);
+}
+
+// PROFILING
+// A runtime built with -DALLOC_PROFILE, linked with a program compiled with -profile, counts the heap allocations of
+// each allocation site of the program (a constructor, tuple or closure expression), the blocks reused in place, the
+// frees and the refcount operations, and follows the live heap words to find their peak. The generated code increments
+// the counters of the sites (alloc_profile_sites, see ir::alloc_sites) and of its own refcount operations and live
+// words, the runtime those of what it does itself. A block reused in place counts for the tag it is rebuilt with in
+// "reused" and for the tag it had in "overwritten", so that for each tag allocated + reused = freed + overwritten once
+// nothing is live. The report is written at exit as JSON, to the file named by
+// BML_PROFILE in the environment, or to stderr. The specialised destructors are not generated for the profiling mode,
+// so every block is freed here, and blocks in the stack or static ones are not counted.
+#ifdef ALLOC_PROFILE
+#define ALLOC_PROFILE_TAGS (1 << 16) // the tag is the top 16 bits of the header
+typedef struct {
+  uint64_t allocated, reused, words, tag;
+  const char *location, *kind;
+} alloc_profile_site;
+// emitted by the compiler, null for a program compiled without -profile
+extern alloc_profile_site alloc_profile_sites[] __attribute__((weak));
+extern const uint64_t alloc_profile_n_sites __attribute__((weak));
+uint64_t alloc_profile_increments, alloc_profile_decrements;
+int64_t alloc_profile_live_words;
+int64_t alloc_profile_peak_words;
+static uint64_t alloc_profile_runtime_allocated[ALLOC_PROFILE_TAGS]; // by tag, the blocks of the runtime itself
+static uint64_t alloc_profile_freed[ALLOC_PROFILE_TAGS]; // by tag
+uint64_t alloc_profile_overwritten[ALLOC_PROFILE_TAGS]; // by tag, the blocks the generated code reused in place
+
+static void alloc_profile_words(int64_t words) {
+  alloc_profile_live_words += words;
+  if (alloc_profile_live_words > alloc_profile_peak_words)alloc_profile_peak_words = alloc_profile_live_words;
+}
+
+static void alloc_profile_runtime_allocation(uint32_t tag, size_t words) {
+  ++alloc_profile_runtime_allocated[tag];
+  alloc_profile_words((int64_t) words);
+}
+
+static void alloc_profile_free(const uintptr_t *x) {
+  ++alloc_profile_freed[get_tag(x[0])];
+  alloc_profile_words(-(int64_t) block_words(x));
+}
+
+static void alloc_profile_print_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\')fputc('\\', f);
+    fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static int alloc_profile_by_words_allocated(const void *a, const void *b) {
+  const alloc_profile_site *x = *(const alloc_profile_site *const *) a, *y = *(const alloc_profile_site *const *) b;
+  const uint64_t wx = x->allocated * x->words, wy = y->allocated * y->words;
+  return wx < wy ? 1 : wx > wy ? -1 : 0;
+}
+
+void alloc_profile_print(FILE *f) {
+  const uint64_t n_sites = &alloc_profile_n_sites ? alloc_profile_n_sites : 0;
+  uint64_t allocated[ALLOC_PROFILE_TAGS], reused[ALLOC_PROFILE_TAGS] = {0};
+  memcpy(allocated, alloc_profile_runtime_allocated, sizeof(allocated));
+  uint64_t total_allocated = 0, total_reused = 0, total_freed = 0;
+  const alloc_profile_site **sites = (const alloc_profile_site **) malloc(n_sites * sizeof(alloc_profile_site *));
+  for (uint64_t k = 0; k < n_sites; ++k) {
+    sites[k] = &alloc_profile_sites[k];
+    allocated[sites[k]->tag] += sites[k]->allocated;
+    reused[sites[k]->tag] += sites[k]->reused;
+    total_reused += sites[k]->reused;
+  }
+  for (size_t t = 0; t < ALLOC_PROFILE_TAGS; ++t)total_allocated += allocated[t], total_freed += alloc_profile_freed[t];
+  qsort(sites, n_sites, sizeof(alloc_profile_site *), alloc_profile_by_words_allocated);
+  fprintf(f, "{\"allocated\": %lu, \"reused\": %lu, \"freed\": %lu, \"increments\": %lu, \"decrements\": %lu, "
+             "\"live_bytes\": %ld, \"peak_live_bytes\": %ld,\n \"tags\": [", total_allocated, total_reused,
+          total_freed, alloc_profile_increments, alloc_profile_decrements, 8 * alloc_profile_live_words,
+          8 * alloc_profile_peak_words);
+  const char *sep = "";
+  for (size_t t = 0; t < ALLOC_PROFILE_TAGS; ++t) {
+    if (!allocated[t] && !reused[t] && !alloc_profile_freed[t] && !alloc_profile_overwritten[t])continue;
+    fprintf(f, "%s\n  {\"tag\": %zu, \"allocated\": %lu, \"runtime_allocated\": %lu, \"reused\": %lu, \"freed\": %lu, "
+               "\"overwritten\": %lu}", sep, t, allocated[t], alloc_profile_runtime_allocated[t], reused[t],
+            alloc_profile_freed[t], alloc_profile_overwritten[t]);
+    sep = ",";
+  }
+  fprintf(f, "],\n \"sites\": [");
+  sep = "";
+  for (uint64_t k = 0; k < n_sites; ++k) {
+    if (!sites[k]->allocated && !sites[k]->reused)continue;
+    fprintf(f, "%s\n  {\"location\": ", sep);
+    alloc_profile_print_string(f, sites[k]->location);
+    fprintf(f, ", \"kind\": ");
+    alloc_profile_print_string(f, sites[k]->kind);
+    fprintf(f, ", \"tag\": %lu, \"bytes\": %lu, \"allocated\": %lu, \"reused\": %lu}", sites[k]->tag,
+            8 * sites[k]->words, sites[k]->allocated, sites[k]->reused);
+    sep = ",";
+  }
+  fprintf(f, "]}\n");
+  free(sites);
+}
+
+// a program compiled without -profile gets no report: its counts would be partial
+static void alloc_profile_print_at_exit() {
+  if (!&alloc_profile_n_sites)return;
+  const char *path = getenv("BML_PROFILE");
+  FILE *f = path ? fopen(path, "w") : stderr;
+  if (!f) {
+    perror("alloc profile: fopen");
+    return;
+  }
+  alloc_profile_print(f);
+  if (f != stderr)fclose(f);
+}
+#endif
+
+// what is still queued at exit is reclaimed, so that its destructors run (and it's not counted as live)
+static void lazy_free_drain_at_exit() {
+  lazy_free_steps(SIZE_MAX);
+}
+
+// set BML_ALLOC_STATS in the environment to get the allocator counters on stderr at exit, BML_LAZY_FREE to turn on
+// the lazy mode of destruction
+__attribute__((constructor)) static void fast_malloc_setup() {
+#ifdef ALLOC_PROFILE
+  atexit(alloc_profile_print_at_exit); // registered first, run last
+#endif
+  if (getenv("BML_ALLOC_STATS"))atexit(fast_malloc_print_stats_at_exit);
+  const char *lazy_free_steps_env = getenv("BML_LAZY_FREE");
+  if (lazy_free_steps_env) {
+    lazy_free_budget = strtoul(lazy_free_steps_env, NULL, 10);
+    if (!lazy_free_budget)lazy_free_budget = LAZY_FREE_DEFAULT_STEPS;
+    atexit(lazy_free_drain_at_exit); // registered last, run first
+  }
+}
+
 typedef uintptr_t (*text_ptr)(uintptr_t);
 
-uintptr_t apply_fn(uintptr_t f, uintptr_t x) {
+// PARTIAL APPLICATIONS
+// A partial application is a flat Tag_Arg block [header, f, n_args_left, x_1, ..., x_k]: f is always the Tag_Fun
+// block, and the supplied args are stored contiguously. Once the last arg is supplied, the block is passed to the text
+// of f, which reads arg i at [3 + i] and its captures through [1], with no chain to walk.
+// Arg blocks are allocated with room for all the args of f, so that a non-shared one is extended in place.
 
-  const uintptr_t *fb = (uintptr_t *) f;
-  uintptr_t *n = (uintptr_t *) malloc(8 * 5);
-  n[0] = uint_to_v(1);
-  n[1] = (uintptr_t) make_tag_size_d(Tag_Arg, 3, 0);
-  n[2] = f;
-  n[3] = uint_to_v(v_to_uint(fb[3]) - 1);
-  n[4] = x;
-  if (v_to_uint(fb[3]) != 1)return (uintptr_t) n;
-  while (get_tag(fb[1]) != Tag_Fun) {
-    fb = (uintptr_t *) fb[2];
+uintptr_t increment_value(uintptr_t x);
+void decrement_value(uintptr_t x);
+
+// returns the partial application f x, consuming both
+uintptr_t *apply_fn_pap(uintptr_t f, uintptr_t x) {
+  uintptr_t *fb = (uintptr_t *) f;
+  if (get_tag(fb[0]) == Tag_Fun) {
+    const uint64_t n_args = v_to_uint(fb[2]);
+    uintptr_t *n = fast_malloc(3 + n_args);
+#ifdef ALLOC_PROFILE
+    alloc_profile_runtime_allocation(Tag_Arg, 3 + n_args);
+#endif
+    n[0] = (uintptr_t) make_header(Tag_Arg, 3, 0, uint_to_v(1));
+    n[1] = f;
+    n[2] = uint_to_v(n_args - 1);
+    n[3] = x;
+    return n;
+  }
+  const uint32_t size = get_size(fb[0]);
+  if (get_refcount(fb[0]) == uint_to_v(1)) {
+    //f is not shared: fill its next slot
+    fb[0] = (uintptr_t) make_header(Tag_Arg, size + 1, 0, uint_to_v(1));
+    fb[2] -= 2; // one arg less
+    fb[size + 1] = x;
+    return fb;
   }
+  uintptr_t *n = fast_malloc(1 + size + v_to_uint(fb[2]));
+#ifdef ALLOC_PROFILE
+  alloc_profile_runtime_allocation(Tag_Arg, 1 + size + v_to_uint(fb[2]));
+#endif
+  n[0] = (uintptr_t) make_header(Tag_Arg, size + 1, 0, uint_to_v(1));
+  n[1] = increment_value(fb[1]);
+  n[2] = fb[2] - 2;
+  for (uint32_t i = 3; i < size + 1; ++i)n[i] = increment_value(fb[i]);
+  n[size + 1] = x;
+  decrement_value(f);
+  return n;
+}
+
 #ifdef DEBUG_JSON
+uintptr_t apply_fn(uintptr_t f, uintptr_t x) {
+  uintptr_t *n = apply_fn_pap(f, x);
+  if (n[2] != uint_to_v(0))return (uintptr_t) n;
+  const uintptr_t *fb = (uintptr_t *) n[1];
   static int indent = 0;
   for(int i=0;i<indent;++i) fputs("  ", debug_stream);
   fputs("calling = ", debug_stream);
   json_debug((uintptr_t) n);
   fputs("\n", debug_stream);
   ++indent;
-#endif
-  uintptr_t result = ((text_ptr) fb[2])((uintptr_t) n);
-#ifdef DEBUG_JSON
+  uintptr_t result = ((text_ptr) fb[1])((uintptr_t) n);
   --indent;
   for(int i=0;i<indent;++i) fputs("  ", debug_stream);
   fputs("returned ", debug_stream);
   json_debug(result);
   fputs("\n", debug_stream);
-#endif
   return result;
 
 }
+#else
+// apply_fn(f, x): same as the C version above, but once the last arg is supplied it jumps into the function's text
+// instead of calling it, so that tail calls through apply_fn run in constant stack.
+// Only copying a shared partial application is left to apply_fn_pap.
+uintptr_t apply_fn(uintptr_t f, uintptr_t x);
+__asm__(
+    ".intel_syntax noprefix\n"
+    ".text\n"
+    ".globl apply_fn\n"
+    ".type apply_fn, @function\n"
+    "apply_fn:\n"
+    "  cmp word ptr [rdi+6], 1\n" // is f a Tag_Fun block?
+    "  jne .Lapply_fn_extend\n"
+#ifdef ALLOC_PROFILE
+    "  jmp .Lapply_fn_copy\n" // apply_fn_pap counts the allocation
+#endif
+    "  mov rdx, qword ptr [rdi+16]\n"
+    "  shr rdx, 1\n"
+    "  add rdx, 3\n" // words for an Arg block with all the args of f
+    "  cmp rdx, 16\n" // FAST_MALLOC_MAX_WORDS
+    "  ja .Lapply_fn_refill\n"
+    "  lea rcx, [rip+fast_malloc_free_list]\n"
+    "  mov rax, qword ptr [rcx+8*rdx]\n" // pop a block of that size
+    "  test rax, rax\n"
+    "  jz .Lapply_fn_refill\n"
+    "  mov r8, qword ptr [rax]\n"
+    "  mov qword ptr [rcx+8*rdx], r8\n"
+    ".Lapply_fn_allocated:\n"
+    "  movabs rdx, 562975723225091\n" // make_header(Tag_Arg, 3, 0, refcount 1)
+    "  mov qword ptr [rax], rdx\n"
+    "  mov qword ptr [rax+8], rdi\n"
+    "  mov rdx, qword ptr [rdi+16]\n"
+    "  sub rdx, 2\n" // one arg less
+    "  mov qword ptr [rax+16], rdx\n"
+    "  mov qword ptr [rax+24], rsi\n"
+    "  cmp rdx, 1\n"
+    "  jne .Lapply_fn_partial\n"
+    "  mov rdx, qword ptr [rdi+8]\n"
+    "  mov rdi, rax\n"
+    "  jmp rdx\n"
+    ".Lapply_fn_partial:\n"
+    "  ret\n"
+    ".Lapply_fn_refill:\n"
+    "  push rdi\n"
+    "  push rsi\n"
+    "  sub rsp, 8\n"
+    "  mov rdi, rdx\n"
+    "  call fast_malloc\n"
+    "  add rsp, 8\n"
+    "  pop rsi\n"
+    "  pop rdi\n"
+    "  jmp .Lapply_fn_allocated\n"
+    ".Lapply_fn_extend:\n"
+    "  cmp dword ptr [rdi], 3\n" // shared (or static) partial application?
+    "  jne .Lapply_fn_copy\n"
+    "  movzx eax, word ptr [rdi+4]\n"
+    "  shr eax, 1\n" // size
+    "  mov qword ptr [rdi+8*rax+8], rsi\n"
+    "  add word ptr [rdi+4], 2\n" // size + 1
+    "  mov rax, rdi\n"
+    "  sub qword ptr [rax+16], 2\n" // one arg less
+    "  jmp .Lapply_fn_check\n"
+    ".Lapply_fn_copy:\n"
+    "  sub rsp, 8\n"
+    "  call apply_fn_pap\n"
+    "  add rsp, 8\n"
+    ".Lapply_fn_check:\n"
+    "  cmp qword ptr [rax+16], 1\n"
+    "  jne .Lapply_fn_partial\n"
+    "  mov rdx, qword ptr [rax+8]\n"
+    "  mov rdi, rax\n"
+    "  jmp qword ptr [rdx+8]\n"
+    ".size apply_fn, .-apply_fn\n"
+    ".att_syntax prefix\n"
+    );
+#endif
 
 void decrement_value(uintptr_t x);//partially_inlined
 void decrement_trivial(uintptr_t x) {}//inlined
@@ -258,87 +635,245 @@ void decrement_value(uintptr_t x) { //partially inlined
 void decrement_boxed(uintptr_t x) { //partially inlined
   assert((x & 0) == 0);
   uintptr_t *xb = (uintptr_t *) x;
-  if (*xb == 0)return; // rule out global
+  if (get_refcount(*xb) == 0)return; // rule out global
   decrement_nontrivial(x);
 }
 
 void decrement_nonglobal(uintptr_t x) { //partially inlined
   if (x & 1)return; // rule out unboxed
-  assert(*(uintptr_t *) x);
+  assert(get_refcount(*(uintptr_t *) x));
   decrement_nontrivial(x);
 }
 
 void decrement_nontrivial(uintptr_t x) {
   assert((x & 0) == 0);
   uintptr_t *xb = (uintptr_t *) x;
-  assert(*xb);
-  (*xb) -= 2;
+  assert(get_refcount(*xb));
+  (*xb) -= 2; // the refcount is odd, no borrow into the upper half
+#ifdef ALLOC_PROFILE
+  ++alloc_profile_decrements;
+#endif
 #ifdef DEBUG_JSON
   //fprintf(debug_stream, "decrementing [%p] to %lu\n", xb, (*xb) >> 1);
 #endif
 #ifdef DEBUG_LOG
-  fprintf(stderr,"decrement block 0x%016" PRIxPTR " to %lu\n", x, v_to_uint(*xb));
+  fprintf(stderr,"decrement block 0x%016" PRIxPTR " to %u\n", x, get_refcount(*xb) >> 1);
 #endif
-  if (*xb != 1)return;
+  if (get_refcount(*xb) != 1)return;
   destroy_nontrivial(x);
 }
 
 uintptr_t increment_value(uintptr_t x) {
   if (x & 1)return x;
   uintptr_t *xb = (uintptr_t *) x;
-  if (*xb == 0)return x;
+  if (get_refcount(*xb) == 0)return x;
   (*xb) += 2;
+#ifdef ALLOC_PROFILE
+  ++alloc_profile_increments;
+#endif
 #ifdef DEBUG_JSON
   //fprintf(debug_stream, "incrementing [%p] to %lu\n", xb, (*xb) >> 1);
 #endif
 #ifdef DEBUG_LOG
-  fprintf(stderr,"increment block 0x%016" PRIxPTR " to %lu\n", x, v_to_uint(*xb));
+  fprintf(stderr,"increment block 0x%016" PRIxPTR " to %u\n", x, get_refcount(*xb) >> 1);
 #endif
   return x;
 }
 
-void destroy_nontrivial(uintptr_t x_v) {
-  uintptr_t *x = (uintptr_t *) x_v;
-#ifdef DEBUG_JSON
-  //fprintf(debug_stream, "destroying [%p] = ", x);
-  //json_debug(x_v);
-  //fprintf(debug_stream, "\n");
+// DESTRUCTION
+// Dropping a block frees what is only reachable from it without recursing on the C stack. The dead blocks whose
+// fields are still to be dropped form a worklist threaded through their field 1, whose content is taken out into a
+// single carry slot when the block is entered; the index of the next field to drop is kept in the refcount dword, which
+// a dead block no longer needs. The carry is dropped before anything else, so it is always empty when a block is
+// entered, and a block is freed as soon as its last field is taken: lists and other right-leaning structures are
+// freed in constant space, left-leaning ones keep a chain of dead blocks rather than of stack frames.
+// With BML_LAZY_FREE=n in the environment the dropped blocks are only queued, and the allocator reclaims them n steps
+// at a time (a step drops a single field) whenever it's called, i.e. whenever a size class free list runs dry, so that
+// a single drop takes constant time. Their destructors run late then, from the allocation that reclaims them.
+typedef struct {
+  uintptr_t *top; // the last entered block, linked to the previous ones through field 1
+  uintptr_t carry; // the content of the field 1 of the last entered block, 1 once dropped
+} free_worklist;
+
+static free_worklist lazy_free = {.top = NULL, .carry = 1};
+// the blocks dropped in the lazy mode, still to be entered: one for each call to destroy_nontrivial
+static uintptr_t **lazy_free_roots = NULL;
+static size_t lazy_free_roots_size = 0, lazy_free_roots_capacity = 0;
+static bool lazy_free_running = false;
+
+// drops a reference to x, true if it was the last one
+static bool drop_is_last(uintptr_t x) {
+  if (x & 1)return false;
+  uintptr_t *xb = (uintptr_t *) x;
+  if (get_refcount(*xb) == 0)return false;
+  *xb -= 2;
+#ifdef ALLOC_PROFILE
+  ++alloc_profile_decrements;
 #endif
+  return get_refcount(*xb) == 1;
+}
 
-  //get size, tag, d.
-  //assert(x[0] == 1);
-  uint32_t tag = get_tag(x[1]);
-  uint32_t size = get_size(x[1]);
-  uint8_t d = get_d(x[1]);
-  if (d) {
-    x[0] = 3; //refcount:=1
-    x[1] ^= 1; // d:=0
-    uintptr_t f = x[size + 2];
-    uintptr_t y = apply_fn(f, (uintptr_t) x);
-    decrement_value(y);
-    return;
-  } else {
+static void free_block(uintptr_t *x) {
 #ifdef DEBUG_LOG
-    fprintf(stderr,"destroying block of size %u at 0x%016" PRIxPTR "\n", size, x_v);
+  fprintf(stderr,"destroying block of size %u at 0x%016" PRIxPTR "\n", get_size(x[0]), (uintptr_t) x);
 #endif
-    const uintptr_t *xloop = x;
-    xloop += 2;
-    if (tag == Tag_String) {
-      xloop += size;
-      size = 0;
-    } else if (tag == Tag_Fun) {
-      ++xloop;
-      --size;
-    }
-    while (size--) {
-      decrement_value(*xloop);
-      ++xloop;
+#ifdef ALLOC_PROFILE
+  alloc_profile_free(x);
+#endif
+  fast_free(x, block_words(x));
+}
+
+// the destructor slot of a block whose destructor has run: the block keeps its d bit, so that it is freed with its
+// slot, into the class it was allocated from
+#define DESTRUCTOR_RAN 1
+
+// true if x has a destructor still to run
+static bool has_destructor(const uintptr_t *x) {
+  return get_d(x[0]) && x[get_size(x[0]) + 1] != DESTRUCTOR_RAN;
+}
+
+// the destructor takes over the block, as if it had a reference to it
+static void run_destructor(uintptr_t *x) {
+  const uint32_t size = get_size(x[0]);
+  x[0] = make_header(get_tag(x[0]), size, 1, 3); //refcount:=1
+  uintptr_t f = x[size + 1];
+  x[size + 1] = DESTRUCTOR_RAN;
+  decrement_value(apply_fn(f, (uintptr_t) x));
+}
+
+// takes a dead block into the worklist, whose carry is empty
+static void free_enter(free_worklist *w, uintptr_t *x) {
+  assert(w->carry == 1);
+  if (has_destructor(x)) {
+    run_destructor(x);
+    return;
+  }
+  const uint32_t tag = get_tag(x[0]), size = get_size(x[0]);
+  if (tag == Tag_String || size == 0) {
+    free_block(x);
+    return;
+  }
+  //the text pointer of a Fun block is not a value, its captures start after the number of args
+  const uint32_t first = tag == Tag_Fun ? 3 : 2;
+  if (tag != Tag_Fun)w->carry = x[1];
+  if (first > size) {
+    free_block(x);
+    return;
+  }
+  x[0] = make_header(tag, size, get_d(x[0]), first);
+  x[1] = (uintptr_t) w->top;
+  w->top = x;
+}
+
+// drops the carry, or the next field of the last entered block; false once there's nothing left
+static bool free_step(free_worklist *w) {
+  if (w->carry != 1) {
+    const uintptr_t c = w->carry;
+    w->carry = 1;
+    if (drop_is_last(c))free_enter(w, (uintptr_t *) c);
+    return true;
+  }
+  uintptr_t *y = w->top;
+  if (!y)return false;
+  const uint32_t i = get_refcount(y[0]);
+  const uintptr_t c = y[i];
+  if (i == get_size(y[0])) {
+    w->top = (uintptr_t *) y[1];
+    free_block(y);
+  } else ++y[0]; // next field
+  if (drop_is_last(c))free_enter(w, (uintptr_t *) c);
+  return true;
+}
+
+static void lazy_free_push(uintptr_t *x) {
+  if (lazy_free_roots_size == lazy_free_roots_capacity) {
+    lazy_free_roots_capacity = lazy_free_roots_capacity ? 2 * lazy_free_roots_capacity : 1024;
+    lazy_free_roots = (uintptr_t **) realloc(lazy_free_roots, lazy_free_roots_capacity * sizeof(uintptr_t *));
+    if (!lazy_free_roots) {
+      perror("lazy free: realloc");
+      exit(1);
     }
-    if(x[0])free(x); // cheap trick to use same code for globals
-    //TODO: consider if you want to do something nicer
   }
+  lazy_free_roots[lazy_free_roots_size++] = x;
+}
+
+static void lazy_free_steps(size_t steps) {
+  if (lazy_free_running)return; // a destructor run by a step is allocating
+  lazy_free_running = true;
+  for (; steps > 0; --steps) {
+    if (free_step(&lazy_free))continue;
+    if (!lazy_free_roots_size)break;
+    free_enter(&lazy_free, lazy_free_roots[--lazy_free_roots_size]);
+  }
+  lazy_free_running = false;
+}
+
+void destroy_nontrivial(uintptr_t x_v) {
+  uintptr_t *x = (uintptr_t *) x_v;
+  if (has_destructor(x)) {
+    run_destructor(x);
+    return;
+  }
+  if (get_refcount(x[0]) == 0) {
+    //a static block, e.g. a global at exit: only its fields are dropped
+    const uint32_t tag = get_tag(x[0]), size = get_size(x[0]);
+    if (tag == Tag_String)return;
+    for (uint32_t i = tag == Tag_Fun ? 3 : 1; i <= size; ++i)
+      if (drop_is_last(x[i]))destroy_nontrivial(x[i]);
+    return;
+  }
+  if (lazy_free_budget) {
+    lazy_free_push(x);
+    return;
+  }
+  free_worklist w = {.top = NULL, .carry = 1};
+  free_enter(&w, x);
+  while (free_step(&w));
 }
 
+// REGISTER-PRESERVING ENTRY POINTS
+// Called by the generated code on the slow paths of allocation and destruction. They take their argument in r11,
+// return (if anything) in rax, and preserve every other register, so the caller doesn't have to save anything but
+// r11 (see reg::runtime_scratch in ir.h). They also realign the stack themselves.
+#define PRESERVE_VOLATILES_PUSH "  push rcx\n  push rdx\n  push rsi\n  push rdi\n  push r8\n  push r9\n  push r10\n"
+#define PRESERVE_VOLATILES_POP "  pop r10\n  pop r9\n  pop r8\n  pop rdi\n  pop rsi\n  pop rdx\n  pop rcx\n"
+__asm__(
+    ".intel_syntax noprefix\n"
+    ".text\n"
+    ".globl fast_malloc_preserving\n"
+    ".type fast_malloc_preserving, @function\n"
+    "fast_malloc_preserving:\n" // r11: words, rax: the block
+    "  push rbp\n"
+    "  mov rbp, rsp\n"
+    "  and rsp, -16\n"
+    "  sub rsp, 8\n"
+    PRESERVE_VOLATILES_PUSH
+    "  mov rdi, r11\n"
+    "  call fast_malloc\n"
+    PRESERVE_VOLATILES_POP
+    "  mov rsp, rbp\n"
+    "  pop rbp\n"
+    "  ret\n"
+    ".size fast_malloc_preserving, .-fast_malloc_preserving\n"
+    ".globl destroy_nontrivial_preserving\n"
+    ".type destroy_nontrivial_preserving, @function\n"
+    "destroy_nontrivial_preserving:\n" // r11: a block whose refcount dropped to 0
+    "  push rbp\n"
+    "  mov rbp, rsp\n"
+    "  and rsp, -16\n"
+    "  push rax\n"
+    PRESERVE_VOLATILES_PUSH
+    "  mov rdi, r11\n"
+    "  call destroy_nontrivial\n"
+    PRESERVE_VOLATILES_POP
+    "  pop rax\n"
+    "  mov rsp, rbp\n"
+    "  pop rbp\n"
+    "  ret\n"
+    ".size destroy_nontrivial_preserving, .-destroy_nontrivial_preserving\n"
+    ".att_syntax prefix\n"
+    );
+
 uintptr_t match_failed_fun(uintptr_t unit) {
   fputs("match failed\n", stderr);
   exit(1);
@@ -348,123 +883,111 @@ uintptr_t match_failed_fun(uintptr_t unit) {
 //LIBRARY FUNCTIONS have signature _mllib_fn__...
 
 uintptr_t _mllib_fn__int_add(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   return int_to_v(a + b);
 }
 
 uintptr_t _mllib_fn__int_sub(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   return int_to_v(a - b);
 }
 
 uintptr_t _mllib_fn__int_mul(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   return int_to_v(a * b);
 }
 
 uintptr_t _mllib_fn__int_div(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   return int_to_v(a / b);
 }
 
 uintptr_t _mllib_fn__int_neg(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
+  int64_t b = v_to_int(argv_b[3]);
   decrement_boxed(argv);
   return int_to_v(-b);
 }
 
 uintptr_t _mllib_fn__int_eq(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  uint64_t b = v_to_uint(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  uint64_t a = v_to_uint(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  uint64_t a = v_to_uint(args[3]);
+  uint64_t b = v_to_uint(args[4]);
+  decrement_boxed(argv);
   return uint_to_v(a == b ? 1 : 0);
 }
 
+uintptr_t _mllib_fn__int_neq(uintptr_t argv) {
+  const uintptr_t *args = (const uintptr_t *) argv;
+  uint64_t a = v_to_uint(args[3]);
+  uint64_t b = v_to_uint(args[4]);
+  decrement_boxed(argv);
+  return uint_to_v(a != b ? 1 : 0);
+}
+
 uintptr_t _mllib_fn__t_phys_eq(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  uintptr_t b_v = argv_b[4];
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  uintptr_t a_v = argv_a[4];
+  const uintptr_t *args = (const uintptr_t *) argv;
+  uintptr_t a_v = args[3];
+  uintptr_t b_v = args[4];
   decrement_value(argv);
   return uint_to_v(a_v == b_v ? 1 : 0);
 }
 
+uintptr_t _mllib_fn__t_phys_neq(uintptr_t argv) {
+  const uintptr_t *args = (const uintptr_t *) argv;
+  uintptr_t a_v = args[3];
+  uintptr_t b_v = args[4];
+  decrement_value(argv);
+  return uint_to_v(a_v != b_v ? 1 : 0);
+}
+
 uintptr_t _mllib_fn__int_lt(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   return uint_to_v(a < b ? 1 : 0);
 }
 
 uintptr_t _mllib_fn__int_leq(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   return uint_to_v(a <= b ? 1 : 0);
 }
 
 uintptr_t _mllib_fn__int_gt(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   return uint_to_v(a > b ? 1 : 0);
 }
 
 uintptr_t _mllib_fn__int_geq(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   return uint_to_v(a >= b ? 1 : 0);
 }
 
 uintptr_t _mllib_fn__int_println(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
+  int64_t b = v_to_int(argv_b[3]);
   printf("%ld\n", b);
   decrement_boxed(argv);
   return uint_to_v(0);
@@ -472,7 +995,7 @@ uintptr_t _mllib_fn__int_println(uintptr_t argv) {
 
 uintptr_t _mllib_fn__bool_println(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
+  int64_t b = v_to_int(argv_b[3]);
   if (b)printf("true\n");
   else printf("false\n");
   decrement_boxed(argv);
@@ -481,7 +1004,7 @@ uintptr_t _mllib_fn__bool_println(uintptr_t argv) {
 
 uintptr_t _mllib_fn__bool_print(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
+  int64_t b = v_to_int(argv_b[3]);
   if (b)printf("true ");
   else printf("false ");
   decrement_boxed(argv);
@@ -489,32 +1012,26 @@ uintptr_t _mllib_fn__bool_print(uintptr_t argv) {
 }
 
 uintptr_t _mllib_fn__int_fprintln(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   dprintf(a, "%ld\n", b);
   return uint_to_v(0);
 }
 
 uintptr_t _mllib_fn__int_fprint(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
-  uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  increment_value((uintptr_t) argv_a);
-  decrement_value((uintptr_t) argv_b);
-  int64_t a = v_to_int(argv_a[4]);
-  decrement_value((uintptr_t) argv_a);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int64_t a = v_to_int(args[3]);
+  int64_t b = v_to_int(args[4]);
+  decrement_boxed(argv);
   dprintf(a, "%ld ", b);
   return uint_to_v(0);
 }
 
 uintptr_t _mllib_fn__int_print(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  int64_t b = v_to_int(argv_b[4]);
+  int64_t b = v_to_int(argv_b[3]);
   printf("%ld ", b);
   fflush(stdout);
   decrement_boxed(argv);
@@ -523,7 +1040,7 @@ uintptr_t _mllib_fn__int_print(uintptr_t argv) {
 
 uintptr_t _mllib_fn__chr_print(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  int8_t b = v_to_int(argv_b[4]);
+  int8_t b = v_to_int(argv_b[3]);
   printf("%c", b);
   fflush(stdout);
   decrement_boxed(argv);
@@ -544,22 +1061,25 @@ uintptr_t deep_copy(uintptr_t x) {
   if (x & 1)return x;
   if (x == 0)return x;
   const uintptr_t *v = (const uintptr_t *) x;
-  if (v[0] == 0)return x;
-  uint32_t tag = get_tag(v[1]);
-  uint32_t size = get_size(v[1]);
-  uint8_t d = get_d(v[1]);
-  uintptr_t *new_x = (uintptr_t *) malloc(8 * (2 + size + d));
-  new_x[0] = 3;
-  new_x[1] = v[1];
-  new_x[2] = (tag == Tag_Fun) ? v[2] : deep_copy(v[2]);
-  for (int i = 1; i < size; ++i)new_x[i + 2] = deep_copy(v[i + 2]);
-  if (d)new_x[size + 2] = deep_copy(v[size + 2]);
+  if (get_refcount(v[0]) == 0)return x;
+  uint32_t tag = get_tag(v[0]);
+  uint32_t size = get_size(v[0]);
+  uint8_t d = get_d(v[0]);
+  //Arg blocks have room for the args still to be supplied
+  uintptr_t *new_x = fast_malloc(1 + size + d + (tag == Tag_Arg ? v_to_uint(v[2]) : 0));
+#ifdef ALLOC_PROFILE
+  alloc_profile_runtime_allocation(tag, 1 + size + d + (tag == Tag_Arg ? v_to_uint(v[2]) : 0));
+#endif
+  new_x[0] = make_header(tag, size, d, 3);
+  new_x[1] = (tag == Tag_Fun) ? v[1] : deep_copy(v[1]);
+  for (int i = 1; i < size; ++i)new_x[i + 1] = deep_copy(v[i + 1]);
+  if (d)new_x[size + 1] = deep_copy(v[size + 1]);
   return (uintptr_t) new_x;
 }
 
 uintptr_t _mllib_fn__t_deep_copy(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  uintptr_t x = argv_b[4];
+  uintptr_t x = argv_b[3];
   x = deep_copy(x);
   decrement_boxed(argv);
   return x;
@@ -567,7 +1087,7 @@ uintptr_t _mllib_fn__t_deep_copy(uintptr_t argv) {
 
 uintptr_t _mllib_fn__time_print(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  time_t x = (time_t) (v_to_int(argv_b[4]));
+  time_t x = (time_t) (v_to_int(argv_b[3]));
   const char *c_time_string = ctime(&x);
   printf("%s", c_time_string);
   decrement_boxed(argv);
@@ -575,10 +1095,9 @@ uintptr_t _mllib_fn__time_print(uintptr_t argv) {
 }
 
 uintptr_t _mllib_fn__time_fprint(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  const uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  int fd = v_to_int(argv_a[4]);
-  time_t t = (time_t) (v_to_int(argv_b[4]));
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int fd = v_to_int(args[3]);
+  time_t t = (time_t) (v_to_int(args[4]));
   const char *c_time_string = ctime(&t);
   dprintf(fd, "%s", c_time_string);
   decrement_boxed(argv);
@@ -587,8 +1106,8 @@ uintptr_t _mllib_fn__time_fprint(uintptr_t argv) {
 
 uintptr_t _mllib_fn__str_print(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  uintptr_t *b = (uintptr_t *) argv_b[4];
-  const char *s = (const char *) (b + 2);
+  uintptr_t *b = (uintptr_t *) argv_b[3];
+  const char *s = (const char *) (b + 1);
   fputs(s, stdout);
   fflush(stdout);
   decrement_boxed(argv);
@@ -596,11 +1115,10 @@ uintptr_t _mllib_fn__str_print(uintptr_t argv) {
 }
 
 uintptr_t _mllib_fn__str_fprint(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  const uintptr_t *b = (uintptr_t *) argv_b[4];
-  const uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  int fd = v_to_int(argv_a[4]);
-  const char *s = (const char *) (b + 2);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  int fd = v_to_int(args[3]);
+  const uintptr_t *b = (uintptr_t *) args[4];
+  const char *s = (const char *) (b + 1);
   size_t len = strlen(s);
   assert(write(fd, s, len) == len);
   decrement_boxed(argv);
@@ -609,20 +1127,19 @@ uintptr_t _mllib_fn__str_fprint(uintptr_t argv) {
 
 uintptr_t _mllib_fn__str_length(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  uintptr_t *b = (uintptr_t *) argv_b[4];
-  size_t len = get_size(b[1]) * 8;
-  const char *s = (const char *) (b + 2);
+  uintptr_t *b = (uintptr_t *) argv_b[3];
+  size_t len = get_size(b[0]) * 8;
+  const char *s = (const char *) (b + 1);
   while (len > 0 && s[len - 1] == 0)--len;
   decrement_boxed(argv);
   return int_to_v(len);
 }
 
 uintptr_t _mllib_fn__str_at(uintptr_t argv) {
-  const uintptr_t *argv_b = (uintptr_t *) argv;
-  const uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  const uintptr_t *s_v = (uintptr_t *) argv_a[4];
-  const int64_t idx = v_to_int(argv_b[4]);
-  const char *s = (const char *) (s_v + 2);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  const uintptr_t *s_v = (uintptr_t *) args[3];
+  const int64_t idx = v_to_int(args[4]);
+  const char *s = (const char *) (s_v + 1);
   char c = s[idx];
   decrement_boxed(argv);
   return int_to_v(c);
@@ -630,7 +1147,7 @@ uintptr_t _mllib_fn__str_at(uintptr_t argv) {
 
 uintptr_t _mllib_fn__fclose(uintptr_t argv) {
   uintptr_t *argv_b = (uintptr_t *) argv;
-  int fd = v_to_int(argv_b[4]);
+  int fd = v_to_int(argv_b[3]);
   if (close(fd)) {
     perror("closing file");
     exit(1);
@@ -640,10 +1157,9 @@ uintptr_t _mllib_fn__fclose(uintptr_t argv) {
 }
 
 uintptr_t _mllib_fn__fopen(uintptr_t argv) {
-  uintptr_t *argv_b = (uintptr_t *) argv;
-  const uintptr_t *argv_a = (uintptr_t *) argv_b[2];
-  const char *path = (const char *) ((uintptr_t *) (argv_a[4]) + 2);
-  const char *mode = (const char *) ((uintptr_t *) (argv_b[4]) + 2);
+  const uintptr_t *args = (const uintptr_t *) argv;
+  const char *path = (const char *) ((uintptr_t *) (args[3]) + 1);
+  const char *mode = (const char *) ((uintptr_t *) (args[4]) + 1);
   int flag = 0;
   bool r = false, w = false;
   for (const char *c = mode; *c; ++c) {